@@ -15,6 +15,7 @@
 #include <stdint.h>
 #include <string.h>
 #include "image.h"
+#include "stream.h"
 
 #define NO_ERROR      0 /**< エラー無し */
 #define ERROR         1 /**< エラー */
@@ -126,23 +127,25 @@ static void bs_write32(bs_t *bs, uint32_t data);
 
 static void set_default_color_masks(uint16_t bit_count, channel_mask *cmasks);
 static void read_color_masks(uint32_t *masks, channel_mask *cmasks);
-static result_t read_file_header(FILE *fp, bmp_header_t *header);
-static result_t read_info_header(FILE *fp, bmp_header_t *header);
-static result_t read_palette(FILE *fp, bmp_header_t *header, image_t *img);
-static result_t read_bitmap_32(FILE *fp, bmp_header_t *header, int stride, image_t *img);
-static result_t read_bitmap_24(FILE *fp, bmp_header_t *header, int stride, image_t *img);
-static result_t read_bitmap_16(FILE *fp, bmp_header_t *header, int stride, image_t *img);
-static result_t read_bitmap_index(FILE *fp, bmp_header_t *header, int stride, image_t *img);
-static result_t read_bitmap_rle(FILE *fp, bmp_header_t *header, int stride, image_t *img);
-static result_t read_bitmap(FILE *fp, bmp_header_t *header, image_t *img);
+static result_t read_file_header(stream_t *s, bmp_header_t *header);
+static result_t read_info_header(stream_t *s, bmp_header_t *header);
+static result_t read_palette(stream_t *s, bmp_header_t *header, image_t *img);
+static result_t read_bitmap_32(stream_t *s, bmp_header_t *header, int stride, image_t *img);
+static result_t read_bitmap_24(stream_t *s, bmp_header_t *header, int stride, image_t *img);
+static result_t read_bitmap_16(stream_t *s, bmp_header_t *header, int stride, image_t *img);
+static result_t read_bitmap_index(stream_t *s, bmp_header_t *header, int stride, image_t *img);
+static result_t read_bitmap_rle(stream_t *s, bmp_header_t *header, int stride, image_t *img);
+static result_t read_bitmap(stream_t *s, bmp_header_t *header, image_t *img);
+static image_t *read_bmp(stream_t *s);
 
-static result_t write_header(FILE *fp, image_t *img, int bc, int image_size, int compress);
-static result_t write_palette(FILE *fp, image_t *img, int bc);
-static result_t write_bitmap_32(FILE *fp, image_t *img, int bc, int stride);
-static result_t write_bitmap_24(FILE *fp, image_t *img, int bc, int stride);
-static result_t write_bitmap_index(FILE *fp, image_t *img, int bc, int stride);
-static result_t write_bitmap_rle(FILE *fp, image_t *img, int bc, int stride);
-static result_t write_bitmap(FILE *fp, image_t *img, int bc, int compress);
+static result_t write_header(stream_t *s, image_t *img, int bc, int image_size, int compress);
+static result_t write_palette(stream_t *s, image_t *img, int bc);
+static result_t write_bitmap_32(stream_t *s, image_t *img, int bc, int stride);
+static result_t write_bitmap_24(stream_t *s, image_t *img, int bc, int stride);
+static result_t write_bitmap_index(stream_t *s, image_t *img, int bc, int stride);
+static result_t write_bitmap_rle(stream_t *s, image_t *img, int bc, int stride);
+static result_t write_bitmap(stream_t *s, image_t *img, int bc, int compress);
+static result_t write_bmp(stream_t *s, image_t *img, int compress);
 
 /**
  * @brief バイトストリームを初期化する
@@ -336,14 +339,14 @@ static void read_color_masks(uint32_t *masks, channel_mask *cmasks) {
 /**
  * @brief ファイルヘッダ読み込み
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[out] header ヘッダ情報
  * @return 成否
  */
-static result_t read_file_header(FILE *fp, bmp_header_t *header) {
+static result_t read_file_header(stream_t *s, bmp_header_t *header) {
   bs_t bs;
   uint8_t buffer[FILE_HEADER_SIZE];
-  if (fread(buffer, FILE_HEADER_SIZE, 1, fp) != 1) {
+  if (stream_read(s, buffer, FILE_HEADER_SIZE) != SUCCESS) {
     return FAILURE;
   }
   bs_init(buffer, FILE_HEADER_SIZE, &bs);
@@ -365,17 +368,17 @@ static result_t read_file_header(FILE *fp, bmp_header_t *header) {
 /**
  * @brief 情報ヘッダ読み込み
  *
- * @param[in]     fp     ファイルストリーム
+ * @param[in]     s      ストリーム
  * @param[in,out] header ヘッダ
  * @param[out]    cmasks 読み出しマスクの格納先
  * @return 成否
  */
-static result_t read_info_header(FILE *fp, bmp_header_t *header) {
+static result_t read_info_header(stream_t *s, bmp_header_t *header) {
   bs_t bs;
   uint8_t buffer[INFO_HEADER_SIZE_MAX];
   int buf_size = 4;
   // 先頭4byteを読み出す
-  if (fread(buffer, buf_size, 1, fp) != 1) {
+  if (stream_read(s, buffer, buf_size) != SUCCESS) {
     return FAILURE;
   }
   bs_init(buffer, buf_size, &bs);
@@ -384,7 +387,7 @@ static result_t read_info_header(FILE *fp, bmp_header_t *header) {
     return FAILURE;
   }
   buf_size = header->info.biSize - buf_size;
-  if (fread(buffer, buf_size, 1, fp) != 1) {
+  if (stream_read(s, buffer, buf_size) != SUCCESS) {
     return FAILURE;
   }
   bs_init(buffer, buf_size, &bs);
@@ -422,7 +425,7 @@ static result_t read_info_header(FILE *fp, bmp_header_t *header) {
         // 読み出せるビットフィールドがない
         return FAILURE;
       }
-      if (fread(buffer, buf_size, 1, fp) != 1) {
+      if (stream_read(s, buffer, buf_size) != SUCCESS) {
         return FAILURE;
       }
       bs_init(buffer, buf_size, &bs);
@@ -500,12 +503,12 @@ static result_t read_info_header(FILE *fp, bmp_header_t *header) {
 /**
  * @brief パレット情報を読み込む
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[in]  header ヘッダ情報
  * @param[out] img    画像構造体
  * @return 成否
  */
-static result_t read_palette(FILE *fp, bmp_header_t *header, image_t *img) {
+static result_t read_palette(stream_t *s, bmp_header_t *header, image_t *img) {
   int i;
   bs_t bs;
   uint8_t buffer[PALET_SIZE_MAX];
@@ -528,7 +531,7 @@ static result_t read_palette(FILE *fp, bmp_header_t *header, image_t *img) {
     palette_num = header->info.biClrUsed;
   }
   palette_size = palette_num * color_size;
-  if (fread(buffer, palette_size, 1, fp) != 1) {
+  if (stream_read(s, buffer, palette_size) != SUCCESS) {
     return FAILURE;
   }
   bs_init(buffer, palette_size, &bs);
@@ -548,14 +551,14 @@ static result_t read_palette(FILE *fp, bmp_header_t *header, image_t *img) {
 /**
  * @brief BitCount=32のビットマップ情報を読み込む
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[in]  header ヘッダ情報
  * @param[in]  stride 1行のサイズ
  * @param[out] img    画像構造体
  * @return 成否
  */
 static result_t read_bitmap_32(
-    FILE *fp, bmp_header_t *header, int stride, image_t *img) {
+    stream_t *s, bmp_header_t *header, int stride, image_t *img) {
   int x, y;
   bs_t bs;
   uint8_t *buffer;
@@ -565,7 +568,7 @@ static result_t read_bitmap_32(
     return FAILURE;
   }
   for (y = height - 1; y >= 0; y--) {
-    if (fread(buffer, stride, 1, fp) != 1) {
+    if (stream_read(s, buffer, stride) != SUCCESS) {
       free(buffer);
       return FAILURE;
     }
@@ -589,14 +592,14 @@ static result_t read_bitmap_32(
 /**
  * @brief BitCount=24のビットマップ情報を読み込む
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[in]  header ヘッダ情報
  * @param[in]  stride 1行のサイズ
  * @param[out] img    画像構造体
  * @return 成否
  */
 static result_t read_bitmap_24(
-    FILE *fp, bmp_header_t *header, int stride, image_t *img) {
+    stream_t *s, bmp_header_t *header, int stride, image_t *img) {
   int x, y;
   bs_t bs;
   uint8_t *buffer;
@@ -606,7 +609,7 @@ static result_t read_bitmap_24(
     return FAILURE;
   }
   for (y = height - 1; y >= 0; y--) {
-    if (fread(buffer, stride, 1, fp) != 1) {
+    if (stream_read(s, buffer, stride) != SUCCESS) {
       free(buffer);
       return FAILURE;
     }
@@ -625,14 +628,14 @@ static result_t read_bitmap_24(
 /**
  * @brief BitCount=16のビットマップ情報を読み込む
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[in]  header ヘッダ情報
  * @param[in]  stride 1行のサイズ
  * @param[out] img    画像構造体
  * @return 成否
  */
 static result_t read_bitmap_16(
-    FILE *fp, bmp_header_t *header, int stride, image_t *img) {
+    stream_t *s, bmp_header_t *header, int stride, image_t *img) {
   int x, y;
   bs_t bs;
   uint8_t *buffer;
@@ -642,7 +645,7 @@ static result_t read_bitmap_16(
     return FAILURE;
   }
   for (y = height - 1; y >= 0; y--) {
-    if (fread(buffer, stride, 1, fp) != 1) {
+    if (stream_read(s, buffer, stride) != SUCCESS) {
       free(buffer);
       return FAILURE;
     }
@@ -666,14 +669,14 @@ static result_t read_bitmap_16(
 /**
  * @brief インデックスカラーのビットマップ情報を読み込む
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[in]  header ヘッダ情報
  * @param[in]  stride 1行のサイズ
  * @param[out] img    画像構造体
  * @return 成否
  */
 static result_t read_bitmap_index(
-    FILE *fp, bmp_header_t *header, int stride, image_t *img) {
+    stream_t *s, bmp_header_t *header, int stride, image_t *img) {
   int x, y;
   bs_t bs;
   uint8_t *buffer;
@@ -687,7 +690,7 @@ static result_t read_bitmap_index(
   }
   for (y = height - 1; y >= 0; y--) {
     int shift = 8;
-    if (fread(buffer, stride, 1, fp) != 1) {
+    if (stream_read(s, buffer, stride) != SUCCESS) {
       free(buffer);
       return FAILURE;
     }
@@ -709,14 +712,14 @@ static result_t read_bitmap_index(
 /**
  * @brief RLE4/RLE8のビットマップ情報を読み込む
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[in]  header ヘッダ情報
  * @param[in]  stride 1行のサイズ
  * @param[out] img    画像構造体
  * @return 成否
  */
 static result_t read_bitmap_rle(
-    FILE *fp, bmp_header_t *header, int stride, image_t *img) {
+    stream_t *s, bmp_header_t *header, int stride, image_t *img) {
   int x, y, i;
   bs_t bs;
   uint8_t buffer[256];
@@ -728,7 +731,7 @@ static result_t read_bitmap_rle(
   x = 0;
   bs_init(buffer, sizeof(buffer), &bs);
   while (y >= 0 && x <= width) {
-    if (fread(buffer, 2, 1, fp) != 1) {
+    if (stream_read(s, buffer, 2) != SUCCESS) {
       return FAILURE;
     }
     if (buffer[0] != 0) {  // エンコードデータ
@@ -744,7 +747,7 @@ static result_t read_bitmap_rle(
       int shift = 8;
       int n = buffer[1];
       int c = (n * bc + 15) / 16 * 2;  // 2byte単位揃え
-      if (fread(buffer, c, 1, fp) != 1) {
+      if (stream_read(s, buffer, c) != SUCCESS) {
         return FAILURE;
       }
       bs_set_offset(&bs, 0);
@@ -759,7 +762,7 @@ static result_t read_bitmap_rle(
         }
       }
     } else if (buffer[1] == 2) {  // 移動
-      if (fread(buffer, 2, 1, fp) != 1) {
+      if (stream_read(s, buffer, 2) != SUCCESS) {
         return FAILURE;
       }
       x += buffer[0];
@@ -777,27 +780,27 @@ static result_t read_bitmap_rle(
 /**
  * @brief ビットマップ情報を読み込む
  *
- * @param[in]  fp     ファイルストリーム
+ * @param[in]  s      ストリーム
  * @param[in]  header ヘッダ情報
  * @param[out] img    画像構造体
  * @return 成否
  */
-static result_t read_bitmap(FILE *fp, bmp_header_t *header, image_t *img) {
+static result_t read_bitmap(stream_t *s, bmp_header_t *header, image_t *img) {
   int stride = (header->info.biWidth * header->info.biBitCount + 31) / 32 * 4;
   switch (header->info.biBitCount) {
     case 32:
-      return read_bitmap_32(fp, header, stride, img);
+      return read_bitmap_32(s, header, stride, img);
     case 24:
-      return read_bitmap_24(fp, header, stride, img);
+      return read_bitmap_24(s, header, stride, img);
     case 16:
-      return read_bitmap_16(fp, header, stride, img);
+      return read_bitmap_16(s, header, stride, img);
     case 8:
     case 4:
     case 1:
       if (header->info.biCompression == BI_RGB) {
-        return read_bitmap_index(fp, header, stride, img);
+        return read_bitmap_index(s, header, stride, img);
       }
-      return read_bitmap_rle(fp, header, stride, img);
+      return read_bitmap_rle(s, header, stride, img);
   }
   return FAILURE;
 }
@@ -826,13 +829,38 @@ image_t *read_bmp_file(const char *filename) {
  * @return 読み込んだ画像、読み込みに失敗した場合NULL
  */
 image_t *read_bmp_stream(FILE *fp) {
+  stream_t s;
+  stream_init_file(&s, fp);
+  return read_bmp(&s);
+}
+
+/**
+ * @brief メモリ上のBMP形式のデータを読み込む。
+ *
+ * @param[in] data BMP形式のデータ
+ * @param[in] size データのサイズ
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_bmp_memory(const uint8_t *data, size_t size) {
+  stream_t s;
+  stream_init_memory(&s, data, size);
+  return read_bmp(&s);
+}
+
+/**
+ * @brief BMP形式の画像を読み込む。
+ *
+ * @param[in] s ストリーム
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+static image_t *read_bmp(stream_t *s) {
   image_t *img = NULL;
   bmp_header_t header;
   int height;
   uint16_t color_type;
   memset(&header, 0, sizeof(header));
-  if ((read_file_header(fp, &header) != SUCCESS) ||
-      (read_info_header(fp, &header) != SUCCESS)) {
+  if ((read_file_header(s, &header) != SUCCESS) ||
+      (read_info_header(s, &header) != SUCCESS)) {
     return NULL;
   }
   if (header.info.biBitCount <= 8) {
@@ -847,14 +875,15 @@ image_t *read_bmp_stream(FILE *fp) {
     return NULL;
   }
   if (color_type == COLOR_TYPE_INDEX) {
-    if (read_palette(fp, &header, img) != SUCCESS) {
+    if (read_palette(s, &header, img) != SUCCESS) {
       goto error;
     }
   }
-  if (fseek(fp, header.file.bfOffBits, SEEK_SET) != 0) {
+  // パイプなどシークできないストリームでも読めるよう、画像データの先頭まで読み飛ばす
+  if (stream_skip_to(s, header.file.bfOffBits) != SUCCESS) {
     goto error;
   }
-  if (read_bitmap(fp, &header, img) != SUCCESS) {
+  if (read_bitmap(s, &header, img) != SUCCESS) {
     goto error;
   }
   if (header.info.biHeight < 0) {
@@ -875,7 +904,7 @@ image_t *read_bmp_stream(FILE *fp) {
 /**
  * @brief ファイルヘッダを書き出す
  *
- * @param[in] fp         ファイルストリーム
+ * @param[in] s          ストリーム
  * @param[in] img        画像データ
  * @param[in] bc         1色あたりのビット数
  * @param[in] image_size 画像サイズ
@@ -883,7 +912,7 @@ image_t *read_bmp_stream(FILE *fp) {
  * @return 成否
  */
 static result_t write_header(
-    FILE *fp, image_t *img, int bc, int image_size, int compress) {
+    stream_t *s, image_t *img, int bc, int image_size, int compress) {
   result_t result = FAILURE;
   bs_t bs;
   uint8_t *header = NULL;
@@ -945,7 +974,7 @@ static result_t write_header(
     bs_write32(&bs, 0);  // bV5ProfileSize
     bs_write32(&bs, 0);  // bV5Reserved
   }
-  if (fwrite(header, header_size, 1, fp) != 1) {
+  if (stream_write(s, header, header_size) != SUCCESS) {
     goto error;
   }
   result = SUCCESS;
@@ -956,12 +985,12 @@ static result_t write_header(
 /**
  * @brief パレット情報を書き出す
  *
- * @param[in] fp  ファイルストリーム
+ * @param[in] s   ストリーム
  * @param[in] img 画像データ
  * @param[in] bc  1色あたりのビット数
  * @return 成否
  */
-static result_t write_palette(FILE *fp, image_t *img, int bc) {
+static result_t write_palette(stream_t *s, image_t *img, int bc) {
   result_t result = FAILURE;
   bs_t bs;
   int i;
@@ -977,7 +1006,7 @@ static result_t write_palette(FILE *fp, image_t *img, int bc) {
     bs_write8(&bs, img->palette[i].r);
     bs_write8(&bs, 0);
   }
-  if (fwrite(buffer, palette_size, 1, fp) != 1) {
+  if (stream_write(s, buffer, palette_size) != SUCCESS) {
     goto error;
   }
   result = SUCCESS;
@@ -989,13 +1018,13 @@ static result_t write_palette(FILE *fp, image_t *img, int bc) {
 /**
  * @brief BitCount=32のビットマップ情報を書き出す
  *
- * @param[in] fp     ファイルストリーム
+ * @param[in] s      ストリーム
  * @param[in] img    画像データ
  * @param[in] bc     1色あたりのビット数
  * @param[in] stride 1行のサイズ
  * @return 成否
  */
-static result_t write_bitmap_32(FILE *fp, image_t *img, int bc, int stride) {
+static result_t write_bitmap_32(stream_t *s, image_t *img, int bc, int stride) {
   result_t result = FAILURE;
   int x, y;
   uint8_t *row = NULL;
@@ -1011,7 +1040,7 @@ static result_t write_bitmap_32(FILE *fp, image_t *img, int bc, int stride) {
       *work++ = img->map[y][x].c.g;
       *work++ = img->map[y][x].c.r;
     }
-    if (fwrite(row, stride, 1, fp) != 1) {
+    if (stream_write(s, row, stride) != SUCCESS) {
       goto error;
     }
   }
@@ -1024,13 +1053,13 @@ static result_t write_bitmap_32(FILE *fp, image_t *img, int bc, int stride) {
 /**
  * @brief BitCount=24のビットマップ情報を書き出す
  *
- * @param[in] fp     ファイルストリーム
+ * @param[in] s      ストリーム
  * @param[in] img    画像データ
  * @param[in] bc     1色あたりのビット数
  * @param[in] stride 1行のサイズ
  * @return 成否
  */
-static result_t write_bitmap_24(FILE *fp, image_t *img, int bc, int stride) {
+static result_t write_bitmap_24(stream_t *s, image_t *img, int bc, int stride) {
   result_t result = FAILURE;
   int x, y;
   uint8_t *row = NULL;
@@ -1045,7 +1074,7 @@ static result_t write_bitmap_24(FILE *fp, image_t *img, int bc, int stride) {
       *work++ = img->map[y][x].c.g;
       *work++ = img->map[y][x].c.r;
     }
-    if (fwrite(row, stride, 1, fp) != 1) {
+    if (stream_write(s, row, stride) != SUCCESS) {
       goto error;
     }
   }
@@ -1058,13 +1087,13 @@ static result_t write_bitmap_24(FILE *fp, image_t *img, int bc, int stride) {
 /**
  * @brief インデックスカラーのビットマップ情報を書き出す
  *
- * @param[in] fp     ファイルストリーム
+ * @param[in] s      ストリーム
  * @param[in] img    画像データ
  * @param[in] bc     1色あたりのビット数
  * @param[in] stride 1行のサイズ
  * @return 成否
  */
-static result_t write_bitmap_index(FILE *fp, image_t *img, int bc, int stride) {
+static result_t write_bitmap_index(stream_t *s, image_t *img, int bc, int stride) {
   result_t result = FAILURE;
   int x, y;
   uint8_t *row = NULL;
@@ -1088,7 +1117,7 @@ static result_t write_bitmap_index(FILE *fp, image_t *img, int bc, int stride) {
     if (shift != 8) {
       *work++ = tmp;
     }
-    if (fwrite(row, stride, 1, fp) != 1) {
+    if (stream_write(s, row, stride) != SUCCESS) {
       goto error;
     }
   }
@@ -1101,13 +1130,15 @@ static result_t write_bitmap_index(FILE *fp, image_t *img, int bc, int stride) {
 /**
  * @brief インデックスカラーのビットマップ情報をRLE形式で書き出す
  *
- * @param[in] fp     ファイルストリーム
+ * ヘッダは書き出さないため、圧縮後のサイズは書き出したサイズから求めること。
+ *
+ * @param[in] s      ストリーム
  * @param[in] img    画像データ
  * @param[in] bc     1色あたりのビット数
  * @param[in] stride 1行のサイズ
  * @return 成否
  */
-static result_t write_bitmap_rle(FILE *fp, image_t *img, int bc, int stride) {
+static result_t write_bitmap_rle(stream_t *s, image_t *img, int bc, int stride) {
   result_t result = FAILURE;
   int i;
   int x, y;
@@ -1118,13 +1149,13 @@ static result_t write_bitmap_rle(FILE *fp, image_t *img, int bc, int stride) {
   uint8_t *raw = NULL;
   uint8_t *step = NULL;
   uint8_t *row = NULL;
-  int image_size = 0;
   int cpb = 8 / bc; // 1Byteあたりの色数
   int count_max = 255 / cpb;
   stride = (img->width * bc + 7) / 8;
   raw = calloc(stride, 1);
   step = calloc(stride, 1);
-  row = calloc(stride * 2, 1);
+  // 圧縮後は最大で1byteあたり2byteとなり、行末か画像末尾の2byteが付く
+  row = calloc(stride * 2 + 2, 1);
   if (raw == NULL || step == NULL || row == NULL) {
     goto error;
   }
@@ -1209,15 +1240,11 @@ static result_t write_bitmap_rle(FILE *fp, image_t *img, int bc, int stride) {
       *work++ = 0;
       *work++ = 0;
     }
-    if (fwrite(row, work - row, 1, fp) != 1) {
+    if (stream_write(s, row, work - row) != SUCCESS) {
       goto error;
     }
-    image_size += work - row;
-  }
-  if (fseek(fp, 0, SEEK_SET) != 0) {
-    goto error;
   }
-  result = write_header(fp, img, bc, image_size, TRUE);
+  result = SUCCESS;
   error:
   free(raw);
   free(step);
@@ -1228,28 +1255,28 @@ static result_t write_bitmap_rle(FILE *fp, image_t *img, int bc, int stride) {
 /**
  * @brief ビットマップ情報を出力する。
  *
- * @param[in] fp       ファイルストリーム
+ * @param[in] s        ストリーム
  * @param[in] img      画像データ
  * @param[in] bc       1色あたりのビット数
  * @param[in] compress TRUEの時RLE圧縮を行う
  * @return 成否
  */
-static result_t write_bitmap(FILE *fp, image_t *img, int bc, int compress) {
+static result_t write_bitmap(stream_t *s, image_t *img, int bc, int compress) {
   int stride = (img->width * bc + 31) / 32 * 4;
   switch (bc) {
     case 32:
-      return write_bitmap_32(fp, img, bc, stride);
+      return write_bitmap_32(s, img, bc, stride);
     case 24:
-      return write_bitmap_24(fp, img, bc, stride);
+      return write_bitmap_24(s, img, bc, stride);
     case 8:
     case 4:
       if (compress) {
-        return write_bitmap_rle(fp, img, bc, stride);
+        return write_bitmap_rle(s, img, bc, stride);
       } else {
-        return write_bitmap_index(fp, img, bc, stride);
+        return write_bitmap_index(s, img, bc, stride);
       }
     case 1:
-      return write_bitmap_index(fp, img, bc, stride);
+      return write_bitmap_index(s, img, bc, stride);
     default:
       break;
   }
@@ -1302,13 +1329,46 @@ result_t write_bmp_file(const char *filename, image_t *img, int compress) {
  * @return 成否
  */
 result_t write_bmp_stream(FILE *fp, image_t *img, int compress) {
+  stream_t s;
+  stream_init_file(&s, fp);
+  return write_bmp(&s, img, compress);
+}
+
+/**
+ * @brief BMP形式としてメモリ上に書き出す。
+ *
+ * 出力形式はwrite_bmp_stream()と同じ。
+ *
+ * @param[out] data     書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size     書き出したデータのサイズ
+ * @param[in]  img      画像データ
+ * @param[in]  compress TRUEの時RLE圧縮を行う
+ * @return 成否
+ */
+result_t write_bmp_memory(uint8_t **data, size_t *size, image_t *img, int compress) {
+  stream_t s;
+  stream_init_buffer(&s);
+  return stream_take_buffer(&s, write_bmp(&s, img, compress), data, size);
+}
+
+/**
+ * @brief BMP形式として書き出す。
+ *
+ * @param[in] s        ストリーム
+ * @param[in] img      画像データ
+ * @param[in] compress TRUEの時RLE圧縮を行う
+ * @return 成否
+ */
+static result_t write_bmp(stream_t *s, image_t *img, int compress) {
   result_t result = FAILURE;
   image_t *work = NULL;
+  stream_t rle;
   int bc;
   int size;
   if (img == NULL) {
     return FAILURE;
   }
+  stream_init_buffer(&rle);
   if (img->color_type == COLOR_TYPE_GRAY) {
     work = clone_image(img);
     if (work == NULL) {
@@ -1331,17 +1391,30 @@ result_t write_bmp_stream(FILE *fp, image_t *img, int compress) {
   } else {
     goto error;
   }
-  size = (img->width * bc + 31) / 32 * 4 * img->height;
-  if (write_header(fp, img, bc, size, compress) != SUCCESS) {
+  if (compress && (bc == 8 || bc == 4)) {
+    // ヘッダに圧縮後のサイズを書くため、後から戻って書き直さずに済むよう先に圧縮しておく
+    if (write_bitmap(&rle, img, bc, compress) != SUCCESS || rle.error) {
+      goto error;
+    }
+    size = rle.size;
+  } else {
+    size = (img->width * bc + 31) / 32 * 4 * img->height;
+  }
+  if (write_header(s, img, bc, size, compress) != SUCCESS) {
     goto error;
   }
   if (bc <= 8) {
-    if (write_palette(fp, img, bc) != SUCCESS) {
+    if (write_palette(s, img, bc) != SUCCESS) {
       goto error;
     }
   }
-  result = write_bitmap(fp, img, bc, compress);
+  if (rle.size != 0) {
+    result = stream_write(s, rle.data, rle.size);
+  } else {
+    result = write_bitmap(s, img, bc, compress);
+  }
   error:
+  free(rle.data);
   free_image(work);
   return result;
 }
@@ -16,6 +16,7 @@
 #include <stdint.h>
 #include <string.h>
 #include "image.h"
+#include "stream.h"
 
 #define FILE_TYPE 0x4D42    /**< "BM"をリトルエンディアンで解釈した値 */
 #define FILE_HEADER_SIZE 14 /**< BMPファイルヘッダサイズ */
@@ -55,6 +56,9 @@ typedef struct BITMAPINFOHEADER {
   uint32_t biClrImportant; /**< カラーパレットのうち重要な色の数 */
 } BITMAPINFOHEADER;
 
+static image_t *read_bmp_simple(stream_t *s);
+static result_t write_bmp_simple(stream_t *s, image_t *img);
+
 /**
  * @brief BMP形式のファイルを読み込む。
  *
@@ -83,6 +87,33 @@ image_t *read_bmp_simple_file(const char *filename) {
  * @return 読み込んだ画像、読み込みに失敗した場合NULL
  */
 image_t *read_bmp_simple_stream(FILE *fp) {
+  stream_t s;
+  stream_init_file(&s, fp);
+  return read_bmp_simple(&s);
+}
+
+/**
+ * @brief メモリ上のBMP形式のデータを読み込む。
+ *
+ * 24bitRGB形式にのみ対応、それ以外の形式は読み込み失敗扱い
+ *
+ * @param[in] data BMP形式のデータ
+ * @param[in] size データのサイズ
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_bmp_simple_memory(const uint8_t *data, size_t size) {
+  stream_t s;
+  stream_init_memory(&s, data, size);
+  return read_bmp_simple(&s);
+}
+
+/**
+ * @brief BMP形式の画像を読み込む。
+ *
+ * @param[in] s ストリーム
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+static image_t *read_bmp_simple(stream_t *s) {
   uint8_t header_buffer[DEFAULT_HEADER_SIZE];
   BITMAPFILEHEADER *file = (BITMAPFILEHEADER*)header_buffer;
   BITMAPINFOHEADER *info = (BITMAPINFOHEADER*)(header_buffer + FILE_HEADER_SIZE);
@@ -92,7 +123,7 @@ image_t *read_bmp_simple_stream(FILE *fp) {
   int width;
   int height;
   int stride;
-  if (fread(header_buffer, DEFAULT_HEADER_SIZE, 1, fp) != 1) {
+  if (stream_read(s, header_buffer, DEFAULT_HEADER_SIZE) != SUCCESS) {
     return NULL;
   }
   if (file->bfOffBits != DEFAULT_HEADER_SIZE ||
@@ -110,7 +141,7 @@ image_t *read_bmp_simple_stream(FILE *fp) {
     goto error;
   }
   for (y = height - 1; y >= 0; y--) {
-    if (fread(buffer, stride, 1, fp) != 1) {
+    if (stream_read(s, buffer, stride) != SUCCESS) {
       goto error;
     }
     row = buffer;
@@ -165,6 +196,36 @@ result_t write_bmp_simple_file(const char *filename, image_t *img) {
  * @return 成否
  */
 result_t write_bmp_simple_stream(FILE *fp, image_t *img) {
+  stream_t s;
+  stream_init_file(&s, fp);
+  return write_bmp_simple(&s, img);
+}
+
+/**
+ * @brief BMP形式としてメモリ上に書き出す。
+ *
+ * COLOR_TYPE_RGBの場合にのみ
+ * Windows形式での出力を行う
+ *
+ * @param[out] data 書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size 書き出したデータのサイズ
+ * @param[in]  img  画像データ
+ * @return 成否
+ */
+result_t write_bmp_simple_memory(uint8_t **data, size_t *size, image_t *img) {
+  stream_t s;
+  stream_init_buffer(&s);
+  return stream_take_buffer(&s, write_bmp_simple(&s, img), data, size);
+}
+
+/**
+ * @brief BMP形式として書き出す。
+ *
+ * @param[in] s   ストリーム
+ * @param[in] img 画像データ
+ * @return 成否
+ */
+static result_t write_bmp_simple(stream_t *s, image_t *img) {
   uint8_t header_buffer[DEFAULT_HEADER_SIZE];
   BITMAPFILEHEADER *file = (BITMAPFILEHEADER*)header_buffer;
   BITMAPINFOHEADER *info = (BITMAPINFOHEADER*)(header_buffer + FILE_HEADER_SIZE);
@@ -194,7 +255,7 @@ result_t write_bmp_simple_stream(FILE *fp, image_t *img) {
   info->biYPelsPerMeter = 0;
   info->biClrUsed = 0;
   info->biClrImportant = 0;
-  if (fwrite(header_buffer, DEFAULT_HEADER_SIZE, 1, fp) != 1) {
+  if (stream_write(s, header_buffer, DEFAULT_HEADER_SIZE) != SUCCESS) {
     goto error;
   }
   memset(buffer, 0, stride);
@@ -205,7 +266,7 @@ result_t write_bmp_simple_stream(FILE *fp, image_t *img) {
       *row++ = img->map[y][x].c.g;
       *row++ = img->map[y][x].c.r;
     }
-    if (fwrite(buffer, stride, 1, fp) != 1) {
+    if (stream_write(s, buffer, stride) != SUCCESS) {
       goto error;
     }
   }
@@ -15,6 +15,35 @@
 #include <stdint.h>
 #include "image.h"
 
+/**
+ * @brief RGBAの画素を背景色にアルファブレンドしてRGBの画素にする。
+ *
+ * @param[in,out] p  変換する画素
+ * @param[in]     bg アルファブレンドを行う背景色
+ */
+static void blend_pixcel(pixcel_t *p, color_t bg) {
+  const uint8_t a = p->c.a;
+  p->c.r = (p->c.r * a + bg.r * (0xff - a) + 0x7f) / 0xff;
+  p->c.g = (p->c.g * a + bg.g * (0xff - a) + 0x7f) / 0xff;
+  p->c.b = (p->c.b * a + bg.b * (0xff - a) + 0x7f) / 0xff;
+  p->c.a = 0xff;
+}
+
+/**
+ * @brief RGBの画素をグレースケールの画素にする。
+ *
+ * @param[in,out] p 変換する画素
+ */
+static void rgb_to_gray_pixcel(pixcel_t *p) {
+  const uint8_t r = p->c.r;
+  const uint8_t g = p->c.g;
+  const uint8_t b = p->c.b;
+  // ITU-R BT.601規定の輝度計算で変換する
+  const uint8_t gray = (uint8_t) (0.299f * r + 0.587f * g + 0.114f * b + 0.5f);
+  memset(p, 0, sizeof(pixcel_t));
+  p->g = gray;
+}
+
 /**
  * @brief 画像情報のダンプを行う。
  *
@@ -469,12 +498,7 @@ image_t *image_rgba_to_rgb(image_t *img, color_t bg) {
   }
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      pixcel_t *p = &img->map[y][x];
-      const uint8_t a = p->c.a;
-      p->c.r = (p->c.r * a + bg.r * (0xff - a) + 0x7f) / 0xff;
-      p->c.g = (p->c.g * a + bg.g * (0xff - a) + 0x7f) / 0xff;
-      p->c.b = (p->c.b * a + bg.b * (0xff - a) + 0x7f) / 0xff;
-      p->c.a = 0xff;
+      blend_pixcel(&img->map[y][x], bg);
     }
   }
   img->color_type = COLOR_TYPE_RGB;
@@ -568,14 +592,7 @@ image_t *image_rgb_to_gray(image_t *img) {
   }
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      pixcel_t *p = &img->map[y][x];
-      const uint8_t r = p->c.r;
-      const uint8_t g = p->c.g;
-      const uint8_t b = p->c.b;
-      // ITU-R BT.601規定の輝度計算で変換する
-      const uint8_t gray = (uint8_t) (0.299f * r + 0.587f * g + 0.114f * b + 0.5f);
-      memset(p, 0, sizeof(pixcel_t));
-      p->g = gray;
+      rgb_to_gray_pixcel(&img->map[y][x]);
     }
   }
   img->color_type = COLOR_TYPE_GRAY;
@@ -616,3 +633,56 @@ image_t *image_gray_to_binary(image_t *img) {
   img->color_type = COLOR_TYPE_INDEX;
   return img;
 }
+
+/**
+ * @brief 1行分の画素の色表現を変換する。
+ *
+ * image_to_rgb()、image_to_rgba()、image_to_gray()で画像全体を変換した場合と
+ * 同じ結果を行単位で得るためのもので、デコードしながら変換する場合に利用する。
+ * インデックスカラーへの変換は画像全体の色数を数える必要があるため、
+ * インデックスカラーからの変換でなければ失敗する。
+ *
+ * @param[in,out] row         変換する行
+ * @param[in]     width       行の画素数
+ * @param[in]     from        変換元の色表現の種別
+ * @param[in]     to          変換先の色表現の種別
+ * @param[in]     palette     インデックスカラーの場合のカラーパレット
+ * @param[in]     palette_num カラーパレットの数
+ * @return 成否
+ */
+result_t convert_pixcels(pixcel_t *row, uint32_t width, int from, int to,
+    const color_t *palette, int palette_num) {
+  uint32_t x;
+  if (from == to) {
+    return SUCCESS;
+  }
+  if (to == COLOR_TYPE_INDEX) {
+    return FAILURE;
+  }
+  for (x = 0; x < width; x++) {
+    pixcel_t *p = &row[x];
+    // 一旦RGB(A)にする
+    switch (from) {
+      case COLOR_TYPE_INDEX:
+        if (p->i >= palette_num) {
+          return FAILURE;
+        }
+        p->c = palette[p->i];
+        break;
+      case COLOR_TYPE_GRAY: {
+        const uint8_t g = p->g;
+        p->c = color_from_rgb(g, g, g);
+        break;
+      }
+      case COLOR_TYPE_RGBA:
+        if (to != COLOR_TYPE_RGBA) {
+          blend_pixcel(p, color_from_rgb(255, 255, 255));
+        }
+        break;
+    }
+    if (to == COLOR_TYPE_GRAY) {
+      rgb_to_gray_pixcel(p);
+    }
+  }
+  return SUCCESS;
+}
@@ -65,6 +65,192 @@ typedef struct image_t {
   pixcel_t **map;       /**< 画像データ */
 } image_t;
 
+#define PNG_WRITE_STRATEGY_DEFAULT      0 /**< zlibの標準の圧縮戦略 */
+#define PNG_WRITE_STRATEGY_FILTERED     1 /**< フィルタ済みデータ向けの圧縮戦略 */
+#define PNG_WRITE_STRATEGY_RLE          2 /**< 直前の値の繰り返しのみを探す圧縮戦略 */
+#define PNG_WRITE_STRATEGY_HUFFMAN_ONLY 3 /**< ハフマン符号化のみの圧縮戦略 */
+
+#define PNG_WRITE_FILTER_NONE  0x01 /**< Noneフィルタ */
+#define PNG_WRITE_FILTER_SUB   0x02 /**< Subフィルタ */
+#define PNG_WRITE_FILTER_UP    0x04 /**< Upフィルタ */
+#define PNG_WRITE_FILTER_AVG   0x08 /**< Averageフィルタ */
+#define PNG_WRITE_FILTER_PAETH 0x10 /**< Paethフィルタ */
+#define PNG_WRITE_FILTER_ALL   0x1f /**< 全てのフィルタ */
+
+#define PNG_WRITE_PALETTE_KEEP         0 /**< カラーパレットを元の順序のまま書き出す */
+#define PNG_WRITE_PALETTE_FREQUENCY    1 /**< カラーパレットを使用頻度の高い順に並べ替えて書き出す */
+#define PNG_WRITE_PALETTE_LUMINANCE    2 /**< カラーパレットを輝度の低い順に並べ替えて書き出す */
+#define PNG_WRITE_PALETTE_COOCCURRENCE 3 /**< カラーパレットを隣接して現れるもの同士が近くなるよう並べ替えて書き出す */
+
+#define PNG_WRITE_ENCODER_LIBPNG 0 /**< libpngとzlibで圧縮する */
+#define PNG_WRITE_ENCODER_FAST   1 /**< 圧縮率よりも速度を優先した内蔵のエンコーダで圧縮する */
+
+/**
+ * @brief PNG読み込みのオプション
+ *
+ * init_png_read_option()で標準の設定に初期化してから変更すること。
+ */
+typedef struct png_read_option_t {
+  /**
+   * 画素の変換に使用するスレッド数、1以上でデコードと並行して変換する。
+   * デコードが律速となるため、変換スレッドは行を待つ間は条件変数で眠り、CPUを消費しない。
+   * 多く指定しても速くなるのは変換にかかる時間の分だけで、通常は1～2で十分。
+   */
+  int threads;
+  int color_type; /**< 変換先の色表現の種別、負の値でファイルの形式のまま */
+} png_read_option_t;
+
+/**
+ * @brief PNG書き出しのオプション
+ *
+ * 負の値、0を指定した項目はlibpngの標準の設定のまま書き出す。
+ * init_png_write_option()で標準の設定に初期化してから変更すること。
+ */
+typedef struct png_write_option_t {
+  int level;          /**< zlibの圧縮レベル(0-9)、負の値で標準 */
+  int strategy;       /**< 圧縮戦略(PNG_WRITE_STRATEGY_*)、負の値で標準 */
+  int filters;        /**< 使用を許可するフィルタ(PNG_WRITE_FILTER_*の論理和)、0で標準 */
+  size_t buffer_size; /**< 圧縮バッファのサイズ、0で標準 */
+  int threads;        /**< 圧縮に使用するスレッド数、2以上で並列に圧縮する */
+  int palette_order;  /**< インデックスカラーのカラーパレットの並べ方(PNG_WRITE_PALETTE_*) */
+  int encoder;        /**< 使用するエンコーダ(PNG_WRITE_ENCODER_*) */
+  int interlace;      /**< Adam7のインターレースで書き出すか否か */
+} png_write_option_t;
+
+#define JPEG_SUBSAMPLING_444 0 /**< 色差をサブサンプリングしない */
+#define JPEG_SUBSAMPLING_422 1 /**< 色差を水平方向に1/2にサブサンプリングする */
+#define JPEG_SUBSAMPLING_420 2 /**< 色差を水平垂直方向に1/2にサブサンプリングする */
+
+#define JPEG_DCT_ISLOW 0 /**< 低速で正確な整数演算のDCT */
+#define JPEG_DCT_IFAST 1 /**< 高速で精度の低い整数演算のDCT */
+#define JPEG_DCT_FLOAT 2 /**< 浮動小数点演算のDCT */
+
+#define JPEG_DITHER_NONE    0 /**< 減色時にディザリングしない */
+#define JPEG_DITHER_ORDERED 1 /**< 減色時に組織的ディザリングを行う */
+#define JPEG_DITHER_FS      2 /**< 減色時にFloyd-Steinbergの誤差拡散を行う */
+
+/**
+ * @brief JPEG読み込みのオプション
+ *
+ * init_jpeg_read_option()で標準の設定に初期化してから変更すること。
+ */
+typedef struct jpeg_read_option_t {
+  int dct_method;       /**< 逆DCTの方式(JPEG_DCT_*) */
+  int fancy_upsampling; /**< 色差を補間してアップサンプリングするか否か */
+  int block_smoothing;  /**< プログレッシブJPEGの途中のスキャンでブロックを平滑化するか否か */
+  int colors;           /**< 減色する色数(2-256)、0で減色せずRGBのまま読み込む */
+  int dither;           /**< 減色時のディザリングの方式(JPEG_DITHER_*) */
+  int threads;          /**< デコードに使用するスレッド数、2以上でリスタート区間ごとに並列にデコードする */
+} jpeg_read_option_t;
+
+/**
+ * @brief JPEG書き出しのオプション
+ *
+ * init_jpeg_write_option()で標準の設定に初期化してから変更すること。
+ */
+typedef struct jpeg_write_option_t {
+  int quality;          /**< 品質(0-100) */
+  int subsampling;      /**< 色差のサブサンプリング(JPEG_SUBSAMPLING_*) */
+  int progressive;      /**< プログレッシブJPEGとして書き出すか否か */
+  int optimize_coding;  /**< ハフマン符号表を画像に合わせて最適化するか否か */
+  int dct_method;       /**< DCTの方式(JPEG_DCT_*) */
+  int restart_interval; /**< リスタートマーカーを挿入するMCUの間隔、0で挿入しない */
+  int smoothing;        /**< 入力を平滑化する強さ(0-100)、0で平滑化しない */
+  int threads;          /**< 圧縮に使用するスレッド数、2以上で横長の帯に分けて並列に圧縮する */
+} jpeg_write_option_t;
+
+#define JPEG_TRANSFORM_NONE       0 /**< 変形しない */
+#define JPEG_TRANSFORM_FLIP_H     1 /**< 左右反転 */
+#define JPEG_TRANSFORM_FLIP_V     2 /**< 上下反転 */
+#define JPEG_TRANSFORM_TRANSPOSE  3 /**< 左上から右下への対角線で反転 */
+#define JPEG_TRANSFORM_TRANSVERSE 4 /**< 右上から左下への対角線で反転 */
+#define JPEG_TRANSFORM_ROT_90     5 /**< 時計回りに90度回転 */
+#define JPEG_TRANSFORM_ROT_180    6 /**< 180度回転 */
+#define JPEG_TRANSFORM_ROT_270    7 /**< 時計回りに270度回転 */
+
+/**
+ * @brief JPEGの無劣化変形のオプション
+ *
+ * 切り抜きは元の画像の座標で指定し、変形の前に行う。
+ * 切り抜きの左上はMCUの境界に切り下げ、右下は変わらないように幅と高さを広げる。
+ * init_jpeg_transform_option()で標準の設定に初期化してから変更すること。
+ */
+typedef struct jpeg_transform_option_t {
+  int transform;        /**< 変形の種別(JPEG_TRANSFORM_*) */
+  uint32_t crop_x;      /**< 切り抜く領域の左端 */
+  uint32_t crop_y;      /**< 切り抜く領域の上端 */
+  uint32_t crop_width;  /**< 切り抜く領域の幅、0で切り抜かない */
+  uint32_t crop_height; /**< 切り抜く領域の高さ、0で切り抜かない */
+  int progressive;      /**< プログレッシブJPEGとして書き出すか否か */
+  int optimize_coding;  /**< ハフマン符号表を画像に合わせて最適化するか否か */
+} jpeg_transform_option_t;
+
+#define JPEG_PLANE_MAX 3 /**< JPEGの平面画像の成分の最大数 */
+
+/**
+ * @brief JPEGの平面画像の1成分
+ *
+ * 右端と下端はMCUの大きさまで余白を確保している。
+ */
+typedef struct jpeg_plane_t {
+  uint32_t width;    /**< 平面の幅 */
+  uint32_t height;   /**< 平面の高さ */
+  uint32_t stride;   /**< 1行のbyte数 */
+  uint32_t rows;     /**< 余白を含めて確保した行数 */
+  int h_samp_factor; /**< 水平方向のサンプリング係数 */
+  int v_samp_factor; /**< 垂直方向のサンプリング係数 */
+  uint8_t *data;     /**< 画素データ */
+} jpeg_plane_t;
+
+/**
+ * @brief JPEGの平面画像
+ *
+ * JPEGの色空間のまま、Y、Cb、Crの各成分をサブサンプリングされた大きさの平面で保持する。
+ * グレースケールの場合はYの1成分のみとなる。
+ */
+typedef struct jpeg_planes_t {
+  uint32_t width;                    /**< 画像の幅 */
+  uint32_t height;                   /**< 画像の高さ */
+  int components;                    /**< 成分の数(1または3) */
+  jpeg_plane_t plane[JPEG_PLANE_MAX]; /**< 各成分の平面 */
+} jpeg_planes_t;
+
+/**
+ * @brief PNGの逐次デコードで行が更新された時に呼ばれるコールバック
+ *
+ * @param[in] user create_png_decoder()で指定したポインタ
+ * @param[in] img  デコード中の画像
+ * @param[in] y    更新された行
+ * @param[in] pass インターレースのパス(0-6)、インターレースでない場合は0
+ */
+typedef void (*png_row_callback_t)(void *user, image_t *img, uint32_t y, int pass);
+
+/**
+ * @brief PNGの逐次デコーダ
+ */
+typedef struct png_decoder_t png_decoder_t;
+
+/**
+ * @brief PNGの読み書きを繰り返すためのコンテキスト
+ */
+typedef struct png_context_t png_context_t;
+
+/**
+ * @brief JPEGの読み書きを繰り返すためのコンテキスト
+ */
+typedef struct jpeg_context_t jpeg_context_t;
+
+/**
+ * @brief プログレッシブJPEGのスキャンを読み込むごとに呼ばれるコールバック
+ *
+ * @param[in] user  read_jpeg_stream_progressive()で指定したポインタ
+ * @param[in] img   このスキャンまでの情報で復元した画像
+ * @param[in] scan  スキャンの番号(1から)
+ * @param[in] final 最後のスキャンか否か
+ * @return デコードを続ける場合TRUE、打ち切る場合FALSE
+ */
+typedef int (*jpeg_scan_callback_t)(void *user, image_t *img, int scan, int final);
+
 void dump_image_info(image_t *img);
 image_t *allocate_image(uint32_t width, uint32_t height, uint8_t type);
 image_t *clone_image(image_t *img);
@@ -83,34 +269,120 @@ image_t *image_rgba_to_rgb_ignore_alpha(image_t *img);
 image_t *image_gray_to_rgb(image_t *img);
 image_t *image_rgb_to_gray(image_t *img);
 image_t *image_gray_to_binary(image_t *img);
+result_t convert_pixcels(pixcel_t *row, uint32_t width, int from, int to,
+    const color_t *palette, int palette_num);
 
 /* PNG形式の読み書き */
 image_t *read_png_file(const char *filename);
 image_t *read_png_stream(FILE *fp);
+void init_png_read_option(png_read_option_t *opt);
+image_t *read_png_file_with_option(const char *filename, const png_read_option_t *opt);
+image_t *read_png_stream_with_option(FILE *fp, const png_read_option_t *opt);
+png_context_t *create_png_context(void);
+void reset_png_context(png_context_t *ctx);
+void free_png_context(png_context_t *ctx);
+image_t *read_png_stream_with_context(png_context_t *ctx, FILE *fp, const png_read_option_t *opt);
+image_t *read_png_memory(const uint8_t *data, size_t size);
+image_t *read_png_memory_with_option(const uint8_t *data, size_t size,
+    const png_read_option_t *opt);
+png_decoder_t *create_png_decoder(png_row_callback_t callback, void *user);
+result_t feed_png_decoder(png_decoder_t *dec, const uint8_t *data, size_t size);
+image_t *finish_png_decoder(png_decoder_t *dec);
+void free_png_decoder(png_decoder_t *dec);
 result_t write_png_file(const char *filename, image_t *img);
 result_t write_png_stream(FILE *fp, image_t *img);
+void init_png_write_option(png_write_option_t *opt);
+void init_png_write_option_fastest(png_write_option_t *opt);
+result_t write_png_file_with_option(const char *filename, image_t *img,
+    const png_write_option_t *opt);
+result_t write_png_stream_with_option(FILE *fp, image_t *img,
+    const png_write_option_t *opt);
+result_t write_png_stream_with_context(png_context_t *ctx, FILE *fp, image_t *img,
+    const png_write_option_t *opt);
+result_t write_png_memory(uint8_t **data, size_t *size, image_t *img);
+result_t write_png_memory_with_option(uint8_t **data, size_t *size, image_t *img,
+    const png_write_option_t *opt);
+result_t optimize_png_file(const char *filename, image_t *img, int threads,
+    png_write_option_t *best);
+result_t optimize_png_stream(FILE *fp, image_t *img, int threads,
+    png_write_option_t *best);
 
 /* JPG形式の読み書き */
 image_t *read_jpeg_file(const char *filename);
 image_t *read_jpeg_stream(FILE *fp);
+void init_jpeg_read_option(jpeg_read_option_t *opt);
+void init_jpeg_read_option_fastest(jpeg_read_option_t *opt);
+image_t *read_jpeg_file_with_option(const char *filename, const jpeg_read_option_t *opt);
+image_t *read_jpeg_stream_with_option(FILE *fp, const jpeg_read_option_t *opt);
+image_t *read_jpeg_file_scaled(const char *filename, uint32_t width, uint32_t height,
+    const jpeg_read_option_t *opt);
+image_t *read_jpeg_stream_scaled(FILE *fp, uint32_t width, uint32_t height,
+    const jpeg_read_option_t *opt);
+image_t *read_jpeg_file_progressive(const char *filename, const jpeg_read_option_t *opt,
+    jpeg_scan_callback_t callback, void *user);
+image_t *read_jpeg_stream_progressive(FILE *fp, const jpeg_read_option_t *opt,
+    jpeg_scan_callback_t callback, void *user);
+jpeg_context_t *create_jpeg_context(void);
+void reset_jpeg_context(jpeg_context_t *ctx);
+void free_jpeg_context(jpeg_context_t *ctx);
+image_t *read_jpeg_stream_with_context(jpeg_context_t *ctx, FILE *fp,
+    const jpeg_read_option_t *opt);
+image_t *read_jpeg_memory(const uint8_t *data, size_t size);
+image_t *read_jpeg_memory_with_option(const uint8_t *data, size_t size,
+    const jpeg_read_option_t *opt);
 result_t write_jpeg_file(const char *filename, image_t *img);
 result_t write_jpeg_stream(FILE *fp, image_t *img);
+void init_jpeg_write_option(jpeg_write_option_t *opt);
+void init_jpeg_write_option_fastest(jpeg_write_option_t *opt);
+void init_jpeg_write_option_smallest(jpeg_write_option_t *opt);
+result_t write_jpeg_file_with_option(const char *filename, image_t *img,
+    const jpeg_write_option_t *opt);
+result_t write_jpeg_stream_with_option(FILE *fp, image_t *img,
+    const jpeg_write_option_t *opt);
+result_t write_jpeg_file_within_size(const char *filename, image_t *img, size_t limit,
+    jpeg_write_option_t *opt);
+result_t write_jpeg_stream_within_size(FILE *fp, image_t *img, size_t limit,
+    jpeg_write_option_t *opt);
+result_t write_jpeg_stream_with_context(jpeg_context_t *ctx, FILE *fp, image_t *img,
+    const jpeg_write_option_t *opt);
+result_t write_jpeg_memory(uint8_t **data, size_t *size, image_t *img);
+result_t write_jpeg_memory_with_option(uint8_t **data, size_t *size, image_t *img,
+    const jpeg_write_option_t *opt);
+void init_jpeg_transform_option(jpeg_transform_option_t *opt);
+result_t transform_jpeg_file(const char *src, const char *dst,
+    const jpeg_transform_option_t *opt);
+result_t transform_jpeg_stream(FILE *in, FILE *out, const jpeg_transform_option_t *opt);
+jpeg_planes_t *allocate_jpeg_planes(uint32_t width, uint32_t height, int components,
+    int subsampling);
+void free_jpeg_planes(jpeg_planes_t *planes);
+jpeg_planes_t *read_jpeg_planes_file(const char *filename);
+jpeg_planes_t *read_jpeg_planes_stream(FILE *fp);
+result_t write_jpeg_planes_file(const char *filename, jpeg_planes_t *planes,
+    const jpeg_write_option_t *opt);
+result_t write_jpeg_planes_stream(FILE *fp, jpeg_planes_t *planes,
+    const jpeg_write_option_t *opt);
 
 /* BMP形式の読み書き */
 image_t *read_bmp_file(const char *filename);
 image_t *read_bmp_stream(FILE *fp);
+image_t *read_bmp_memory(const uint8_t *data, size_t size);
 result_t write_bmp_file(const char *filename, image_t *img, int compress);
 result_t write_bmp_stream(FILE *fp, image_t *img, int compress);
+result_t write_bmp_memory(uint8_t **data, size_t *size, image_t *img, int compress);
 
 image_t *read_bmp_simple_file(const char *filename);
 image_t *read_bmp_simple_stream(FILE *fp);
+image_t *read_bmp_simple_memory(const uint8_t *data, size_t size);
 result_t write_bmp_simple_file(const char *filename, image_t *img);
 result_t write_bmp_simple_stream(FILE *fp, image_t *img);
+result_t write_bmp_simple_memory(uint8_t **data, size_t *size, image_t *img);
 
 /* PNM(PPM/PGM/PBM)形式の読み書き */
 image_t *read_pnm_file(const char *filename);
 image_t *read_pnm_stream(FILE *fp);
+image_t *read_pnm_memory(const uint8_t *data, size_t size);
 result_t write_pnm_file(const char *filename, image_t *img, int type);
 result_t write_pnm_stream(FILE *fp, image_t *img, int type);
+result_t write_pnm_memory(uint8_t **data, size_t *size, image_t *img, int type);
 
 #endif /* IMAGE_H_ */
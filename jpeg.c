@@ -16,7 +16,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <jpeglib.h>
+#include <pthread.h>
 #include "image.h"
+#include "stream.h"
 #include <setjmp.h>
 
 /**
@@ -36,38 +38,2129 @@ static void error_exit(j_common_ptr cinfo) {
   longjmp(err->jmpbuf, 1);
 }
 
+/**
+ * @brief JPEGの読み書きを繰り返すためのコンテキスト
+ *
+ * jpeg_decompress_struct/jpeg_compress_structを画像ごとに作り直さずに使い回す。
+ * libjpegの永続的なメモリプールに確保されるソースとデスティネーション、
+ * 量子化テーブルとハフマン符号表もそのまま再利用される。
+ */
+struct jpeg_context_t {
+  struct jpeg_decompress_struct jpegd; /**< 読み込み用の構造体 */
+  my_error_mgr derr;                   /**< 読み込み用のエラーハンドラ */
+  int has_decompress;                  /**< 読み込み用の構造体を作成済みか */
+  struct jpeg_compress_struct jpegc;   /**< 書き出し用の構造体 */
+  my_error_mgr cerr;                   /**< 書き出し用のエラーハンドラ */
+  int has_compress;                    /**< 書き出し用の構造体を作成済みか */
+  void *scratch;                       /**< 行を詰めるための作業領域 */
+  size_t scratch_size;                 /**< 作業領域のサイズ */
+};
+
+/**
+ * @brief JPEGの読み書きを繰り返すためのコンテキストを作成する。
+ *
+ * 小さな画像を大量に読み書きする場合に、画像ごとのlibjpegの初期化と後始末を省く。
+ * 1つのコンテキストは同時に1つのスレッドからのみ使用すること。
+ *
+ * @return 作成したコンテキスト、失敗した場合NULL
+ */
+jpeg_context_t *create_jpeg_context(void) {
+  return calloc(1, sizeof(jpeg_context_t));
+}
+
+/**
+ * @brief コンテキストが保持している構造体と作業領域を解放する。
+ *
+ * 大きな画像を扱った後などに呼び出す。コンテキストは引き続き使用できる。
+ *
+ * @param[in,out] ctx コンテキスト
+ */
+void reset_jpeg_context(jpeg_context_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+  if (ctx->has_decompress) {
+    jpeg_destroy_decompress(&ctx->jpegd);
+    ctx->has_decompress = FALSE;
+  }
+  if (ctx->has_compress) {
+    jpeg_destroy_compress(&ctx->jpegc);
+    ctx->has_compress = FALSE;
+  }
+  free(ctx->scratch);
+  ctx->scratch = NULL;
+  ctx->scratch_size = 0;
+}
+
+/**
+ * @brief コンテキストを解放する。
+ *
+ * @param[in] ctx コンテキスト
+ */
+void free_jpeg_context(jpeg_context_t *ctx) {
+  reset_jpeg_context(ctx);
+  free(ctx);
+}
+
+/**
+ * @brief 行を詰めるための作業領域を確保する。
+ *
+ * コンテキストがある場合は作業領域を使い回し、足りない場合のみ確保し直す。
+ *
+ * @param[in,out] ctx      コンテキスト、NULLの場合はmalloc()で確保する
+ * @param[in]     row_size 1行のバイト数
+ * @param[in]     n        行数
+ * @return 各行の先頭を指す配列、失敗した場合NULL
+ */
+static JSAMPARRAY allocate_scratch_rows(jpeg_context_t *ctx, size_t row_size, uint32_t n) {
+  uint32_t i;
+  size_t size = (sizeof(JSAMPROW) + row_size) * n;
+  JSAMPARRAY rows;
+  if (ctx == NULL) {
+    rows = malloc(size);
+  } else {
+    if (ctx->scratch_size < size) {
+      free(ctx->scratch);
+      ctx->scratch_size = 0;
+      if ((ctx->scratch = malloc(size)) == NULL) {
+        return NULL;
+      }
+      ctx->scratch_size = size;
+    }
+    rows = ctx->scratch;
+  }
+  if (rows == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    rows[i] = (JSAMPROW) (rows + n) + row_size * i;
+  }
+  return rows;
+}
+
+/**
+ * @brief allocate_scratch_rows()で確保した作業領域を解放する。
+ *
+ * @param[in] ctx  コンテキスト、NULLでない場合は解放せずに保持する
+ * @param[in] rows 作業領域
+ */
+static void free_scratch_rows(jpeg_context_t *ctx, JSAMPARRAY rows) {
+  if (ctx == NULL) {
+    free(rows);
+  }
+}
+
+/**
+ * @brief JPEG形式のファイルを読み込む。
+ *
+ * @param[in] filename ファイル名
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_file(const char *filename) {
+  FILE *fp;
+  if ((fp = fopen(filename, "rb")) == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  image_t *img = read_jpeg_stream(fp);
+  fclose(fp);
+  return img;
+}
+
 /**
  * @brief JPEG形式のファイルを読み込む。
  *
+ * @param[in] fp ファイルストリーム
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_stream(FILE *fp) {
+  return read_jpeg_stream_with_option(fp, NULL);
+}
+
+/**
+ * @brief JPEG読み込みオプションを標準の設定で初期化する。
+ *
+ * libjpegの標準の設定と同じく、正確な整数演算の逆DCT、
+ * 色差の補間、ブロックの平滑化を行い、減色は行わない。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_jpeg_read_option(jpeg_read_option_t *opt) {
+  opt->dct_method = JPEG_DCT_ISLOW;
+  opt->fancy_upsampling = TRUE;
+  opt->block_smoothing = TRUE;
+  opt->colors = 0;
+  opt->dither = JPEG_DITHER_FS;
+  opt->threads = 1;
+}
+
+/**
+ * @brief JPEG読み込みオプションを速度優先の設定で初期化する。
+ *
+ * プレビューや解析向けに、画質よりもデコードの速さを優先する。
+ * 高速な整数演算の逆DCTを使用し、色差の補間とブロックの平滑化を行わない。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_jpeg_read_option_fastest(jpeg_read_option_t *opt) {
+  init_jpeg_read_option(opt);
+  opt->dct_method = JPEG_DCT_IFAST;
+  opt->fancy_upsampling = FALSE;
+  opt->block_smoothing = FALSE;
+}
+
+/**
+ * @brief オプションを指定してJPEG形式のファイルを読み込む。
+ *
+ * @param[in] filename ファイル名
+ * @param[in] opt      読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_file_with_option(const char *filename, const jpeg_read_option_t *opt) {
+  FILE *fp;
+  if ((fp = fopen(filename, "rb")) == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  image_t *img = read_jpeg_stream_with_option(fp, opt);
+  fclose(fp);
+  return img;
+}
+
+/**
+ * @brief DCTの方式に対応するlibjpegの値を返す。
+ *
+ * @param[in] dct_method DCTの方式(JPEG_DCT_*)
+ * @return libjpegのDCTの方式
+ */
+static J_DCT_METHOD get_dct_method(int dct_method) {
+  switch (dct_method) {
+    case JPEG_DCT_IFAST:
+      return JDCT_IFAST;
+    case JPEG_DCT_FLOAT:
+      return JDCT_FLOAT;
+  }
+  return JDCT_ISLOW;
+}
+
+/**
+ * @brief 読み込みオプションをlibjpegに設定する。
+ *
+ * jpeg_read_header()の後に呼び出すこと。
+ *
+ * @param[in,out] jpegd jpeg_decompress_struct
+ * @param[in]     opt   読み込みオプション
+ */
+static void set_jpeg_read_option(j_decompress_ptr jpegd, const jpeg_read_option_t *opt) {
+  jpegd->dct_method = get_dct_method(opt->dct_method);
+  jpegd->do_fancy_upsampling = opt->fancy_upsampling ? TRUE : FALSE;
+  jpegd->do_block_smoothing = opt->block_smoothing ? TRUE : FALSE;
+  if (opt->colors > 0) {
+    jpegd->quantize_colors = TRUE;
+    jpegd->desired_number_of_colors = opt->colors < 2 ? 2 : opt->colors > 256 ? 256 : opt->colors;
+    // 2パスの減色は画像全体をバッファするため、速度を優先して1パスで減色する
+    jpegd->two_pass_quantize = FALSE;
+    switch (opt->dither) {
+      case JPEG_DITHER_NONE:
+        jpegd->dither_mode = JDITHER_NONE;
+        break;
+      case JPEG_DITHER_ORDERED:
+        jpegd->dither_mode = JDITHER_ORDERED;
+        break;
+      default:
+        jpegd->dither_mode = JDITHER_FS;
+        break;
+    }
+  }
+}
+
+/**
+ * @brief 画像データの行の先頭に詰めて読み込まれた画素を画素情報のレイアウトに広げる。
+ *
+ * 後ろの画素から処理することで、作業用バッファを使わずに同じ行の中で変換する。
+ *
+ * @param[in,out] row        画像データの行
+ * @param[in]     width      画像の幅
+ * @param[in]     components 1画素の成分数(1または3)
+ */
+static void expand_row(pixcel_t *row, uint32_t width, int components) {
+  const JSAMPLE *src = (const JSAMPLE *) row;
+  uint32_t x = width;
+  pixcel_t p;
+  if (components == 1) {
+    // グレースケールとインデックスはどちらも先頭のbyteに置く
+    while (x-- > 0) {
+      memset(&p, 0, sizeof(p));
+      p.g = src[x];
+      row[x] = p;
+    }
+  } else {
+    while (x-- > 0) {
+      p.c.r = src[x * 3];
+      p.c.g = src[x * 3 + 1];
+      p.c.b = src[x * 3 + 2];
+      p.c.a = 0xff;
+      row[x] = p;
+    }
+  }
+}
+
+/**
+ * @brief 指定した大きさ以上となる最小の縮小率を設定する。
+ *
+ * libjpegはN/8(N=1-8)の縮小を逆DCTの段階で行えるため、
+ * 縮小後の大きさが指定した大きさを下回らない最小のNを選択する。
+ * 指定した大きさが元の画像以上の場合と、幅と高さの両方が0の場合は縮小しない。
+ *
+ * @param[in,out] jpegd  jpeg_decompress_struct
+ * @param[in]     width  必要な幅、0の場合は幅を考慮しない
+ * @param[in]     height 必要な高さ、0の場合は高さを考慮しない
+ */
+static void set_jpeg_scale(j_decompress_ptr jpegd, uint32_t width, uint32_t height) {
+  unsigned int n;
+  if (width == 0 && height == 0) {
+    return;
+  }
+  for (n = 1; n < 8; n++) {
+    if ((jpegd->image_width * n + 7) / 8 >= width
+        && (jpegd->image_height * n + 7) / 8 >= height) {
+      break;
+    }
+  }
+  jpegd->scale_num = n;
+  jpegd->scale_denom = 8;
+}
+
+/**
+ * @brief オプションを指定してJPEG形式のファイルを読み込む。
+ *
+ * グレースケールのJPEGはグレースケールの画像として読み込む。
+ * 減色を指定した場合はインデックスカラーの画像として読み込む。
+ *
+ * @param[in] fp  ファイルストリーム
+ * @param[in] opt 読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_stream_with_option(FILE *fp, const jpeg_read_option_t *opt) {
+  return read_jpeg_stream_scaled(fp, 0, 0, opt);
+}
+
+/**
+ * @brief 縮小してJPEG形式のファイルを読み込む。
+ *
+ * @param[in] filename ファイル名
+ * @param[in] width    必要な幅、0の場合は幅を考慮しない
+ * @param[in] height   必要な高さ、0の場合は高さを考慮しない
+ * @param[in] opt      読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_file_scaled(const char *filename, uint32_t width, uint32_t height,
+    const jpeg_read_option_t *opt) {
+  FILE *fp;
+  if ((fp = fopen(filename, "rb")) == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  image_t *img = read_jpeg_stream_scaled(fp, width, height, opt);
+  fclose(fp);
+  return img;
+}
+
+/**
+ * @brief デコード結果を格納する画像を確保する。
+ *
+ * jpeg_start_decompress()の後に呼び出すこと。
+ * 減色する場合はlibjpegのカラーマップをカラーパレットに設定する。
+ *
+ * @param[in] jpegd jpeg_decompress_struct
+ * @return 確保した画像、出力の色空間に対応していない場合と失敗した場合NULL
+ */
+static image_t *allocate_output_image(j_decompress_ptr jpegd) {
+  uint32_t i;
+  int type;
+  image_t *img;
+  switch (jpegd->out_color_space) {
+    case JCS_GRAYSCALE:
+      type = COLOR_TYPE_GRAY;
+      break;
+    case JCS_RGB:
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_RGBA:
+#endif
+      type = COLOR_TYPE_RGB;
+      break;
+    default:
+      return NULL;
+  }
+  if (jpegd->quantize_colors) {
+    type = COLOR_TYPE_INDEX;
+  }
+  if ((img = allocate_image(jpegd->output_width, jpegd->output_height, type)) == NULL) {
+    return NULL;
+  }
+  if (jpegd->quantize_colors) {
+    img->palette_num = jpegd->actual_number_of_colors;
+    for (i = 0; i < img->palette_num; i++) {
+      if (jpegd->out_color_components == 1) {
+        img->palette[i] = color_from_rgb(jpegd->colormap[0][i],
+            jpegd->colormap[0][i], jpegd->colormap[0][i]);
+      } else {
+        img->palette[i] = color_from_rgb(jpegd->colormap[0][i],
+            jpegd->colormap[1][i], jpegd->colormap[2][i]);
+      }
+    }
+  }
+  return img;
+}
+
+/**
+ * @brief 出力パスの全ての行を画像データに読み込む。
+ *
+ * @param[in,out] jpegd jpeg_decompress_struct
+ * @param[out]    img   読み込み先の画像
+ */
+static void read_output_rows(j_decompress_ptr jpegd, image_t *img) {
+  uint32_t y, n, i;
+  // 画像データの行に直接デコードし、libjpegが一度に出力できるだけの行をまとめて読み込む
+  while (jpegd->output_scanline < jpegd->output_height) {
+    y = jpegd->output_scanline;
+    n = jpeg_read_scanlines(jpegd, (JSAMPARRAY) (img->map + y), jpegd->output_height - y);
+    if (jpegd->output_components < 4) {
+      for (i = 0; i < n; i++) {
+        expand_row(img->map[y + i], jpegd->output_width, jpegd->output_components);
+      }
+    }
+  }
+}
+
+/**
+ * @brief JPEG形式の画像を1つのスレッドで読み込む。
+ *
+ * fpがNULLの場合はメモリ上のデータから読み込む。
+ * ctxを指定した場合はコンテキストのjpeg_decompress_structを使い回す。
+ *
+ * @param[in,out] ctx    コンテキスト、NULLの場合は使用しない。fpを指定した場合のみ使用できる
+ * @param[in]     fp     ファイルストリーム、NULLの場合はdataから読み込む
+ * @param[in]     data   JPEG形式のデータ
+ * @param[in]     size   データのサイズ
+ * @param[in]     width  必要な幅、0の場合は幅を考慮しない
+ * @param[in]     height 必要な高さ、0の場合は高さを考慮しない
+ * @param[in]     opt    読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+static image_t *read_jpeg(jpeg_context_t *ctx, FILE *fp, const uint8_t *data, size_t size,
+    uint32_t width, uint32_t height, const jpeg_read_option_t *opt) {
+  result_t result = FAILURE;
+  struct jpeg_decompress_struct local;
+  my_error_mgr localerr;
+  j_decompress_ptr jpegd = &local;
+  my_error_mgr *myerr = &localerr;
+  image_t *volatile img = NULL;
+  if (ctx != NULL) {
+    jpegd = &ctx->jpegd;
+    myerr = &ctx->derr;
+  }
+  if (ctx == NULL || !ctx->has_decompress) {
+    jpegd->err = jpeg_std_error(&myerr->jerr);
+    myerr->jerr.error_exit = error_exit;
+  }
+  if (setjmp(myerr->jmpbuf)) {
+    goto error;
+  }
+  if (ctx == NULL || !ctx->has_decompress) {
+    jpeg_create_decompress(jpegd);
+    if (ctx != NULL) {
+      ctx->has_decompress = TRUE;
+    }
+  }
+  if (fp != NULL) {
+    jpeg_stdio_src(jpegd, fp);
+  } else {
+    jpeg_mem_src(jpegd, data, size);
+  }
+  if (jpeg_read_header(jpegd, TRUE) != JPEG_HEADER_OK) {
+    goto error;
+  }
+  if (opt != NULL) {
+    set_jpeg_read_option(jpegd, opt);
+  }
+  set_jpeg_scale(jpegd, width, height);
+#ifdef JCS_ALPHA_EXTENSIONS
+  if (jpegd->out_color_space == JCS_RGB && !jpegd->quantize_colors) {
+    // 4byte目を0xffで埋めさせることで、画像データの行にそのまま展開できる
+    jpegd->out_color_space = JCS_EXT_RGBA;
+  }
+#endif
+  jpeg_start_decompress(jpegd);
+  if ((img = allocate_output_image(jpegd)) == NULL) {
+    goto error;
+  }
+  read_output_rows(jpegd, img);
+  jpeg_finish_decompress(jpegd);
+  result = SUCCESS;
+  error:
+  if (ctx == NULL) {
+    jpeg_destroy_decompress(jpegd);
+  } else if (result != SUCCESS) {
+    // 永続的なメモリプールは残したまま、次の画像を読み込める状態に戻す
+    jpeg_abort_decompress(jpegd);
+  }
+  if (result != SUCCESS) {
+    free_image(img);
+    img = NULL;
+  }
+  return img;
+}
+
+#define STREAM_BUFFER_SIZE 65536 /**< ストリームを読み込む際のバッファの初期サイズ */
+
+/**
+ * @brief ストリームの終端までをメモリに読み込む。
+ *
+ * @param[in]  fp   ファイルストリーム
+ * @param[out] size 読み込んだサイズ
+ * @return 読み込んだデータ、失敗した場合NULL
+ */
+static uint8_t *read_whole_stream(FILE *fp, size_t *size) {
+  size_t capacity = STREAM_BUFFER_SIZE;
+  size_t length = 0;
+  uint8_t *data = malloc(capacity);
+  uint8_t *tmp;
+  if (data == NULL) {
+    return NULL;
+  }
+  while (TRUE) {
+    length += fread(data + length, 1, capacity - length, fp);
+    if (length < capacity) {
+      break;
+    }
+    capacity *= 2;
+    if ((tmp = realloc(data, capacity)) == NULL) {
+      free(data);
+      return NULL;
+    }
+    data = tmp;
+  }
+  if (ferror(fp)) {
+    free(data);
+    return NULL;
+  }
+  *size = length;
+  return data;
+}
+
+/**
+ * @brief メッセージを出力しない。
+ *
+ * 並列デコードに失敗した場合は1つのスレッドで読み込み直してメッセージを出すため、
+ * 並列デコード中のメッセージは捨てる。
+ */
+static void discard_message(j_common_ptr cinfo) {
+  (void) cinfo;
+}
+
+/**
+ * @brief 並列デコードに必要なJPEGの構造
+ */
+typedef struct jpeg_layout_t {
+  uint32_t width;            /**< 画像の幅 */
+  uint32_t height;           /**< 画像の高さ */
+  int type;                  /**< 読み込む画像の色の種類 */
+  uint32_t mcus_per_row;     /**< 1行のMCUの数 */
+  uint32_t mcu_height;       /**< MCUの高さ */
+  uint32_t restart_interval; /**< リスタート区間のMCUの数 */
+  size_t sof;                /**< SOFマーカーの画像の高さの位置 */
+  size_t scan;               /**< エントロピー符号化データの先頭の位置 */
+} jpeg_layout_t;
+
+/**
+ * @brief JPEGのヘッダから指定した範囲のマーカーを探す。
+ *
+ * SOIの直後からSOSマーカーまで、各マーカーの長さに従ってたどる。
+ *
+ * @param[in] data  JPEG形式のデータ
+ * @param[in] size  データのサイズ
+ * @param[in] first 探すマーカーの範囲の先頭
+ * @param[in] last  探すマーカーの範囲の末尾
+ * @return 見つかったマーカーの位置、見つからない場合size
+ */
+static size_t find_jpeg_marker(const uint8_t *data, size_t size, int first, int last) {
+  size_t pos = 2;
+  while (pos + 4 <= size && data[pos] == 0xFF) {
+    if (data[pos + 1] == 0xFF) {
+      // マーカーの前の埋め草
+      pos++;
+      continue;
+    }
+    if (data[pos + 1] >= first && data[pos + 1] <= last) {
+      return pos;
+    }
+    if (data[pos + 1] == 0xDA) {
+      break;
+    }
+    pos += 2 + (data[pos + 2] << 8 | data[pos + 3]);
+  }
+  return size;
+}
+
+/**
+ * @brief 並列デコードに必要なJPEGの構造を読み取る。
+ *
+ * ハフマン符号化の1スキャンで、リスタート区間が設定されている場合のみ並列にデコードできる。
+ *
+ * @param[in]  data   JPEG形式のデータ
+ * @param[in]  size   データのサイズ
+ * @param[out] layout JPEGの構造
+ * @return 並列にデコードできるか否か
+ */
+static result_t read_jpeg_layout(const uint8_t *data, size_t size, jpeg_layout_t *layout) {
+  result_t result = FAILURE;
+  size_t pos;
+  uint32_t h, v;
+  struct jpeg_decompress_struct jpegd;
+  my_error_mgr myerr;
+  jpegd.err = jpeg_std_error(&myerr.jerr);
+  myerr.jerr.error_exit = error_exit;
+  myerr.jerr.output_message = discard_message;
+  if (setjmp(myerr.jmpbuf)) {
+    goto error;
+  }
+  jpeg_create_decompress(&jpegd);
+  jpeg_mem_src(&jpegd, data, size);
+  if (jpeg_read_header(&jpegd, TRUE) != JPEG_HEADER_OK) {
+    goto error;
+  }
+  if (jpegd.progressive_mode || jpegd.arith_code || jpegd.restart_interval == 0
+      || jpegd.comps_in_scan != jpegd.num_components) {
+    goto error;
+  }
+  switch (jpegd.out_color_space) {
+    case JCS_GRAYSCALE:
+      layout->type = COLOR_TYPE_GRAY;
+      break;
+    case JCS_RGB:
+      layout->type = COLOR_TYPE_RGB;
+      break;
+    default:
+      goto error;
+  }
+  // 1成分のスキャンではMCUは1ブロック、複数成分のスキャンでは最大のサンプリング係数分のブロック
+  h = jpegd.comps_in_scan == 1 ? 1 : jpegd.max_h_samp_factor;
+  v = jpegd.comps_in_scan == 1 ? 1 : jpegd.max_v_samp_factor;
+  layout->width = jpegd.image_width;
+  layout->height = jpegd.image_height;
+  layout->mcus_per_row = (jpegd.image_width + h * DCTSIZE - 1) / (h * DCTSIZE);
+  layout->mcu_height = v * DCTSIZE;
+  layout->restart_interval = jpegd.restart_interval;
+  // SOSマーカーまで読んだ位置がエントロピー符号化データの先頭
+  layout->scan = jpegd.src->next_input_byte - data;
+  if ((pos = find_jpeg_marker(data, layout->scan, 0xC0, 0xC1)) + 7 <= layout->scan) {
+    layout->sof = pos + 5;
+    result = SUCCESS;
+  }
+  error:
+  jpeg_destroy_decompress(&jpegd);
+  return result;
+}
+
+/**
+ * @brief 並列デコードで1つのスレッドが担当するバンド
+ *
+ * バンドごとにリスタート区間を切り出した独立したJPEGを作成してデコードする。
+ * 色差の補間は上下のMCU行を参照するため、隣接するバンドと重なる範囲もデコードし、
+ * 重なった行は捨てて担当する行だけを画像データに書き込む。
+ */
+typedef struct jpeg_band_t {
+  const jpeg_read_option_t *opt; /**< 読み込みオプション */
+  image_t *img;      /**< 書き込み先の画像 */
+  uint8_t *data;     /**< 切り出したJPEG */
+  size_t size;       /**< 切り出したJPEGのサイズ */
+  uint32_t top;      /**< 切り出したJPEGの先頭行の画像上の位置 */
+  uint32_t bottom;   /**< 切り出したJPEGの最終行の次の行の画像上の位置 */
+  uint32_t start;    /**< 担当する先頭の行 */
+  uint32_t end;      /**< 担当する最終行の次の行 */
+  result_t result;   /**< 処理結果 */
+  int running;       /**< スレッドが動作中か否か */
+  pthread_t thread;  /**< 処理を行うスレッド */
+} jpeg_band_t;
+
+/**
+ * @brief 1つのバンドをデコードする。
+ *
+ * @param[in,out] arg jpeg_band_t
+ * @return NULL
+ */
+static void *decode_band(void *arg) {
+  jpeg_band_t *band = arg;
+  image_t *img = band->img;
+  uint32_t y, n, i;
+  struct jpeg_decompress_struct jpegd;
+  my_error_mgr myerr;
+  JSAMPARRAY volatile rows = NULL;
+  JSAMPROW volatile scratch = NULL;
+  band->result = FAILURE;
+  jpegd.err = jpeg_std_error(&myerr.jerr);
+  myerr.jerr.error_exit = error_exit;
+  myerr.jerr.output_message = discard_message;
+  if (setjmp(myerr.jmpbuf)) {
+    goto error;
+  }
+  jpeg_create_decompress(&jpegd);
+  jpeg_mem_src(&jpegd, band->data, band->size);
+  if (jpeg_read_header(&jpegd, TRUE) != JPEG_HEADER_OK) {
+    goto error;
+  }
+  set_jpeg_read_option(&jpegd, band->opt);
+#ifdef JCS_ALPHA_EXTENSIONS
+  if (jpegd.out_color_space == JCS_RGB) {
+    jpegd.out_color_space = JCS_EXT_RGBA;
+  }
+#endif
+  jpeg_start_decompress(&jpegd);
+  if (jpegd.output_width != img->width || jpegd.output_height != band->bottom - band->top) {
+    goto error;
+  }
+  if ((rows = malloc(sizeof(JSAMPROW) * jpegd.output_height)) == NULL
+      || (scratch = malloc(sizeof(pixcel_t) * img->width)) == NULL) {
+    goto error;
+  }
+  // 担当する行は画像データの行に直接デコードし、重なった行は作業用の行に捨てる
+  for (y = 0; y < jpegd.output_height; y++) {
+    if (band->top + y >= band->start && band->top + y < band->end) {
+      rows[y] = (JSAMPROW) img->map[band->top + y];
+    } else {
+      rows[y] = scratch;
+    }
+  }
+  while (jpegd.output_scanline < jpegd.output_height) {
+    y = jpegd.output_scanline;
+    n = jpeg_read_scanlines(&jpegd, rows + y, jpegd.output_height - y);
+    if (jpegd.output_components < 4) {
+      for (i = y; i < y + n; i++) {
+        if (rows[i] != scratch) {
+          expand_row((pixcel_t *) rows[i], jpegd.output_width, jpegd.output_components);
+        }
+      }
+    }
+  }
+  jpeg_finish_decompress(&jpegd);
+  band->result = SUCCESS;
+  error:
+  jpeg_destroy_decompress(&jpegd);
+  free(rows);
+  free(scratch);
+  return NULL;
+}
+
+/**
+ * @brief 最大公約数を返す。
+ *
+ * @param[in] a 値
+ * @param[in] b 値
+ * @return aとbの最大公約数
+ */
+static uint32_t gcd(uint32_t a, uint32_t b) {
+  uint32_t t;
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/**
+ * @brief バンドを担当する区間を切り出した独立したJPEGを作成する。
+ *
+ * ヘッダはそのまま複製してSOFの高さだけを書き換え、
+ * 区間の間のリスタートマーカーは0から振り直し、末尾にEOIを付ける。
+ *
+ * @param[in,out] band    バンド
+ * @param[in]     data    JPEG形式のデータ
+ * @param[in]     layout  JPEGの構造
+ * @param[in]     markers リスタートマーカーの位置
+ * @param[in]     first   切り出す先頭の区間
+ * @param[in]     last    切り出す最後の区間の次の区間
+ * @param[in]     from    切り出すエントロピー符号化データの先頭の位置
+ * @param[in]     to      切り出すエントロピー符号化データの末尾の次の位置
+ * @return 成否
+ */
+static result_t make_band_data(jpeg_band_t *band, const uint8_t *data,
+    const jpeg_layout_t *layout, const size_t *markers, size_t first, size_t last,
+    size_t from, size_t to) {
+  size_t i;
+  uint32_t height = band->bottom - band->top;
+  band->size = layout->scan + (to - from) + 2;
+  if ((band->data = malloc(band->size)) == NULL) {
+    return FAILURE;
+  }
+  memcpy(band->data, data, layout->scan);
+  band->data[layout->sof] = height >> 8;
+  band->data[layout->sof + 1] = height & 0xff;
+  memcpy(band->data + layout->scan, data + from, to - from);
+  for (i = first; i + 1 < last; i++) {
+    band->data[layout->scan + markers[i] - from + 1] = JPEG_RST0 + ((i - first) & 7);
+  }
+  band->data[band->size - 2] = 0xFF;
+  band->data[band->size - 1] = JPEG_EOI;
+  return SUCCESS;
+}
+
+/**
+ * @brief リスタート区間ごとに並列にJPEG形式のデータを読み込む。
+ *
+ * エントロピー符号化データをリスタートマーカーで独立した区間に分割し、
+ * MCU行の境界で区切ったバンドを各スレッドで画像データの別々の行にデコードする。
+ *
+ * @param[in] data JPEG形式のデータ
+ * @param[in] size データのサイズ
+ * @param[in] opt  読み込みオプション
+ * @return 読み込んだ画像、並列に読み込めない場合と失敗した場合NULL
+ */
+static image_t *decode_jpeg_parallel(const uint8_t *data, size_t size,
+    const jpeg_read_option_t *opt) {
+  result_t result = FAILURE;
+  jpeg_layout_t layout;
+  image_t *img = NULL;
+  jpeg_band_t *bands = NULL;
+  size_t *markers = NULL;
+  size_t count = 0;
+  size_t segments, pos, end, first, last;
+  const uint8_t *p;
+  uint32_t mcu_rows, unit, units, num, i, r0, r1, a, b;
+  // 減色の誤差拡散は行をまたぐため並列にデコードしない
+  if (opt->colors > 0 || read_jpeg_layout(data, size, &layout) != SUCCESS) {
+    return NULL;
+  }
+  mcu_rows = (layout.height + layout.mcu_height - 1) / layout.mcu_height;
+  segments = ((uint64_t) mcu_rows * layout.mcus_per_row + layout.restart_interval - 1)
+      / layout.restart_interval;
+  // 区間の境界がMCU行の境界と一致する最小の行数を単位としてバンドに分ける
+  unit = layout.restart_interval / gcd(layout.restart_interval, layout.mcus_per_row);
+  units = (mcu_rows + unit - 1) / unit;
+  num = units < (uint32_t) opt->threads ? units : (uint32_t) opt->threads;
+  if (num < 2) {
+    return NULL;
+  }
+  if ((markers = malloc(sizeof(size_t) * segments)) == NULL) {
+    return NULL;
+  }
+  end = size;
+  pos = layout.scan;
+  while (pos < size && (p = memchr(data + pos, 0xFF, size - pos)) != NULL) {
+    pos = p - data;
+    if (pos + 1 >= size) {
+      break;
+    }
+    if (data[pos + 1] == 0x00) {
+      pos += 2;
+    } else if (data[pos + 1] == 0xFF) {
+      pos++;
+    } else if (data[pos + 1] >= JPEG_RST0 && data[pos + 1] <= JPEG_RST0 + 7) {
+      if (count + 1 >= segments) {
+        goto error;
+      }
+      markers[count++] = pos;
+      pos += 2;
+    } else {
+      end = pos;
+      break;
+    }
+  }
+  if (count + 1 != segments) {
+    goto error;
+  }
+  if ((img = allocate_image(layout.width, layout.height, layout.type)) == NULL
+      || (bands = calloc(num, sizeof(jpeg_band_t))) == NULL) {
+    goto error;
+  }
+  for (i = 0; i < num; i++) {
+    r0 = (uint64_t) units * i / num * unit;
+    r1 = (uint64_t) units * (i + 1) / num * unit;
+    r1 = r1 < mcu_rows ? r1 : mcu_rows;
+    // 色差の補間のため上下に1単位ずつ重ねてデコードする
+    a = r0 > 0 ? r0 - unit : 0;
+    b = r1 + unit < mcu_rows ? r1 + unit : mcu_rows;
+    first = (uint64_t) a * layout.mcus_per_row / layout.restart_interval;
+    last = b < mcu_rows ? (uint64_t) b * layout.mcus_per_row / layout.restart_interval : segments;
+    bands[i].opt = opt;
+    bands[i].img = img;
+    bands[i].top = a * layout.mcu_height;
+    bands[i].bottom = b < mcu_rows ? b * layout.mcu_height : layout.height;
+    bands[i].start = r0 * layout.mcu_height;
+    bands[i].end = r1 < mcu_rows ? r1 * layout.mcu_height : layout.height;
+    if (make_band_data(&bands[i], data, &layout, markers, first, last,
+        first == 0 ? layout.scan : markers[first - 1] + 2,
+        last == segments ? end : markers[last - 1]) != SUCCESS) {
+      goto error;
+    }
+  }
+  // 先頭以外のバンドを別スレッドで処理し、先頭のバンドはこのスレッドで処理する
+  for (i = 1; i < num; i++) {
+    bands[i].running = (pthread_create(&bands[i].thread, NULL, decode_band, &bands[i]) == 0);
+  }
+  decode_band(&bands[0]);
+  for (i = 0; i < num; i++) {
+    if (bands[i].running) {
+      pthread_join(bands[i].thread, NULL);
+      bands[i].running = FALSE;
+    } else if (i > 0) {
+      // スレッドを作成できなかった場合はこのスレッドで処理する
+      decode_band(&bands[i]);
+    }
+  }
+  for (i = 0; i < num; i++) {
+    if (bands[i].result != SUCCESS) {
+      goto error;
+    }
+  }
+  result = SUCCESS;
+  error:
+  if (bands != NULL) {
+    for (i = 0; i < num; i++) {
+      free(bands[i].data);
+    }
+    free(bands);
+  }
+  free(markers);
+  if (result != SUCCESS) {
+    free_image(img);
+    img = NULL;
+  }
+  return img;
+}
+
+/**
+ * @brief ストリームを全て読み込んでから並列にJPEG形式の画像を読み込む。
+ *
+ * 並列に読み込めない場合は、読み込んだデータから1つのスレッドで読み込む。
+ *
+ * @param[in] fp  ファイルストリーム
+ * @param[in] opt 読み込みオプション
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+static image_t *read_jpeg_parallel(FILE *fp, const jpeg_read_option_t *opt) {
+  size_t size;
+  image_t *img;
+  uint8_t *data = read_whole_stream(fp, &size);
+  if (data == NULL) {
+    return NULL;
+  }
+  if ((img = decode_jpeg_parallel(data, size, opt)) == NULL) {
+    img = read_jpeg(NULL, NULL, data, size, 0, 0, opt);
+  }
+  free(data);
+  return img;
+}
+/**
+ * @brief 縮小してJPEG形式のファイルを読み込む。
+ *
+ * サムネイルの作成などのため、逆DCTの段階で縮小して読み込む。
+ * 読み込んだ画像は指定した大きさ以上となる最小の大きさであり、
+ * 指定した大きさちょうどにするには呼び出し側で縮小すること。
+ * 全ての画素を復元してから縮小するよりも、逆DCTや色変換の処理量とメモリ使用量が少ない。
+ * 縮小しない場合はoptのthreadsに従い、リスタートマーカーのあるJPEGを並列にデコードする。
+ *
+ * @param[in] fp     ファイルストリーム
+ * @param[in] width  必要な幅、0の場合は幅を考慮しない
+ * @param[in] height 必要な高さ、0の場合は高さを考慮しない
+ * @param[in] opt    読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_stream_scaled(FILE *fp, uint32_t width, uint32_t height,
+    const jpeg_read_option_t *opt) {
+  if (opt != NULL && opt->threads > 1 && width == 0 && height == 0) {
+    return read_jpeg_parallel(fp, opt);
+  }
+  return read_jpeg(NULL, fp, NULL, 0, width, height, opt);
+}
+
+/**
+ * @brief コンテキストを使い回してJPEG形式のファイルを読み込む。
+ *
+ * コンテキストのjpeg_decompress_structを使い回すため、
+ * 小さな画像を連続して読み込む場合の初期化と後始末が省かれる。
+ * optのthreadsは使用せず、常に1つのスレッドで読み込む。
+ *
+ * @param[in,out] ctx コンテキスト
+ * @param[in]     fp  ファイルストリーム
+ * @param[in]     opt 読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_stream_with_context(jpeg_context_t *ctx, FILE *fp,
+    const jpeg_read_option_t *opt) {
+  if (ctx == NULL) {
+    return NULL;
+  }
+  return read_jpeg(ctx, fp, NULL, 0, 0, 0, opt);
+}
+
+/**
+ * @brief メモリ上のJPEG形式のデータを読み込む。
+ *
+ * @param[in] data JPEG形式のデータ
+ * @param[in] size データのサイズ
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_memory(const uint8_t *data, size_t size) {
+  return read_jpeg_memory_with_option(data, size, NULL);
+}
+
+/**
+ * @brief オプションを指定してメモリ上のJPEG形式のデータを読み込む。
+ *
+ * jpeg_mem_src()でデータを直接デコードする。
+ * optのthreadsが2以上の場合、リスタートマーカーのあるJPEGを並列にデコードする。
+ *
+ * @param[in] data JPEG形式のデータ
+ * @param[in] size データのサイズ
+ * @param[in] opt  読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_memory_with_option(const uint8_t *data, size_t size,
+    const jpeg_read_option_t *opt) {
+  image_t *img;
+  if (data == NULL || size == 0) {
+    return NULL;
+  }
+  if (opt != NULL && opt->threads > 1
+      && (img = decode_jpeg_parallel(data, size, opt)) != NULL) {
+    return img;
+  }
+  return read_jpeg(NULL, NULL, data, size, 0, 0, opt);
+}
+
+/**
+ * @brief スキャンごとに途中経過を通知しながらJPEG形式のファイルを読み込む。
+ *
+ * @param[in] filename ファイル名
+ * @param[in] opt      読み込みオプション、NULLの場合標準の設定
+ * @param[in] callback スキャンを読み込むごとに呼ばれるコールバック
+ * @param[in] user     コールバックに渡すポインタ
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_file_progressive(const char *filename, const jpeg_read_option_t *opt,
+    jpeg_scan_callback_t callback, void *user) {
+  FILE *fp;
+  if ((fp = fopen(filename, "rb")) == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  image_t *img = read_jpeg_stream_progressive(fp, opt, callback, user);
+  fclose(fp);
+  return img;
+}
+
+/**
+ * @brief スキャンごとに途中経過を通知しながらJPEG形式のファイルを読み込む。
+ *
+ * プログレッシブJPEGをlibjpegのバッファードイメージモードで読み込み、
+ * スキャンを1つ読み終えるごとにそこまでの情報で画像を復元してコールバックを呼ぶ。
+ * 表示側は全体を読み終える前から粗い画像を表示できる。
+ * コールバックがFALSEを返した場合は残りのスキャンを読まずに打ち切り、その時点の画像を返す。
+ * スキャンが1つだけのJPEGは通常通り読み込み、最後のスキャンとして1度だけコールバックを呼ぶ。
+ *
+ * @param[in] fp       ファイルストリーム
+ * @param[in] opt      読み込みオプション、NULLの場合標準の設定
+ * @param[in] callback スキャンを読み込むごとに呼ばれるコールバック、NULLの場合は呼ばない
+ * @param[in] user     コールバックに渡すポインタ
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_jpeg_stream_progressive(FILE *fp, const jpeg_read_option_t *opt,
+    jpeg_scan_callback_t callback, void *user) {
+  result_t result = FAILURE;
+  int ret, scan, final;
+  struct jpeg_decompress_struct jpegd;
+  my_error_mgr myerr;
+  image_t *volatile img = NULL;
+  jpegd.err = jpeg_std_error(&myerr.jerr);
+  myerr.jerr.error_exit = error_exit;
+  if (setjmp(myerr.jmpbuf)) {
+    goto error;
+  }
+  jpeg_create_decompress(&jpegd);
+  jpeg_stdio_src(&jpegd, fp);
+  if (jpeg_read_header(&jpegd, TRUE) != JPEG_HEADER_OK) {
+    goto error;
+  }
+  if (opt != NULL) {
+    set_jpeg_read_option(&jpegd, opt);
+  }
+#ifdef JCS_ALPHA_EXTENSIONS
+  if (jpegd.out_color_space == JCS_RGB && !jpegd.quantize_colors) {
+    jpegd.out_color_space = JCS_EXT_RGBA;
+  }
+#endif
+  jpegd.buffered_image = jpeg_has_multiple_scans(&jpegd);
+  jpeg_start_decompress(&jpegd);
+  if ((img = allocate_output_image(&jpegd)) == NULL) {
+    goto error;
+  }
+  if (!jpegd.buffered_image) {
+    read_output_rows(&jpegd, img);
+    jpeg_finish_decompress(&jpegd);
+    if (callback != NULL) {
+      callback(user, img, 1, TRUE);
+    }
+  } else {
+    final = FALSE;
+    while (!final) {
+      // 次のスキャンの先頭か終端に達するまで読み進め、読み終えたスキャンを出力する
+      do {
+        ret = jpeg_consume_input(&jpegd);
+      } while (ret != JPEG_REACHED_SOS && ret != JPEG_REACHED_EOI && ret != JPEG_SUSPENDED);
+      final = (ret != JPEG_REACHED_SOS);
+      scan = final ? jpegd.input_scan_number : jpegd.input_scan_number - 1;
+      jpeg_start_output(&jpegd, scan);
+      read_output_rows(&jpegd, img);
+      jpeg_finish_output(&jpegd);
+      if (callback != NULL && !callback(user, img, scan, final) && !final) {
+        // 打ち切った場合は残りのデータを読まない
+        jpeg_abort_decompress(&jpegd);
+        break;
+      }
+    }
+    if (final) {
+      jpeg_finish_decompress(&jpegd);
+    }
+  }
+  result = SUCCESS;
+  error:
+  jpeg_destroy_decompress(&jpegd);
+  if (result != SUCCESS) {
+    free_image(img);
+    img = NULL;
+  }
+  return img;
+}
+
+/**
+ * @brief JPEG形式としてファイルに書き出す。
+ *
+ * @param[in] filename 書き出すファイル名
+ * @param[in] img      画像データ
+ * @return 成否
+ */
+result_t write_jpeg_file(const char *filename, image_t *img) {
+  result_t result = FAILURE;
+  FILE *fp;
+  if (img == NULL) {
+    return result;
+  }
+  if ((fp = fopen(filename, "wb")) == NULL) {
+    perror(filename);
+    return result;
+  }
+  result = write_jpeg_stream(fp, img);
+  fclose(fp);
+  return result;
+}
+
+/**
+ * @brief オプションを指定してJPEG形式としてファイルに書き出す。
+ *
+ * @param[in] filename 書き出すファイル名
+ * @param[in] img      画像データ
+ * @param[in] opt      書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_jpeg_file_with_option(const char *filename, image_t *img,
+    const jpeg_write_option_t *opt) {
+  result_t result = FAILURE;
+  FILE *fp;
+  if (img == NULL) {
+    return result;
+  }
+  if ((fp = fopen(filename, "wb")) == NULL) {
+    perror(filename);
+    return result;
+  }
+  result = write_jpeg_stream_with_option(fp, img, opt);
+  fclose(fp);
+  return result;
+}
+
+/**
+ * @brief JPEG書き出しオプションを標準の設定で初期化する。
+ *
+ * 品質75、4:2:0のサブサンプリング、ベースライン、標準のハフマン符号表、
+ * 正確な整数演算のDCTとする。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_jpeg_write_option(jpeg_write_option_t *opt) {
+  opt->quality = 75;
+  opt->subsampling = JPEG_SUBSAMPLING_420;
+  opt->progressive = FALSE;
+  opt->optimize_coding = FALSE;
+  opt->dct_method = JPEG_DCT_ISLOW;
+  opt->restart_interval = 0;
+  opt->smoothing = 0;
+  opt->threads = 1;
+}
+
+/**
+ * @brief JPEG書き出しオプションを速度優先の設定で初期化する。
+ *
+ * プレビュー向けに、精度よりも速さを優先した高速な整数演算のDCTを使用する。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_jpeg_write_option_fastest(jpeg_write_option_t *opt) {
+  init_jpeg_write_option(opt);
+  opt->dct_method = JPEG_DCT_IFAST;
+}
+
+/**
+ * @brief JPEG書き出しオプションをサイズ優先の設定で初期化する。
+ *
+ * 保存用に、プログレッシブJPEGとしてハフマン符号表を最適化する。
+ * 画質は変わらないが、エンコードに時間がかかる。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_jpeg_write_option_smallest(jpeg_write_option_t *opt) {
+  init_jpeg_write_option(opt);
+  opt->progressive = TRUE;
+  opt->optimize_coding = TRUE;
+}
+
+/**
+ * @brief サブサンプリングの指定に対応する輝度の成分のサンプリング係数を返す。
+ *
+ * @param[in]  subsampling 色差のサブサンプリング(JPEG_SUBSAMPLING_*)
+ * @param[out] h           水平方向のサンプリング係数
+ * @param[out] v           垂直方向のサンプリング係数
+ */
+static void get_samp_factor(int subsampling, int *h, int *v) {
+  switch (subsampling) {
+    case JPEG_SUBSAMPLING_444:
+      *h = 1;
+      *v = 1;
+      break;
+    case JPEG_SUBSAMPLING_422:
+      *h = 2;
+      *v = 1;
+      break;
+    default:
+      *h = 2;
+      *v = 2;
+      break;
+  }
+}
+
+/**
+ * @brief 書き出しオプションをlibjpegに設定する。
+ *
+ * jpeg_set_defaults()の後に呼び出すこと。
+ *
+ * @param[in,out] jpegc jpeg_compress_struct
+ * @param[in]     opt   書き出しオプション
+ */
+static void set_jpeg_write_option(j_compress_ptr jpegc, const jpeg_write_option_t *opt) {
+  int h, v;
+  jpeg_set_quality(jpegc, opt->quality, TRUE);
+  get_samp_factor(opt->subsampling, &h, &v);
+  if (jpegc->num_components >= 3) {
+    // 色差の成分を1とした輝度の成分のサンプリング係数で指定する
+    jpegc->comp_info[0].h_samp_factor = h;
+    jpegc->comp_info[0].v_samp_factor = v;
+  }
+  if (opt->progressive) {
+    jpeg_simple_progression(jpegc);
+  }
+  jpegc->optimize_coding = opt->optimize_coding ? TRUE : FALSE;
+  jpegc->dct_method = get_dct_method(opt->dct_method);
+  jpegc->restart_interval = opt->restart_interval > 0 ? opt->restart_interval : 0;
+  jpegc->smoothing_factor = opt->smoothing > 0 ? opt->smoothing : 0;
+}
+
+/**
+ * @brief JPEG形式としてファイルに書き出す。
+ *
+ * @param[in] fp  書き出すファイルストリームのポインタ
+ * @param[in] img 画像データ
+ * @return 成否
+ */
+result_t write_jpeg_stream(FILE *fp, image_t *img) {
+  return write_jpeg_stream_with_option(fp, img, NULL);
+}
+
+/**
+ * @brief 画像の指定した範囲の行をJPEG形式で書き出す。
+ *
+ * fpがNULLの場合はjpeg_mem_dest()でメモリ上に書き出す。
+ * ctxを指定した場合はコンテキストのjpeg_compress_structと作業領域を使い回す。
+ * 画像はRGBかグレースケールであること。
+ *
+ * @param[in,out] ctx    コンテキスト、NULLの場合は使用しない。fpを指定した場合のみ使用できる
+ * @param[in]     fp     書き出すファイルストリームのポインタ、NULLの場合はメモリに書き出す
+ * @param[out]    data   メモリに書き出したデータ、呼び出し側でfree()すること
+ * @param[out]    size   メモリに書き出したデータのサイズ
+ * @param[in]     img    画像データ
+ * @param[in]     top    書き出す先頭の行
+ * @param[in]     height 書き出す行数
+ * @param[in]     opt    書き出しオプション
+ * @return 成否
+ */
+static result_t encode_jpeg(jpeg_context_t *ctx, FILE *fp, unsigned char **data,
+    unsigned long *size, image_t *img, uint32_t top, uint32_t height,
+    const jpeg_write_option_t *opt) {
+  result_t result = FAILURE;
+  uint32_t x, y, n, i;
+  int direct = FALSE;
+  struct jpeg_compress_struct local;
+  my_error_mgr localerr;
+  j_compress_ptr jpegc = &local;
+  my_error_mgr *myerr = &localerr;
+  JSAMPARRAY volatile rows = NULL;
+  JSAMPROW row;
+  if (ctx != NULL) {
+    jpegc = &ctx->jpegc;
+    myerr = &ctx->cerr;
+  }
+  if (ctx == NULL || !ctx->has_compress) {
+    jpegc->err = jpeg_std_error(&myerr->jerr);
+    myerr->jerr.error_exit = error_exit;
+  }
+  if (setjmp(myerr->jmpbuf)) {
+    goto error;
+  }
+  if (ctx == NULL || !ctx->has_compress) {
+    jpeg_create_compress(jpegc);
+    if (ctx != NULL) {
+      ctx->has_compress = TRUE;
+    }
+  }
+  if (fp != NULL) {
+    jpeg_stdio_dest(jpegc, fp);
+  } else {
+    jpeg_mem_dest(jpegc, data, size);
+  }
+  jpegc->image_width = img->width;
+  jpegc->image_height = height;
+  if (img->color_type == COLOR_TYPE_GRAY) {
+    jpegc->input_components = 1;
+    jpegc->in_color_space = JCS_GRAYSCALE;
+  } else {
+#ifdef JCS_EXTENSIONS
+    // 4byte目を読み飛ばさせることで、画像データの行をそのまま渡せる
+    direct = TRUE;
+    jpegc->input_components = 4;
+    jpegc->in_color_space = JCS_EXT_RGBX;
+#else
+    jpegc->input_components = 3;
+    jpegc->in_color_space = JCS_RGB;
+#endif
+  }
+  // 量子化テーブルとハフマン符号表は作成済みであれば上書きするだけで再確保されない
+  jpeg_set_defaults(jpegc);
+  set_jpeg_write_option(jpegc, opt);
+  jpeg_start_compress(jpegc, TRUE);
+  if (direct) {
+    while (jpegc->next_scanline < jpegc->image_height) {
+      y = jpegc->next_scanline;
+      jpeg_write_scanlines(jpegc, (JSAMPARRAY) (img->map + top + y), height - y);
+    }
+  } else {
+    // MCUの高さ分の行をまとめて詰めて渡す
+    n = jpegc->max_v_samp_factor * DCTSIZE;
+    if ((rows = allocate_scratch_rows(ctx,
+        sizeof(JSAMPLE) * jpegc->input_components * img->width, n)) == NULL) {
+      goto error;
+    }
+    while (jpegc->next_scanline < jpegc->image_height) {
+      y = top + jpegc->next_scanline;
+      for (i = 0; i < n && y + i < top + height; i++) {
+        row = rows[i];
+        if (img->color_type == COLOR_TYPE_GRAY) {
+          for (x = 0; x < img->width; x++) {
+            *row++ = img->map[y + i][x].g;
+          }
+        } else {
+          for (x = 0; x < img->width; x++) {
+            *row++ = img->map[y + i][x].c.r;
+            *row++ = img->map[y + i][x].c.g;
+            *row++ = img->map[y + i][x].c.b;
+          }
+        }
+      }
+      jpeg_write_scanlines(jpegc, rows, i);
+    }
+  }
+  jpeg_finish_compress(jpegc);
+  result = SUCCESS;
+  error:
+  if (ctx == NULL) {
+    jpeg_destroy_compress(jpegc);
+  } else if (result != SUCCESS) {
+    // 永続的なメモリプールは残したまま、次の画像を書き出せる状態に戻す
+    jpeg_abort_compress(jpegc);
+  }
+  free_scratch_rows(ctx, rows);
+  return result;
+}
+
+/**
+ * @brief 並列圧縮で1つのスレッドが担当する帯
+ *
+ * 帯ごとに独立したJPEGとしてメモリ上に圧縮し、
+ * エントロピー符号化データをリスタートマーカーでつないで1つのJPEGにする。
+ */
+typedef struct jpeg_strip_t {
+  image_t *img;             /**< 画像データ */
+  jpeg_write_option_t opt;  /**< 書き出しオプション */
+  uint32_t top;             /**< 担当する先頭の行 */
+  uint32_t height;          /**< 担当する行数 */
+  uint32_t first;           /**< 先頭のリスタート区間の番号 */
+  unsigned char *data;      /**< 圧縮結果 */
+  unsigned long size;       /**< 圧縮結果のサイズ */
+  size_t sof;               /**< SOFマーカーの画像の高さの位置 */
+  size_t scan;              /**< エントロピー符号化データの先頭の位置 */
+  result_t result;          /**< 処理結果 */
+  int running;              /**< スレッドが動作中か否か */
+  pthread_t thread;         /**< 処理を行うスレッド */
+} jpeg_strip_t;
+
+/**
+ * @brief 1つの帯を圧縮する。
+ *
+ * 圧縮後、帯の中のリスタートマーカーを画像全体での番号に振り直す。
+ *
+ * @param[in,out] arg jpeg_strip_t
+ * @return NULL
+ */
+static void *encode_strip(void *arg) {
+  jpeg_strip_t *strip = arg;
+  const unsigned char *p;
+  size_t pos, end;
+  uint32_t count = 0;
+  strip->result = encode_jpeg(NULL, NULL, &strip->data, &strip->size,
+      strip->img, strip->top, strip->height, &strip->opt);
+  if (strip->result != SUCCESS) {
+    return NULL;
+  }
+  strip->result = FAILURE;
+  strip->sof = find_jpeg_marker(strip->data, strip->size, 0xC0, 0xC1);
+  pos = find_jpeg_marker(strip->data, strip->size, 0xDA, 0xDA);
+  if (strip->sof + 7 > strip->size || pos + 4 > strip->size) {
+    return NULL;
+  }
+  strip->sof += 5;
+  strip->scan = pos + 2 + (strip->data[pos + 2] << 8 | strip->data[pos + 3]);
+  // 末尾のEOIを除いた範囲がエントロピー符号化データ
+  if (strip->scan + 2 > strip->size) {
+    return NULL;
+  }
+  end = strip->size - 2;
+  pos = strip->scan;
+  while (pos < end && (p = memchr(strip->data + pos, 0xFF, end - pos)) != NULL) {
+    pos = p - strip->data;
+    if (pos + 1 < end && strip->data[pos + 1] >= JPEG_RST0 && strip->data[pos + 1] <= JPEG_RST0 + 7) {
+      strip->data[pos + 1] = JPEG_RST0 + ((strip->first + count++) & 7);
+    }
+    pos += 2;
+  }
+  strip->result = SUCCESS;
+  return NULL;
+}
+
+/**
+ * @brief 画像を横長の帯に分けて並列にJPEG形式で書き出す。
+ *
+ * MCU行の境界で分けた帯を各スレッドで標準のハフマン符号表により圧縮し、
+ * 帯の境界にリスタートマーカーを置いて1つのベースラインJPEGにつなぐ。
+ * リスタート区間を指定していない場合は帯の大きさをリスタート区間とする。
+ * 同じリスタート区間で1つのスレッドで書き出した場合と同じ結果になる。
+ *
+ * @param[in]  fp   書き出すファイルストリームのポインタ、NULLの場合はメモリに書き出す
+ * @param[out] data メモリに書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size メモリに書き出したデータのサイズ
+ * @param[in]  img  画像データ
+ * @param[in]  opt  書き出しオプション
+ * @return 成否
+ */
+static result_t write_jpeg_parallel(FILE *fp, unsigned char **data, unsigned long *size,
+    image_t *img, const jpeg_write_option_t *opt) {
+  result_t result = FAILURE;
+  stream_t out;
+  uint8_t *buffer;
+  size_t length;
+  jpeg_strip_t *strips = NULL;
+  uint32_t mcus_per_row, mcu_height, mcu_rows, restart, unit, units, num, i, r0, r1;
+  int h, v;
+  unsigned char marker[2];
+  if (img->color_type == COLOR_TYPE_GRAY) {
+    h = 1;
+    v = 1;
+  } else {
+    get_samp_factor(opt->subsampling, &h, &v);
+  }
+  mcus_per_row = (img->width + h * DCTSIZE - 1) / (h * DCTSIZE);
+  mcu_height = v * DCTSIZE;
+  mcu_rows = (img->height + mcu_height - 1) / mcu_height;
+  if (opt->restart_interval > 0) {
+    // 帯の境界はリスタート区間の境界とMCU行の境界が一致する行に限られる
+    restart = opt->restart_interval;
+    unit = restart / gcd(restart, mcus_per_row);
+  } else {
+    // DRIマーカーの16bitに収まる範囲で、帯の大きさをリスタート区間とする
+    unit = (mcu_rows + opt->threads - 1) / opt->threads;
+    if (unit > 0xFFFF / mcus_per_row) {
+      unit = 0xFFFF / mcus_per_row;
+    }
+    if (unit == 0) {
+      return encode_jpeg(NULL, fp, data, size, img, 0, img->height, opt);
+    }
+    restart = unit * mcus_per_row;
+  }
+  units = (mcu_rows + unit - 1) / unit;
+  num = units < (uint32_t) opt->threads ? units : (uint32_t) opt->threads;
+  if (num < 2) {
+    return encode_jpeg(NULL, fp, data, size, img, 0, img->height, opt);
+  }
+  if ((strips = calloc(num, sizeof(jpeg_strip_t))) == NULL) {
+    return FAILURE;
+  }
+  if (fp != NULL) {
+    stream_init_file(&out, fp);
+  } else {
+    stream_init_buffer(&out);
+  }
+  for (i = 0; i < num; i++) {
+    r0 = (uint64_t) units * i / num * unit;
+    r1 = (uint64_t) units * (i + 1) / num * unit;
+    r1 = r1 < mcu_rows ? r1 : mcu_rows;
+    strips[i].img = img;
+    strips[i].opt = *opt;
+    strips[i].opt.restart_interval = restart;
+    strips[i].top = r0 * mcu_height;
+    strips[i].height = (r1 < mcu_rows ? r1 * mcu_height : img->height) - strips[i].top;
+    strips[i].first = (uint64_t) r0 * mcus_per_row / restart;
+  }
+  // 先頭以外の帯を別スレッドで処理し、先頭の帯はこのスレッドで処理する
+  for (i = 1; i < num; i++) {
+    strips[i].running = (pthread_create(&strips[i].thread, NULL, encode_strip, &strips[i]) == 0);
+  }
+  encode_strip(&strips[0]);
+  if (strips[0].result != SUCCESS) {
+    goto error;
+  }
+  // 先頭の帯のヘッダを画像全体の高さにして使う
+  strips[0].data[strips[0].sof] = img->height >> 8;
+  strips[0].data[strips[0].sof + 1] = img->height & 0xff;
+  stream_write(&out, strips[0].data, strips[0].scan);
+  for (i = 0; i < num; i++) {
+    if (strips[i].running) {
+      pthread_join(strips[i].thread, NULL);
+      strips[i].running = FALSE;
+    } else if (i > 0) {
+      // スレッドを作成できなかった場合はこのスレッドで処理する
+      encode_strip(&strips[i]);
+    }
+    if (strips[i].result != SUCCESS) {
+      goto error;
+    }
+    if (i > 0) {
+      marker[0] = 0xFF;
+      marker[1] = JPEG_RST0 + ((strips[i].first - 1) & 7);
+      stream_write(&out, marker, sizeof(marker));
+    }
+    stream_write(&out, strips[i].data + strips[i].scan, strips[i].size - 2 - strips[i].scan);
+    free(strips[i].data);
+    strips[i].data = NULL;
+  }
+  marker[0] = 0xFF;
+  marker[1] = JPEG_EOI;
+  stream_write(&out, marker, sizeof(marker));
+  if (out.error) {
+    goto error;
+  }
+  result = SUCCESS;
+  error:
+  for (i = 0; i < num; i++) {
+    if (strips[i].running) {
+      pthread_join(strips[i].thread, NULL);
+    }
+    free(strips[i].data);
+  }
+  free(strips);
+  if (fp == NULL) {
+    if ((result = stream_take_buffer(&out, result, &buffer, &length)) == SUCCESS) {
+      *data = buffer;
+      *size = length;
+    }
+  }
+  return result;
+}
+
+/**
+ * @brief JPEG形式として書き出す。
+ *
+ * fpがNULLの場合はメモリ上に書き出す。
+ * グレースケールの画像は1成分のグレースケールのJPEGとして書き出し、
+ * それ以外はRGBに変換してから書き出す。
+ * コンテキストを指定しない場合、optのthreadsが2以上で、ベースラインで標準のハフマン符号表を使い、
+ * 平滑化しない設定であれば横長の帯に分けて並列に圧縮する。
+ *
+ * @param[in,out] ctx  コンテキスト、NULLの場合は使用しない。fpを指定した場合のみ使用できる
+ * @param[in]     fp   書き出すファイルストリームのポインタ、NULLの場合はメモリに書き出す
+ * @param[out]    data メモリに書き出したデータ、呼び出し側でfree()すること
+ * @param[out]    size メモリに書き出したデータのサイズ
+ * @param[in]     img  画像データ
+ * @param[in]     opt  書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+static result_t write_jpeg(jpeg_context_t *ctx, FILE *fp, unsigned char **data,
+    unsigned long *size, image_t *img, const jpeg_write_option_t *opt) {
+  result_t result;
+  jpeg_write_option_t def;
+  image_t *to_free = NULL;
+  if (img == NULL) {
+    return FAILURE;
+  }
+  if (img->color_type != COLOR_TYPE_RGB && img->color_type != COLOR_TYPE_GRAY) {
+    // 画像形式がRGBでもグレースケールでもない場合はRGBに変換して出力
+    to_free = clone_image(img);
+    img = image_to_rgb(to_free);
+  }
+  if (opt == NULL) {
+    init_jpeg_write_option(&def);
+    opt = &def;
+  }
+  if (ctx == NULL && opt->threads > 1
+      && !opt->progressive && !opt->optimize_coding && opt->smoothing <= 0) {
+    result = write_jpeg_parallel(fp, data, size, img, opt);
+  } else {
+    result = encode_jpeg(ctx, fp, data, size, img, 0, img->height, opt);
+  }
+  free_image(to_free);
+  return result;
+}
+
+/**
+ * @brief オプションを指定してJPEG形式としてファイルに書き出す。
+ *
+ * グレースケールの画像は1成分のグレースケールのJPEGとして書き出し、
+ * それ以外はRGBに変換してから書き出す。
+ * optのthreadsが2以上の場合、ベースラインで標準のハフマン符号表を使い、
+ * 平滑化しない設定であれば横長の帯に分けて並列に圧縮する。
+ *
+ * @param[in] fp  書き出すファイルストリームのポインタ
+ * @param[in] img 画像データ
+ * @param[in] opt 書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_jpeg_stream_with_option(FILE *fp, image_t *img,
+    const jpeg_write_option_t *opt) {
+  return write_jpeg(NULL, fp, NULL, NULL, img, opt);
+}
+
+/**
+ * @brief コンテキストを使い回してJPEG形式としてファイルに書き出す。
+ *
+ * コンテキストのjpeg_compress_structと作業領域を使い回すため、
+ * 小さな画像を連続して書き出す場合の初期化と後始末が省かれる。
+ * optのthreadsは使用せず、常に1つのスレッドで書き出す。
+ *
+ * @param[in,out] ctx コンテキスト
+ * @param[in]     fp  書き出すファイルストリームのポインタ
+ * @param[in]     img 画像データ
+ * @param[in]     opt 書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_jpeg_stream_with_context(jpeg_context_t *ctx, FILE *fp, image_t *img,
+    const jpeg_write_option_t *opt) {
+  if (ctx == NULL) {
+    return FAILURE;
+  }
+  return write_jpeg(ctx, fp, NULL, NULL, img, opt);
+}
+
+/**
+ * @brief JPEG形式としてメモリ上に書き出す。
+ *
+ * @param[out] data 書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size 書き出したデータのサイズ
+ * @param[in]  img  画像データ
+ * @return 成否
+ */
+result_t write_jpeg_memory(uint8_t **data, size_t *size, image_t *img) {
+  return write_jpeg_memory_with_option(data, size, img, NULL);
+}
+
+/**
+ * @brief オプションを指定してJPEG形式としてメモリ上に書き出す。
+ *
+ * 書き出し処理はwrite_jpeg_stream_with_option()と同じ。
+ * jpeg_mem_dest()で確保されたバッファをそのまま返す。
+ *
+ * @param[out] data 書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size 書き出したデータのサイズ
+ * @param[in]  img  画像データ
+ * @param[in]  opt  書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_jpeg_memory_with_option(uint8_t **data, size_t *size, image_t *img,
+    const jpeg_write_option_t *opt) {
+  unsigned char *buffer = NULL;
+  unsigned long length = 0;
+  if (write_jpeg(NULL, NULL, &buffer, &length, img, opt) != SUCCESS) {
+    free(buffer);
+    return FAILURE;
+  }
+  *data = buffer;
+  *size = length;
+  return SUCCESS;
+}
+
+/**
+ * @brief JPEGの無劣化変形のオプションを標準の設定で初期化する。
+ *
+ * 変形も切り抜きも行わず、ベースラインの標準のハフマン符号表で書き出す。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_jpeg_transform_option(jpeg_transform_option_t *opt) {
+  opt->transform = JPEG_TRANSFORM_NONE;
+  opt->crop_x = 0;
+  opt->crop_y = 0;
+  opt->crop_width = 0;
+  opt->crop_height = 0;
+  opt->progressive = FALSE;
+  opt->optimize_coding = FALSE;
+}
+
+/**
+ * @brief JPEGの無劣化変形を行う。
+ *
+ * @param[in] src 変形元のファイル名
+ * @param[in] dst 書き出すファイル名
+ * @param[in] opt 変形のオプション
+ * @return 成否
+ */
+result_t transform_jpeg_file(const char *src, const char *dst,
+    const jpeg_transform_option_t *opt) {
+  result_t result = FAILURE;
+  FILE *in;
+  FILE *out;
+  if ((in = fopen(src, "rb")) == NULL) {
+    perror(src);
+    return result;
+  }
+  if ((out = fopen(dst, "wb")) == NULL) {
+    perror(dst);
+    fclose(in);
+    return result;
+  }
+  result = transform_jpeg_stream(in, out, opt);
+  fclose(out);
+  fclose(in);
+  return result;
+}
+
+/**
+ * @brief 縦横が入れ替わる変形か否かを返す。
+ *
+ * @param[in] transform 変形の種別(JPEG_TRANSFORM_*)
+ * @return 縦横が入れ替わる場合TRUE
+ */
+static int is_transposed(int transform) {
+  return transform == JPEG_TRANSFORM_TRANSPOSE || transform == JPEG_TRANSFORM_TRANSVERSE
+      || transform == JPEG_TRANSFORM_ROT_90 || transform == JPEG_TRANSFORM_ROT_270;
+}
+
+/**
+ * @brief DCT係数のブロックの変形を表す係数の対応と符号を求める。
+ *
+ * 画素の左右反転は水平方向の周波数が奇数の係数の符号を、
+ * 上下反転は垂直方向の周波数が奇数の係数の符号を反転することと等価であり、
+ * 転置は係数の転置と等価である。
+ *
+ * @param[in]  transform 変形の種別(JPEG_TRANSFORM_*)
+ * @param[out] index     変形後の係数ごとの変形元の係数の位置
+ * @param[out] mask      変形後の係数ごとの符号を反転するマスク、反転する場合-1、しない場合0
+ */
+static void make_block_transform(int transform, int *index, JCOEF *mask) {
+  int u, v, negate;
+  const int transposed = is_transposed(transform);
+  for (v = 0; v < DCTSIZE; v++) {
+    for (u = 0; u < DCTSIZE; u++) {
+      switch (transform) {
+        case JPEG_TRANSFORM_FLIP_H:
+        case JPEG_TRANSFORM_ROT_90:
+          negate = u & 1;
+          break;
+        case JPEG_TRANSFORM_FLIP_V:
+        case JPEG_TRANSFORM_ROT_270:
+          negate = v & 1;
+          break;
+        case JPEG_TRANSFORM_TRANSVERSE:
+        case JPEG_TRANSFORM_ROT_180:
+          negate = (u + v) & 1;
+          break;
+        default:
+          negate = 0;
+          break;
+      }
+      index[v * DCTSIZE + u] = transposed ? u * DCTSIZE + v : v * DCTSIZE + u;
+      mask[v * DCTSIZE + u] = negate ? -1 : 0;
+    }
+  }
+}
+
+/**
+ * @brief DCT係数のブロックを変形する。
+ *
+ * @param[out] dst   変形後のブロック
+ * @param[in]  src   変形元のブロック
+ * @param[in]  index 変形後の係数ごとの変形元の係数の位置
+ * @param[in]  mask  変形後の係数ごとの符号を反転するマスク
+ */
+static void transform_block(JCOEFPTR dst, const JCOEF *src, const int *index,
+    const JCOEF *mask) {
+  int k;
+  for (k = 0; k < DCTSIZE2; k++) {
+    // マスクが-1の場合は2の補数で符号を反転する
+    dst[k] = (src[index[k]] ^ mask[k]) - mask[k];
+  }
+}
+
+/**
+ * @brief 量子化テーブルを転置する。
+ *
+ * @param[in,out] jpegc jpeg_compress_struct
+ */
+static void transpose_quant_tables(j_compress_ptr jpegc) {
+  int i, u, v;
+  UINT16 q;
+  JQUANT_TBL *tbl;
+  for (i = 0; i < NUM_QUANT_TBLS; i++) {
+    if ((tbl = jpegc->quant_tbl_ptrs[i]) == NULL) {
+      continue;
+    }
+    for (v = 0; v < DCTSIZE; v++) {
+      for (u = v + 1; u < DCTSIZE; u++) {
+        q = tbl->quantval[v * DCTSIZE + u];
+        tbl->quantval[v * DCTSIZE + u] = tbl->quantval[u * DCTSIZE + v];
+        tbl->quantval[u * DCTSIZE + v] = q;
+      }
+    }
+  }
+}
+
+/**
+ * @brief JPEGの無劣化変形を行う。
+ *
+ * jpegtranと同様に、DCT係数を読み込んでブロック単位で並べ替えて書き出すため、
+ * 逆DCTと再量子化を行わず画質が劣化しない。
+ * 反転や回転で画像の端に来る、MCUに満たない端のブロックは変形できないため取り除く。
+ * 取り除くと画像が無くなる場合は失敗とする。
+ * マーカーはコピーしない。
+ *
+ * @param[in] in  変形元のファイルストリーム
+ * @param[in] out 書き出すファイルストリーム
+ * @param[in] opt 変形のオプション、NULLの場合変形しない
+ * @return 成否
+ */
+result_t transform_jpeg_stream(FILE *in, FILE *out, const jpeg_transform_option_t *opt) {
+  result_t result = FAILURE;
+  int c, transform;
+  uint32_t x0, y0, w, h, mcu_w, mcu_h;
+  JDIMENSION sw, sh, dw, dh, bx, by, dx, dy, sx, sy;
+  struct jpeg_decompress_struct src;
+  struct jpeg_compress_struct dst;
+  my_error_mgr myerr;
+  jvirt_barray_ptr *src_coef;
+  jvirt_barray_ptr dst_coef[MAX_COMPONENTS];
+  int index[DCTSIZE2];
+  JCOEF mask[DCTSIZE2];
+  jpeg_component_info *comp;
+  JBLOCKARRAY dst_row;
+  JBLOCKARRAY src_row;
+  memset(&src, 0, sizeof(src));
+  memset(&dst, 0, sizeof(dst));
+  src.err = jpeg_std_error(&myerr.jerr);
+  dst.err = &myerr.jerr;
+  myerr.jerr.error_exit = error_exit;
+  if (setjmp(myerr.jmpbuf)) {
+    goto error;
+  }
+  jpeg_create_decompress(&src);
+  jpeg_create_compress(&dst);
+  jpeg_stdio_src(&src, in);
+  if (jpeg_read_header(&src, TRUE) != JPEG_HEADER_OK) {
+    goto error;
+  }
+  transform = opt != NULL ? opt->transform : JPEG_TRANSFORM_NONE;
+  // jpeg_read_header()の時点では計算されていないため、MCUの大きさを求める
+  mcu_w = mcu_h = DCTSIZE;
+  for (c = 0; c < src.num_components; c++) {
+    if (src.comp_info[c].h_samp_factor * DCTSIZE > mcu_w) {
+      mcu_w = src.comp_info[c].h_samp_factor * DCTSIZE;
+    }
+    if (src.comp_info[c].v_samp_factor * DCTSIZE > mcu_h) {
+      mcu_h = src.comp_info[c].v_samp_factor * DCTSIZE;
+    }
+  }
+  // 切り抜く領域の左上をMCUの境界に揃える
+  x0 = y0 = 0;
+  w = src.image_width;
+  h = src.image_height;
+  if (opt != NULL && opt->crop_width > 0 && opt->crop_height > 0) {
+    if (opt->crop_x >= src.image_width || opt->crop_y >= src.image_height) {
+      goto error;
+    }
+    x0 = opt->crop_x / mcu_w * mcu_w;
+    y0 = opt->crop_y / mcu_h * mcu_h;
+    w = opt->crop_x - x0 + opt->crop_width;
+    h = opt->crop_y - y0 + opt->crop_height;
+    if (w > src.image_width - x0) {
+      w = src.image_width - x0;
+    }
+    if (h > src.image_height - y0) {
+      h = src.image_height - y0;
+    }
+  }
+  // 変形後に右端、下端以外に来るMCUに満たない端を取り除く
+  switch (transform) {
+    case JPEG_TRANSFORM_FLIP_H:
+    case JPEG_TRANSFORM_ROT_270:
+      w = w / mcu_w * mcu_w;
+      break;
+    case JPEG_TRANSFORM_FLIP_V:
+    case JPEG_TRANSFORM_ROT_90:
+      h = h / mcu_h * mcu_h;
+      break;
+    case JPEG_TRANSFORM_TRANSVERSE:
+    case JPEG_TRANSFORM_ROT_180:
+      w = w / mcu_w * mcu_w;
+      h = h / mcu_h * mcu_h;
+      break;
+  }
+  if (w == 0 || h == 0) {
+    goto error;
+  }
+  // 変形後のDCT係数の領域は、読み込みと同時に確保されるように先に要求しておく
+  for (c = 0; c < src.num_components; c++) {
+    comp = &src.comp_info[c];
+    sw = (w * comp->h_samp_factor + mcu_w - 1) / mcu_w;
+    sh = (h * comp->v_samp_factor + mcu_h - 1) / mcu_h;
+    if (is_transposed(transform)) {
+      dw = (sh + comp->v_samp_factor - 1) / comp->v_samp_factor * comp->v_samp_factor;
+      dh = (sw + comp->h_samp_factor - 1) / comp->h_samp_factor * comp->h_samp_factor;
+    } else {
+      dw = (sw + comp->h_samp_factor - 1) / comp->h_samp_factor * comp->h_samp_factor;
+      dh = (sh + comp->v_samp_factor - 1) / comp->v_samp_factor * comp->v_samp_factor;
+    }
+    dst_coef[c] = (*src.mem->request_virt_barray)((j_common_ptr) &src, JPOOL_IMAGE, TRUE,
+        dw, dh, is_transposed(transform) ? comp->h_samp_factor : comp->v_samp_factor);
+  }
+  src_coef = jpeg_read_coefficients(&src);
+  make_block_transform(transform, index, mask);
+  for (c = 0; c < src.num_components; c++) {
+    comp = &src.comp_info[c];
+    // 元の画像の切り抜く領域のブロック単位の位置と大きさ
+    bx = x0 / mcu_w * comp->h_samp_factor;
+    by = y0 / mcu_h * comp->v_samp_factor;
+    sw = (w * comp->h_samp_factor + mcu_w - 1) / mcu_w;
+    sh = (h * comp->v_samp_factor + mcu_h - 1) / mcu_h;
+    dw = is_transposed(transform) ? sh : sw;
+    dh = is_transposed(transform) ? sw : sh;
+    for (dy = 0; dy < dh; dy++) {
+      dst_row = (*src.mem->access_virt_barray)((j_common_ptr) &src, dst_coef[c], dy, 1, TRUE);
+      for (dx = 0; dx < dw; dx++) {
+        switch (transform) {
+          case JPEG_TRANSFORM_FLIP_H:
+            sx = sw - 1 - dx;
+            sy = dy;
+            break;
+          case JPEG_TRANSFORM_FLIP_V:
+            sx = dx;
+            sy = sh - 1 - dy;
+            break;
+          case JPEG_TRANSFORM_TRANSPOSE:
+            sx = dy;
+            sy = dx;
+            break;
+          case JPEG_TRANSFORM_TRANSVERSE:
+            sx = sw - 1 - dy;
+            sy = sh - 1 - dx;
+            break;
+          case JPEG_TRANSFORM_ROT_90:
+            sx = dy;
+            sy = sh - 1 - dx;
+            break;
+          case JPEG_TRANSFORM_ROT_180:
+            sx = sw - 1 - dx;
+            sy = sh - 1 - dy;
+            break;
+          case JPEG_TRANSFORM_ROT_270:
+            sx = sw - 1 - dy;
+            sy = dx;
+            break;
+          default:
+            sx = dx;
+            sy = dy;
+            break;
+        }
+        src_row = (*src.mem->access_virt_barray)((j_common_ptr) &src, src_coef[c],
+            by + sy, 1, FALSE);
+        transform_block(dst_row[0][dx], src_row[0][bx + sx], index, mask);
+      }
+    }
+  }
+  jpeg_copy_critical_parameters(&src, &dst);
+  if (is_transposed(transform)) {
+    dst.image_width = h;
+    dst.image_height = w;
+    for (c = 0; c < dst.num_components; c++) {
+      comp = &dst.comp_info[c];
+      sw = comp->h_samp_factor;
+      comp->h_samp_factor = comp->v_samp_factor;
+      comp->v_samp_factor = sw;
+    }
+    transpose_quant_tables(&dst);
+  } else {
+    dst.image_width = w;
+    dst.image_height = h;
+  }
+  jpeg_stdio_dest(&dst, out);
+  if (opt != NULL && opt->progressive) {
+    jpeg_simple_progression(&dst);
+  }
+  dst.optimize_coding = opt != NULL && opt->optimize_coding ? TRUE : FALSE;
+  jpeg_write_coefficients(&dst, dst_coef);
+  jpeg_finish_compress(&dst);
+  jpeg_finish_decompress(&src);
+  result = SUCCESS;
+  error:
+  jpeg_destroy_compress(&dst);
+  jpeg_destroy_decompress(&src);
+  return result;
+}
+
+/**
+ * @brief サンプリング係数を指定してJPEGの平面画像を確保する。
+ *
+ * 各平面はlibjpegの生データの入出力に合わせ、右端と下端をMCUの大きさまで確保する。
+ *
+ * @param[in] width      画像の幅
+ * @param[in] height     画像の高さ
+ * @param[in] components 成分の数
+ * @param[in] h          各成分の水平方向のサンプリング係数
+ * @param[in] v          各成分の垂直方向のサンプリング係数
+ * @return 確保した平面画像、失敗した場合NULL
+ */
+static jpeg_planes_t *create_planes(uint32_t width, uint32_t height, int components,
+    const int *h, const int *v) {
+  int c, max_h = 1, max_v = 1;
+  uint32_t mcus_per_row, mcu_rows;
+  jpeg_planes_t *planes;
+  jpeg_plane_t *plane;
+  if ((planes = calloc(1, sizeof(jpeg_planes_t))) == NULL) {
+    return NULL;
+  }
+  planes->width = width;
+  planes->height = height;
+  planes->components = components;
+  for (c = 0; c < components; c++) {
+    max_h = h[c] > max_h ? h[c] : max_h;
+    max_v = v[c] > max_v ? v[c] : max_v;
+  }
+  mcus_per_row = (width + max_h * DCTSIZE - 1) / (max_h * DCTSIZE);
+  mcu_rows = (height + max_v * DCTSIZE - 1) / (max_v * DCTSIZE);
+  for (c = 0; c < components; c++) {
+    plane = &planes->plane[c];
+    plane->width = ((uint64_t) width * h[c] + max_h - 1) / max_h;
+    plane->height = ((uint64_t) height * v[c] + max_v - 1) / max_v;
+    plane->stride = mcus_per_row * h[c] * DCTSIZE;
+    plane->rows = mcu_rows * v[c] * DCTSIZE;
+    plane->h_samp_factor = h[c];
+    plane->v_samp_factor = v[c];
+    if ((plane->data = calloc((size_t) plane->stride * plane->rows, 1)) == NULL) {
+      free_jpeg_planes(planes);
+      return NULL;
+    }
+  }
+  return planes;
+}
+
+/**
+ * @brief JPEGの平面画像を確保する。
+ *
+ * @param[in] width       画像の幅
+ * @param[in] height      画像の高さ
+ * @param[in] components  成分の数、グレースケールは1、YCbCrは3
+ * @param[in] subsampling 色差のサブサンプリング(JPEG_SUBSAMPLING_*)、1成分の場合は無視する
+ * @return 確保した平面画像、失敗した場合NULL
+ */
+jpeg_planes_t *allocate_jpeg_planes(uint32_t width, uint32_t height, int components,
+    int subsampling) {
+  int h[JPEG_PLANE_MAX] = {1, 1, 1};
+  int v[JPEG_PLANE_MAX] = {1, 1, 1};
+  if (width == 0 || height == 0 || (components != 1 && components != 3)) {
+    return NULL;
+  }
+  if (components == 3) {
+    get_samp_factor(subsampling, &h[0], &v[0]);
+  }
+  return create_planes(width, height, components, h, v);
+}
+
+/**
+ * @brief JPEGの平面画像のメモリを開放する。
+ *
+ * @param[in] planes 開放する平面画像
+ */
+void free_jpeg_planes(jpeg_planes_t *planes) {
+  int c;
+  if (planes == NULL) {
+    return;
+  }
+  for (c = 0; c < JPEG_PLANE_MAX; c++) {
+    free(planes->plane[c].data);
+  }
+  free(planes);
+}
+
+/**
+ * @brief JPEG形式のファイルを色変換せずに平面画像として読み込む。
+ *
  * @param[in] filename ファイル名
- * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ * @return 読み込んだ平面画像、読み込みに失敗した場合NULL
  */
-image_t *read_jpeg_file(const char *filename) {
+jpeg_planes_t *read_jpeg_planes_file(const char *filename) {
   FILE *fp;
   if ((fp = fopen(filename, "rb")) == NULL) {
     perror(filename);
     return NULL;
   }
-  image_t *img = read_jpeg_stream(fp);
+  jpeg_planes_t *planes = read_jpeg_planes_stream(fp);
   fclose(fp);
-  return img;
+  return planes;
 }
 
 /**
- * @brief JPEG形式のファイルを読み込む。
+ * @brief JPEG形式のファイルを色変換せずに平面画像として読み込む。
+ *
+ * 動画のエンコーダなどYCbCrのまま扱う用途向けに、
+ * 色差のアップサンプリングとRGBへの変換を行わず、逆DCTの結果をそのまま取り出す。
+ * YCbCrとグレースケールのJPEGのみ読み込める。
  *
  * @param[in] fp ファイルストリーム
- * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ * @return 読み込んだ平面画像、読み込みに失敗した場合NULL
  */
-image_t *read_jpeg_stream(FILE *fp) {
+jpeg_planes_t *read_jpeg_planes_stream(FILE *fp) {
   result_t result = FAILURE;
-  uint32_t x, y;
+  int c, h[JPEG_PLANE_MAX], v[JPEG_PLANE_MAX];
+  uint32_t y, i, n;
   struct jpeg_decompress_struct jpegd;
   my_error_mgr myerr;
-  image_t *img = NULL;
-  JSAMPROW buffer = NULL;
-  JSAMPROW row;
-  int stride;
+  jpeg_planes_t *volatile planes = NULL;
+  JSAMPARRAY volatile rows = NULL;
+  JSAMPARRAY image[JPEG_PLANE_MAX];
+  jpeg_plane_t *plane;
   jpegd.err = jpeg_std_error(&myerr.jerr);
   myerr.jerr.error_exit = error_exit;
   if (setjmp(myerr.jmpbuf)) {
@@ -78,116 +2171,503 @@ image_t *read_jpeg_stream(FILE *fp) {
   if (jpeg_read_header(&jpegd, TRUE) != JPEG_HEADER_OK) {
     goto error;
   }
-  jpeg_start_decompress(&jpegd);
-  if (jpegd.out_color_space != JCS_RGB) {
+  if (!(jpegd.jpeg_color_space == JCS_YCbCr && jpegd.num_components == 3)
+      && !(jpegd.jpeg_color_space == JCS_GRAYSCALE && jpegd.num_components == 1)) {
     goto error;
   }
-  stride = sizeof(JSAMPLE) * jpegd.output_width * jpegd.output_components;
-  if ((buffer = calloc(stride, 1)) == NULL) {
+  jpegd.raw_data_out = TRUE;
+  jpegd.out_color_space = jpegd.jpeg_color_space;
+  jpeg_start_decompress(&jpegd);
+  for (c = 0; c < jpegd.num_components; c++) {
+    h[c] = jpegd.comp_info[c].h_samp_factor;
+    v[c] = jpegd.comp_info[c].v_samp_factor;
+  }
+  planes = create_planes(jpegd.image_width, jpegd.image_height, jpegd.num_components, h, v);
+  if (planes == NULL) {
     goto error;
   }
-  if ((img = allocate_image(jpegd.output_width, jpegd.output_height,
-                            COLOR_TYPE_RGB)) == NULL) {
+  n = jpegd.max_v_samp_factor * DCTSIZE;
+  if ((rows = malloc(sizeof(JSAMPROW) * n * jpegd.num_components)) == NULL) {
     goto error;
   }
-  for (y = 0; y < jpegd.output_height; y++) {
-    jpeg_read_scanlines(&jpegd, &buffer, 1);
-    row = buffer;
-    for (x = 0; x < jpegd.output_width; x++) {
-      img->map[y][x].c.r = *row++;
-      img->map[y][x].c.g = *row++;
-      img->map[y][x].c.b = *row++;
-      img->map[y][x].c.a = 0xff;
+  // 1回の呼び出しでiMCU行分、各成分のサンプリング係数×8行を平面に直接読み込む
+  for (y = 0; jpegd.output_scanline < jpegd.output_height; y++) {
+    for (c = 0; c < jpegd.num_components; c++) {
+      plane = &planes->plane[c];
+      image[c] = rows + n * c;
+      for (i = 0; i < (uint32_t) plane->v_samp_factor * DCTSIZE; i++) {
+        image[c][i] = plane->data
+            + (size_t) plane->stride * ((y * plane->v_samp_factor * DCTSIZE) + i);
+      }
+    }
+    if (jpeg_read_raw_data(&jpegd, image, n) == 0) {
+      goto error;
     }
   }
   jpeg_finish_decompress(&jpegd);
   result = SUCCESS;
   error:
   jpeg_destroy_decompress(&jpegd);
-  free(buffer);
+  free(rows);
   if (result != SUCCESS) {
-    free_image(img);
-    img = NULL;
+    free_jpeg_planes(planes);
+    planes = NULL;
   }
-  return img;
+  return planes;
 }
 
 /**
- * @brief JPEG形式としてファイルに書き出す。
+ * @brief 平面画像をJPEG形式としてファイルに書き出す。
  *
  * @param[in] filename 書き出すファイル名
- * @param[in] img      画像データ
+ * @param[in] planes   平面画像
+ * @param[in] opt      書き出しオプション、NULLの場合標準の設定
  * @return 成否
  */
-result_t write_jpeg_file(const char *filename, image_t *img) {
+result_t write_jpeg_planes_file(const char *filename, jpeg_planes_t *planes,
+    const jpeg_write_option_t *opt) {
   result_t result = FAILURE;
   FILE *fp;
-  if (img == NULL) {
+  if (planes == NULL) {
     return result;
   }
   if ((fp = fopen(filename, "wb")) == NULL) {
     perror(filename);
     return result;
   }
-  result = write_jpeg_stream(fp, img);
+  result = write_jpeg_planes_stream(fp, planes, opt);
   fclose(fp);
   return result;
 }
 
 /**
- * @brief JPEG形式としてファイルに書き出す。
+ * @brief 平面画像の大きさを確認し、余白を端の画素で埋める。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
- * @param[in] img 画像データ
+ * libjpegは生データをMCU単位で読むため、右端と下端の余白を画像の端の値で埋めておく。
+ *
+ * @param[in,out] planes 平面画像
  * @return 成否
  */
-result_t write_jpeg_stream(FILE *fp, image_t *img) {
-  result_t result = FAILURE;
-  int x, y;
-  struct jpeg_compress_struct jpegc;
-  my_error_mgr myerr;
-  image_t *to_free = NULL;
-  JSAMPROW buffer = NULL;
-  JSAMPROW row;
-  if (img == NULL) {
+static result_t pad_planes(jpeg_planes_t *planes) {
+  int c, max_h = 1, max_v = 1;
+  uint32_t y, mcus_per_row, mcu_rows;
+  jpeg_plane_t *plane;
+  uint8_t *row;
+  if (planes->width == 0 || planes->height == 0
+      || (planes->components != 1 && planes->components != 3)) {
     return FAILURE;
   }
-  if ((buffer = malloc(sizeof(JSAMPLE) * 3 * img->width)) == NULL) {
-    return FAILURE;
+  for (c = 0; c < planes->components; c++) {
+    plane = &planes->plane[c];
+    if (plane->h_samp_factor < 1 || plane->h_samp_factor > MAX_SAMP_FACTOR
+        || plane->v_samp_factor < 1 || plane->v_samp_factor > MAX_SAMP_FACTOR) {
+      return FAILURE;
+    }
+    max_h = plane->h_samp_factor > max_h ? plane->h_samp_factor : max_h;
+    max_v = plane->v_samp_factor > max_v ? plane->v_samp_factor : max_v;
   }
-  if (img->color_type != COLOR_TYPE_RGB) {
-    // 画像形式がRGBでない場合はRGBに変換して出力
-    to_free = clone_image(img);
-    img = image_to_rgb(to_free);
+  mcus_per_row = (planes->width + max_h * DCTSIZE - 1) / (max_h * DCTSIZE);
+  mcu_rows = (planes->height + max_v * DCTSIZE - 1) / (max_v * DCTSIZE);
+  for (c = 0; c < planes->components; c++) {
+    plane = &planes->plane[c];
+    if (plane->data == NULL
+        || plane->width != ((uint64_t) planes->width * plane->h_samp_factor + max_h - 1) / max_h
+        || plane->height != ((uint64_t) planes->height * plane->v_samp_factor + max_v - 1) / max_v
+        || plane->stride < mcus_per_row * plane->h_samp_factor * DCTSIZE
+        || plane->rows < mcu_rows * plane->v_samp_factor * DCTSIZE) {
+      return FAILURE;
+    }
+    for (y = 0; y < plane->height; y++) {
+      row = plane->data + (size_t) plane->stride * y;
+      memset(row + plane->width, row[plane->width - 1], plane->stride - plane->width);
+    }
+    for (; y < plane->rows; y++) {
+      memcpy(plane->data + (size_t) plane->stride * y,
+          plane->data + (size_t) plane->stride * (plane->height - 1), plane->stride);
+    }
   }
+  return SUCCESS;
+}
+
+/**
+ * @brief 平面画像をJPEG形式で書き出す。
+ *
+ * fpがNULLの場合はjpeg_mem_dest()でメモリ上に書き出す。
+ * 平面の余白は埋められていること。
+ *
+ * @param[in]  fp     書き出すファイルストリームのポインタ、NULLの場合はメモリに書き出す
+ * @param[out] data   メモリに書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size   メモリに書き出したデータのサイズ
+ * @param[in]  planes 平面画像
+ * @param[in]  opt    書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+static result_t encode_jpeg_planes(FILE *fp, unsigned char **data, unsigned long *size,
+    const jpeg_planes_t *planes, const jpeg_write_option_t *opt) {
+  result_t result = FAILURE;
+  int c;
+  uint32_t y, i, n;
+  struct jpeg_compress_struct jpegc;
+  my_error_mgr myerr;
+  jpeg_write_option_t def;
+  JSAMPARRAY volatile rows = NULL;
+  JSAMPARRAY image[JPEG_PLANE_MAX];
+  const jpeg_plane_t *plane;
   jpegc.err = jpeg_std_error(&myerr.jerr);
   myerr.jerr.error_exit = error_exit;
   if (setjmp(myerr.jmpbuf)) {
     goto error;
   }
   jpeg_create_compress(&jpegc);
-  jpeg_stdio_dest(&jpegc, fp);
-  jpegc.image_width = img->width;
-  jpegc.image_height = img->height;
-  jpegc.input_components = 3;
-  jpegc.in_color_space = JCS_RGB;
+  if (fp != NULL) {
+    jpeg_stdio_dest(&jpegc, fp);
+  } else {
+    jpeg_mem_dest(&jpegc, data, size);
+  }
+  jpegc.image_width = planes->width;
+  jpegc.image_height = planes->height;
+  jpegc.input_components = planes->components;
+  jpegc.in_color_space = planes->components == 1 ? JCS_GRAYSCALE : JCS_YCbCr;
   jpeg_set_defaults(&jpegc);
-  jpeg_set_quality(&jpegc, 75, TRUE);
+  if (opt == NULL) {
+    init_jpeg_write_option(&def);
+    opt = &def;
+  }
+  set_jpeg_write_option(&jpegc, opt);
+  for (c = 0; c < planes->components; c++) {
+    jpegc.comp_info[c].h_samp_factor = planes->plane[c].h_samp_factor;
+    jpegc.comp_info[c].v_samp_factor = planes->plane[c].v_samp_factor;
+  }
+  jpegc.raw_data_in = TRUE;
   jpeg_start_compress(&jpegc, TRUE);
-  for (y = 0; y < img->height; y++) {
-    row = buffer;
-    for (x = 0; x < img->width; x++) {
-      *row++ = img->map[y][x].c.r;
-      *row++ = img->map[y][x].c.g;
-      *row++ = img->map[y][x].c.b;
+  n = jpegc.max_v_samp_factor * DCTSIZE;
+  if ((rows = malloc(sizeof(JSAMPROW) * n * planes->components)) == NULL) {
+    goto error;
+  }
+  for (y = 0; jpegc.next_scanline < jpegc.image_height; y++) {
+    for (c = 0; c < planes->components; c++) {
+      plane = &planes->plane[c];
+      image[c] = rows + n * c;
+      for (i = 0; i < (uint32_t) plane->v_samp_factor * DCTSIZE; i++) {
+        image[c][i] = plane->data
+            + (size_t) plane->stride * ((y * plane->v_samp_factor * DCTSIZE) + i);
+      }
+    }
+    if (jpeg_write_raw_data(&jpegc, image, n) == 0) {
+      goto error;
     }
-    jpeg_write_scanlines(&jpegc, &buffer, 1);
   }
   jpeg_finish_compress(&jpegc);
   result = SUCCESS;
   error:
   jpeg_destroy_compress(&jpegc);
+  free(rows);
+  return result;
+}
+
+/**
+ * @brief 平面画像をJPEG形式としてファイルに書き出す。
+ *
+ * RGBからの色変換と色差のダウンサンプリングを行わず、平面をそのままDCTにかける。
+ * サブサンプリングは平面のサンプリング係数に従い、オプションの指定は無視する。
+ * 平面の右端と下端の余白は端の画素で上書きする。
+ *
+ * @param[in] fp     書き出すファイルストリームのポインタ
+ * @param[in] planes 平面画像、allocate_jpeg_planes()で確保したもの
+ * @param[in] opt    書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_jpeg_planes_stream(FILE *fp, jpeg_planes_t *planes,
+    const jpeg_write_option_t *opt) {
+  if (planes == NULL || pad_planes(planes) != SUCCESS) {
+    return FAILURE;
+  }
+  return encode_jpeg_planes(fp, NULL, NULL, planes, opt);
+}
+
+#define YCC_SCALEBITS 16 /**< 色変換の固定小数点の小数部のbit数 */
+#define YCC_FIX(x) ((int32_t) ((x) * (1L << YCC_SCALEBITS) + 0.5)) /**< 固定小数点への変換 */
+#define YCC_HALF ((int32_t) 1 << (YCC_SCALEBITS - 1)) /**< 固定小数点の0.5 */
+#define YCC_OFFSET ((int32_t) CENTERJSAMPLE << YCC_SCALEBITS) /**< 色差の中心値 */
+
+/**
+ * @brief RGBの行をYCbCrに変換する。
+ *
+ * libjpegの色変換と同じ固定小数点演算で変換する。
+ * 画像の幅を超える列は右端の画素を繰り返す。
+ *
+ * @param[in]  src   変換元の行
+ * @param[in]  width 画像の幅
+ * @param[out] y     Yの出力先
+ * @param[out] cb    Cbの出力先
+ * @param[out] cr    Crの出力先
+ * @param[in]  count 変換する列数
+ */
+static void convert_row_to_ycc(const pixcel_t *src, uint32_t width,
+    uint8_t *y, uint8_t *cb, uint8_t *cr, uint32_t count) {
+  uint32_t x;
+  int32_t r, g, b;
+  for (x = 0; x < count; x++) {
+    const color_t *c = &src[x < width ? x : width - 1].c;
+    r = c->r;
+    g = c->g;
+    b = c->b;
+    y[x] = (YCC_FIX(0.29900) * r + YCC_FIX(0.58700) * g + YCC_FIX(0.11400) * b
+        + YCC_HALF) >> YCC_SCALEBITS;
+    cb[x] = (-YCC_FIX(0.16874) * r - YCC_FIX(0.33126) * g + YCC_FIX(0.50000) * b
+        + YCC_OFFSET + YCC_HALF - 1) >> YCC_SCALEBITS;
+    cr[x] = (YCC_FIX(0.50000) * r - YCC_FIX(0.41869) * g - YCC_FIX(0.08131) * b
+        + YCC_OFFSET + YCC_HALF - 1) >> YCC_SCALEBITS;
+  }
+}
+
+/**
+ * @brief 画像をJPEGの平面画像に変換する。
+ *
+ * libjpegの色変換とダウンサンプリングを再現し、右端と下端の余白も
+ * libjpegと同じく画像の端の画素を繰り返した値から求めるため、
+ * 変換した平面画像を書き出した結果は画像を直接書き出した場合と同じになる。
+ *
+ * @param[in] img         画像データ、RGBかグレースケール
+ * @param[in] subsampling 色差のサブサンプリング(JPEG_SUBSAMPLING_*)
+ * @return 変換した平面画像、失敗した場合NULL
+ */
+static jpeg_planes_t *convert_to_planes(image_t *img, int subsampling) {
+  uint32_t x, y, k, hr, vr, sy;
+  int gray = (img->color_type == COLOR_TYPE_GRAY);
+  jpeg_planes_t *planes;
+  jpeg_plane_t *luma, *cb, *cr;
+  uint8_t *buffer, *row;
+  const pixcel_t *src;
+  planes = allocate_jpeg_planes(img->width, img->height, gray ? 1 : 3, subsampling);
+  if (planes == NULL) {
+    return NULL;
+  }
+  luma = &planes->plane[0];
+  if (gray) {
+    for (y = 0; y < luma->rows; y++) {
+      src = img->map[y < img->height ? y : img->height - 1];
+      row = luma->data + (size_t) luma->stride * y;
+      for (x = 0; x < luma->stride; x++) {
+        row[x] = src[x < img->width ? x : img->width - 1].g;
+      }
+    }
+    return planes;
+  }
+  cb = &planes->plane[1];
+  cr = &planes->plane[2];
+  hr = luma->h_samp_factor / cb->h_samp_factor;
+  vr = luma->v_samp_factor / cb->v_samp_factor;
+  // 色差はダウンサンプリング前の値を1iMCU行の単位の作業用バッファに求める
+  if ((buffer = malloc((size_t) luma->stride * vr * 2)) == NULL) {
+    free_jpeg_planes(planes);
+    return NULL;
+  }
+  for (y = 0; y < cb->rows; y++) {
+    for (k = 0; k < vr; k++) {
+      sy = y * vr + k;
+      convert_row_to_ycc(img->map[sy < img->height ? sy : img->height - 1], img->width,
+          luma->data + (size_t) luma->stride * sy,
+          buffer + (size_t) luma->stride * k,
+          buffer + (size_t) luma->stride * (vr + k), luma->stride);
+    }
+    for (k = 0; k < 2; k++) {
+      const uint8_t *r0 = buffer + (size_t) luma->stride * vr * k;
+      const uint8_t *r1 = r0 + (size_t) luma->stride * (vr - 1);
+      row = (k == 0 ? cb : cr)->data + (size_t) cb->stride * y;
+      // libjpegと同じく丸めの偏りを列ごとに交互に変える
+      if (hr == 1 && vr == 1) {
+        memcpy(row, r0, cb->stride);
+      } else if (vr == 1) {
+        for (x = 0; x < cb->stride; x++) {
+          row[x] = (r0[x * 2] + r0[x * 2 + 1] + (x & 1)) >> 1;
+        }
+      } else {
+        for (x = 0; x < cb->stride; x++) {
+          row[x] = (r0[x * 2] + r0[x * 2 + 1] + r1[x * 2] + r1[x * 2 + 1] + 1 + (x & 1)) >> 2;
+        }
+      }
+    }
+  }
   free(buffer);
+  return planes;
+}
+
+/**
+ * @brief 目標サイズでの書き出しの1回の試行
+ */
+typedef struct jpeg_size_trial_t {
+  const jpeg_planes_t *planes; /**< 変換済みの平面画像、NULLの場合は画像データから書き出す */
+  image_t *img;                /**< 画像データ */
+  jpeg_write_option_t opt;     /**< 試行する書き出しオプション */
+  unsigned char *data;         /**< 書き出し結果 */
+  unsigned long size;          /**< 書き出し結果のサイズ */
+  result_t result;             /**< 処理結果 */
+  int running;                 /**< スレッドが動作中か否か */
+  pthread_t thread;            /**< 試行を行うスレッド */
+} jpeg_size_trial_t;
+
+/**
+ * @brief 1つの品質でメモリ上に書き出す。
+ *
+ * @param[in,out] arg jpeg_size_trial_t
+ * @return NULL
+ */
+static void *run_size_trial(void *arg) {
+  jpeg_size_trial_t *t = arg;
+  t->data = NULL;
+  t->size = 0;
+  if (t->planes != NULL) {
+    t->result = encode_jpeg_planes(NULL, &t->data, &t->size, t->planes, &t->opt);
+  } else {
+    t->result = encode_jpeg(NULL, NULL, &t->data, &t->size, t->img, 0, t->img->height, &t->opt);
+  }
+  return NULL;
+}
+
+/**
+ * @brief 指定したサイズに収まる最高の品質でJPEG形式としてファイルに書き出す。
+ *
+ * @param[in]     filename 書き出すファイル名
+ * @param[in]     img      画像データ
+ * @param[in]     limit    書き出すサイズの上限(byte)
+ * @param[in,out] opt      書き出しオプション、threadsは試行の並列数に使用し、
+ *                         採用した品質とthreadsを1としたものを返す
+ * @return 成否
+ */
+result_t write_jpeg_file_within_size(const char *filename, image_t *img, size_t limit,
+    jpeg_write_option_t *opt) {
+  result_t result = FAILURE;
+  FILE *fp;
+  if (img == NULL) {
+    return result;
+  }
+  if ((fp = fopen(filename, "wb")) == NULL) {
+    perror(filename);
+    return result;
+  }
+  result = write_jpeg_stream_within_size(fp, img, limit, opt);
+  fclose(fp);
+  return result;
+}
+
+/**
+ * @brief 指定したサイズに収まる最高の品質でJPEG形式としてファイルに書き出す。
+ *
+ * 品質1-100の範囲で、各回optのthreadsの数の品質を等間隔に選んでメモリ上に並列に書き出し、
+ * 収まった最高の品質と収まらなかった最低の品質の間に範囲を狭めていく。
+ * 色変換とダウンサンプリングは最初に1度だけ行い、各試行で共有する。
+ * ただし平滑化を指定した場合は、平面画像の書き出しではlibjpegの平滑化が行われないため、
+ * 各試行で画像データから書き出す。
+ * 各試行は帯に分けた並列圧縮を使わずに書き出すため、optのthreadsは1としたものを返す。
+ * 書き出す結果は返したoptでwrite_jpeg_stream_with_option()を呼んだ場合と同じになる。
+ * 品質1でも収まらない場合は何も書き出さずに失敗する。
+ *
+ * @param[in]     fp    書き出すファイルストリームのポインタ
+ * @param[in]     img   画像データ
+ * @param[in]     limit 書き出すサイズの上限(byte)
+ * @param[in,out] opt   書き出しオプション、threadsは試行の並列数に使用し、
+ *                      採用した品質とthreadsを1としたものを返す、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_jpeg_stream_within_size(FILE *fp, image_t *img, size_t limit,
+    jpeg_write_option_t *opt) {
+  result_t result = FAILURE;
+  jpeg_write_option_t def;
+  jpeg_size_trial_t *trials = NULL;
+  jpeg_planes_t *planes = NULL;
+  image_t *to_free = NULL;
+  unsigned char *best = NULL;
+  unsigned long best_size = 0;
+  int i, num, threads, lo = 0, hi = 101, next_lo, next_hi;
+  if (img == NULL) {
+    return FAILURE;
+  }
+  if (opt == NULL) {
+    init_jpeg_write_option(&def);
+    opt = &def;
+  }
+  threads = opt->threads > 1 ? opt->threads : 1;
+  if (img->color_type != COLOR_TYPE_RGB && img->color_type != COLOR_TYPE_GRAY) {
+    // 画像形式がRGBでもグレースケールでもない場合はRGBに変換して出力
+    to_free = clone_image(img);
+    img = image_to_rgb(to_free);
+  }
+  if (opt->smoothing <= 0 && (planes = convert_to_planes(img, opt->subsampling)) == NULL) {
+    goto error;
+  }
+  if ((trials = calloc(threads, sizeof(jpeg_size_trial_t))) == NULL) {
+    goto error;
+  }
+  // 収まる品質lo(0は未発見)と収まらない品質hi(101は未発見)の間を狭める
+  while (hi - lo > 1) {
+    num = hi - lo - 1 < threads ? hi - lo - 1 : threads;
+    for (i = 0; i < num; i++) {
+      trials[i].planes = planes;
+      trials[i].img = img;
+      trials[i].opt = *opt;
+      trials[i].opt.threads = 1;
+      trials[i].opt.quality = lo + (hi - lo) * (i + 1) / (num + 1);
+    }
+    // 先頭以外はスレッドを作成し、このスレッドでも試行を行う
+    for (i = 1; i < num; i++) {
+      trials[i].running = (pthread_create(&trials[i].thread, NULL, run_size_trial, &trials[i]) == 0);
+    }
+    run_size_trial(&trials[0]);
+    for (i = 1; i < num; i++) {
+      if (trials[i].running) {
+        pthread_join(trials[i].thread, NULL);
+        trials[i].running = FALSE;
+      } else {
+        // スレッドを作成できなかった場合はこのスレッドで処理する
+        run_size_trial(&trials[i]);
+      }
+    }
+    next_lo = lo;
+    for (i = 0; i < num; i++) {
+      if (trials[i].result != SUCCESS) {
+        goto error;
+      }
+      if (trials[i].size <= limit && trials[i].opt.quality > next_lo) {
+        next_lo = trials[i].opt.quality;
+      }
+    }
+    next_hi = hi;
+    for (i = 0; i < num; i++) {
+      if (trials[i].size > limit && trials[i].opt.quality > next_lo
+          && trials[i].opt.quality < next_hi) {
+        next_hi = trials[i].opt.quality;
+      }
+      if (trials[i].opt.quality == next_lo && next_lo != lo) {
+        free(best);
+        best = trials[i].data;
+        best_size = trials[i].size;
+        trials[i].data = NULL;
+      }
+      free(trials[i].data);
+      trials[i].data = NULL;
+    }
+    lo = next_lo;
+    hi = next_hi;
+  }
+  if (best == NULL) {
+    goto error;
+  }
+  if (fwrite(best, 1, best_size, fp) != best_size) {
+    goto error;
+  }
+  opt->quality = lo;
+  opt->threads = 1;
+  result = SUCCESS;
+  error:
+  if (trials != NULL) {
+    for (i = 0; i < threads; i++) {
+      free(trials[i].data);
+    }
+    free(trials);
+  }
+  free(best);
+  free_jpeg_planes(planes);
   free_image(to_free);
   return result;
 }
@@ -15,49 +15,2339 @@
 #include <stdint.h>
 #include <string.h>
 #include <png.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "image.h"
 
+#define PNG_CONTEXT_BLOCKS 64 /**< コンテキストで保持する解放済みのメモリブロックの最大数 */
+#define BLOCK_HEADER_SIZE 16  /**< メモリブロックの先頭に置くサイズの領域、アライメントを保つ大きさ */
+
+/**
+ * @brief PNGの読み書きを繰り返すためのコンテキスト
+ *
+ * libpngのpng_structは画像ごとに作り直す必要があるため、
+ * png_struct、png_info、zlibの状態、行バッファなど画像ごとに確保と解放を繰り返すメモリを
+ * 解放せずに保持し、次の画像で同じサイズの確保があれば再利用する。
+ */
+struct png_context_t {
+  void *blocks[PNG_CONTEXT_BLOCKS]; /**< 解放済みのメモリブロック */
+  int num;                          /**< 保持しているメモリブロックの数 */
+};
+
+/**
+ * @brief コンテキストからメモリを確保する。
+ *
+ * 保持している解放済みのブロックに同じサイズのものがあれば再利用する。
+ *
+ * @param[in,out] ctx  コンテキスト、NULLの場合はmalloc()で確保する
+ * @param[in]     size 確保するサイズ
+ * @return 確保したメモリ、失敗した場合NULL
+ */
+static void *context_alloc(png_context_t *ctx, size_t size) {
+  int i;
+  uint8_t *block;
+  if (ctx == NULL) {
+    return malloc(size);
+  }
+  for (i = ctx->num - 1; i >= 0; i--) {
+    block = ctx->blocks[i];
+    if (*(size_t *) block == size) {
+      ctx->blocks[i] = ctx->blocks[--ctx->num];
+      return block + BLOCK_HEADER_SIZE;
+    }
+  }
+  if ((block = malloc(size + BLOCK_HEADER_SIZE)) == NULL) {
+    return NULL;
+  }
+  *(size_t *) block = size;
+  return block + BLOCK_HEADER_SIZE;
+}
+
+/**
+ * @brief コンテキストから確保したメモリを解放する。
+ *
+ * 解放せずにコンテキストで保持し、保持できる数を超えた場合は最も古いブロックを解放する。
+ *
+ * @param[in,out] ctx コンテキスト、NULLの場合はfree()で解放する
+ * @param[in]     ptr context_alloc()で確保したメモリ
+ */
+static void context_free(png_context_t *ctx, void *ptr) {
+  if (ctx == NULL || ptr == NULL) {
+    free(ptr);
+    return;
+  }
+  if (ctx->num == PNG_CONTEXT_BLOCKS) {
+    free(ctx->blocks[0]);
+    memmove(ctx->blocks, ctx->blocks + 1, sizeof(void *) * (PNG_CONTEXT_BLOCKS - 1));
+    ctx->num--;
+  }
+  ctx->blocks[ctx->num++] = (uint8_t *) ptr - BLOCK_HEADER_SIZE;
+}
+
+/**
+ * @brief libpngのメモリ確保の関数
+ *
+ * @param[in] png  png_struct
+ * @param[in] size 確保するサイズ
+ * @return 確保したメモリ、失敗した場合NULL
+ */
+static png_voidp png_context_malloc(png_structp png, png_alloc_size_t size) {
+  return context_alloc(png_get_mem_ptr(png), size);
+}
+
+/**
+ * @brief libpngのメモリ解放の関数
+ *
+ * @param[in] png png_struct
+ * @param[in] ptr 解放するメモリ
+ */
+static void png_context_free(png_structp png, png_voidp ptr) {
+  context_free(png_get_mem_ptr(png), ptr);
+}
+
+/**
+ * @brief 読み込み用のpng_structを作成する。
+ *
+ * @param[in] ctx コンテキスト、NULLの場合はlibpngの標準のメモリ管理を使う
+ * @return png_struct、失敗した場合NULL
+ */
+static png_structp create_read_struct(png_context_t *ctx) {
+  if (ctx == NULL) {
+    return png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  }
+  return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+      ctx, png_context_malloc, png_context_free);
+}
+
+/**
+ * @brief 書き出し用のpng_structを作成する。
+ *
+ * @param[in] ctx コンテキスト、NULLの場合はlibpngの標準のメモリ管理を使う
+ * @return png_struct、失敗した場合NULL
+ */
+static png_structp create_write_struct(png_context_t *ctx) {
+  if (ctx == NULL) {
+    return png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  }
+  return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+      ctx, png_context_malloc, png_context_free);
+}
+
+/**
+ * @brief PNGの読み書きを繰り返すためのコンテキストを作成する。
+ *
+ * 小さな画像を大量に読み書きする場合に、画像ごとのメモリの確保と解放を省く。
+ * 1つのコンテキストは同時に1つのスレッドからのみ使用すること。
+ *
+ * @return 作成したコンテキスト、失敗した場合NULL
+ */
+png_context_t *create_png_context(void) {
+  return calloc(1, sizeof(png_context_t));
+}
+
+/**
+ * @brief コンテキストが保持しているメモリを解放する。
+ *
+ * 大きな画像を扱った後などに呼び出す。コンテキストは引き続き使用できる。
+ *
+ * @param[in,out] ctx コンテキスト
+ */
+void reset_png_context(png_context_t *ctx) {
+  int i;
+  if (ctx == NULL) {
+    return;
+  }
+  for (i = 0; i < ctx->num; i++) {
+    free(ctx->blocks[i]);
+  }
+  ctx->num = 0;
+}
+
+/**
+ * @brief コンテキストを解放する。
+ *
+ * @param[in] ctx コンテキスト
+ */
+void free_png_context(png_context_t *ctx) {
+  reset_png_context(ctx);
+  free(ctx);
+}
+
+/**
+ * @brief PNG形式のファイルを読み込む。
+ *
+ * @param[in] filename ファイル名
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_png_file(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  image_t *img = read_png_stream(fp);
+  fclose(fp);
+  return img;
+}
+
+/**
+ * @brief 読み込み時の変換を設定する。
+ *
+ * 16bitは8bitに落とし、8bit未満は1画素1byteに展開する。
+ * directを指定した場合、RGBとグレースケール+αは画素情報と同じ4byte/画素の
+ * レイアウトになるようにlibpngの変換を設定し、読み込んだ行をそのまま利用できるようにする。
+ * それ以外の場合はPNGの画素のレイアウトのまま読み込まれるため、
+ * unpack_row()で展開する必要がある。
+ *
+ * @param[in] png    png_struct
+ * @param[in] info   png_info
+ * @param[in] direct 可能な場合画素情報のレイアウトで読み込むか否か
+ * @return 読み込み結果の色表現の種別、対応していない形式の場合-1
+ */
+static int set_read_transform(png_structp png, png_infop info, int direct) {
+  png_set_strip_16(png);
+  png_set_packing(png);
+  switch (png_get_color_type(png, info)) {
+    case PNG_COLOR_TYPE_PALETTE:  // インデックスカラー
+      return COLOR_TYPE_INDEX;
+    case PNG_COLOR_TYPE_GRAY:  // グレースケール
+      png_set_expand_gray_1_2_4_to_8(png);
+      return COLOR_TYPE_GRAY;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:  // グレースケール+α
+      if (direct) {
+        png_set_gray_to_rgb(png);
+      }
+      return COLOR_TYPE_RGBA;
+    case PNG_COLOR_TYPE_RGB:  // RGB
+      if (direct) {
+        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+      }
+      return COLOR_TYPE_RGB;
+    case PNG_COLOR_TYPE_RGB_ALPHA:  // RGBA
+      return COLOR_TYPE_RGBA;
+  }
+  return -1;
+}
+
+/**
+ * @brief PNGの画素のレイアウトで読み込んだ行を画素情報のレイアウトに展開する。
+ *
+ * 末尾側から展開するため、dstの行の先頭に詰めて格納された値を
+ * 作業用バッファを使わずに同じ行の上で展開することもできる。
+ *
+ * @param[out] dst        展開先の行
+ * @param[in]  src        PNGの画素のレイアウトの行
+ * @param[in]  width      画像の幅
+ * @param[in]  channels   1画素のbyte数
+ * @param[in]  color_type 色表現の種別
+ */
+static void unpack_row(pixcel_t *dst, const png_byte *src, uint32_t width,
+    int channels, int color_type) {
+  uint32_t x;
+  pixcel_t p;
+  switch (channels) {
+    case 1:  // インデックスカラー、グレースケール
+      memset(&p, 0, sizeof(p));
+      for (x = width; x-- > 0;) {
+        if (color_type == COLOR_TYPE_INDEX) {
+          p.i = src[x];
+        } else {
+          p.g = src[x];
+        }
+        dst[x] = p;
+      }
+      break;
+    case 2:  // グレースケール+α
+      for (x = width; x-- > 0;) {
+        const png_byte *s = &src[x * 2];
+        p.c = color_from_rgba(s[0], s[0], s[0], s[1]);
+        dst[x] = p;
+      }
+      break;
+    case 3:  // RGB
+      for (x = width; x-- > 0;) {
+        const png_byte *s = &src[x * 3];
+        p.c = color_from_rgb(s[0], s[1], s[2]);
+        dst[x] = p;
+      }
+      break;
+    case 4:  // RGBA
+      memmove(dst, src, sizeof(pixcel_t) * width);
+      break;
+  }
+}
+
+/**
+ * @brief カラーパレットを読み込む。
+ *
+ * @param[in]     png  png_struct
+ * @param[in]     info png_info
+ * @param[in,out] img  カラーパレットを格納する画像
+ */
+static void read_palette(png_structp png, png_infop info, image_t *img) {
+  int i;
+  int num = 0;
+  png_colorp palette;
+  png_bytep trans = NULL;
+  int num_trans = 0;
+  png_get_PLTE(png, info, &palette, &num);
+  img->palette_num = num;
+  for (i = 0; i < num; i++) {
+    png_color pc = palette[i];
+    img->palette[i] = color_from_rgb(pc.red, pc.green, pc.blue);
+  }
+  if (png_get_tRNS(png, info, &trans, &num_trans, NULL) == PNG_INFO_tRNS
+      && trans != NULL && num_trans > 0) {
+    for (i = 0; i < num_trans && i < num; i++) {
+      img->palette[i].a = trans[i];
+    }
+  }
+}
+
+#define PIPELINE_ROWS_PER_THREAD 8 /**< パイプライン読み込みでスレッドあたりに用意する行バッファの数 */
+#define PIPELINE_SPIN_COUNT 64     /**< パイプライン読み込みで眠って待つ前に状態を確認し直す回数 */
+
+/**
+ * @brief パイプライン読み込みの状態
+ *
+ * デコードを行うスレッドが書き込み、変換を行うスレッドが読み出す行バッファのリングを持つ。
+ * リングの各スロットの状態はseqで表し、行yを書き込めるときはy、
+ * 行yが書き込み済みで変換を待っているときはy + 1となる。
+ * 変換が終わるとslotsを加えて次の周回の行を書き込めるようにする。
+ *
+ * 状態の変化を待つ側は少しの間だけ確認を繰り返し、変化しなければ条件変数で眠る。
+ * 状態を変えた側は眠っているスレッドがいる場合だけ条件変数で起こす。
+ */
+typedef struct png_pipeline_t {
+  image_t *img;           /**< 画像データ */
+  int color_type;         /**< 読み込み結果の色表現の種別 */
+  int to;                 /**< 行ごとに変換する色表現の種別 */
+  int channels;           /**< 1画素のbyte数 */
+  size_t row_size;        /**< 1行のbyte数 */
+  uint32_t slots;         /**< 行バッファの数 */
+  png_bytep rows;         /**< 行バッファ */
+  atomic_uint *seq;       /**< 各行バッファの状態 */
+  atomic_uint next;       /**< 次に変換する行 */
+  atomic_int abort;       /**< 中断要求 */
+  atomic_int failed;      /**< 変換の失敗 */
+  atomic_int waiters;     /**< 条件変数で眠っているスレッドの数 */
+  pthread_mutex_t lock;   /**< 条件変数で待つためのロック */
+  pthread_cond_t changed; /**< 行バッファの状態が変化したことの通知 */
+  int num;                /**< 変換を行うスレッドの数 */
+  pthread_t *threads;     /**< 変換を行うスレッド */
+} png_pipeline_t;
+
+/**
+ * @brief 待っている状態になったか否かを返す。
+ *
+ * @param[in] p       パイプラインの状態
+ * @param[in] slot    行バッファの番号
+ * @param[in] value   待っている行バッファの状態
+ * @param[in] pending この行より前に変換待ちの行があれば待つのをやめる、使わない場合0
+ * @return 待つのをやめる場合TRUE
+ */
+static int is_pipeline_ready(png_pipeline_t *p, uint32_t slot, uint32_t value, uint32_t pending) {
+  return atomic_load(&p->seq[slot]) == value
+      || atomic_load(&p->next) < pending
+      || atomic_load(&p->abort);
+}
+
+/**
+ * @brief 行バッファの状態が変化するのを待つ。
+ *
+ * 変換スレッドはデコードより速く、ほとんどの時間を待って過ごすため、
+ * PIPELINE_SPIN_COUNT回確認して変化がなければ条件変数で眠り、CPUを消費しない。
+ *
+ * @param[in,out] p       パイプラインの状態
+ * @param[in]     slot    行バッファの番号
+ * @param[in]     value   待っている行バッファの状態
+ * @param[in]     pending この行より前に変換待ちの行があれば待つのをやめる、使わない場合0
+ */
+static void wait_pipeline(png_pipeline_t *p, uint32_t slot, uint32_t value, uint32_t pending) {
+  int i;
+  for (i = 0; i < PIPELINE_SPIN_COUNT; i++) {
+    if (is_pipeline_ready(p, slot, value, pending)) {
+      return;
+    }
+    sched_yield();
+  }
+  // 通知側は状態を変えてからwaitersを確認するため、先にwaitersを増やしてから確認し直す
+  atomic_fetch_add(&p->waiters, 1);
+  pthread_mutex_lock(&p->lock);
+  while (!is_pipeline_ready(p, slot, value, pending)) {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  atomic_fetch_sub(&p->waiters, 1);
+}
+
+/**
+ * @brief 行バッファの状態の変化を眠っているスレッドに通知する。
+ *
+ * @param[in,out] p パイプラインの状態
+ */
+static void notify_pipeline(png_pipeline_t *p) {
+  if (atomic_load(&p->waiters) > 0) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+ * @brief 1行分を変換する。
+ *
+ * @param[in,out] p パイプラインの状態
+ * @param[in]     y 変換する行
+ */
+static void convert_pipeline_row(png_pipeline_t *p, uint32_t y) {
+  const uint32_t slot = y % p->slots;
+  image_t *img = p->img;
+  unpack_row(img->map[y], p->rows + p->row_size * slot, img->width, p->channels, p->color_type);
+  if (convert_pixcels(img->map[y], img->width, p->color_type, p->to,
+      img->palette, img->palette_num) != SUCCESS) {
+    atomic_store(&p->failed, TRUE);
+  }
+  atomic_store(&p->seq[slot], y + p->slots);
+  notify_pipeline(p);
+}
+
+/**
+ * @brief 書き込み済みの行を順に取り出して変換する。
+ *
+ * スレッドのエントリポイントとなる。
+ *
+ * @param[in,out] arg パイプラインの状態(png_pipeline_t)
+ * @return NULL
+ */
+static void *convert_pipeline(void *arg) {
+  png_pipeline_t *p = arg;
+  uint32_t y;
+  while ((y = atomic_fetch_add(&p->next, 1)) < p->img->height) {
+    const uint32_t slot = y % p->slots;
+    wait_pipeline(p, slot, y + 1, 0);
+    if (atomic_load(&p->abort)) {
+      return NULL;
+    }
+    convert_pipeline_row(p, y);
+  }
+  return NULL;
+}
+
+/**
+ * @brief パイプラインで全行を読み込む。
+ *
+ * このスレッドでlibpngのデコードを行い、変換は別スレッドで行う。
+ * 行バッファが全て使用中の場合は、書き込み済みの行の変換をこのスレッドでも行う。
+ * libpngのエラーで中断した場合も変換スレッドを終了させてから戻る。
+ *
+ * @param[in]     png png_struct
+ * @param[in,out] p   パイプラインの状態
+ * @return 成否
+ */
+static result_t read_rows_pipeline(png_structp png, png_pipeline_t *p) {
+  uint32_t y, n;
+  int i;
+  if (setjmp(png_jmpbuf(png))) {
+    atomic_store(&p->abort, TRUE);
+    notify_pipeline(p);
+    for (i = 0; i < p->num; i++) {
+      pthread_join(p->threads[i], NULL);
+    }
+    return FAILURE;
+  }
+  for (i = 0; i < p->num; i++) {
+    if (pthread_create(&p->threads[i], NULL, convert_pipeline, p) != 0) {
+      break;
+    }
+  }
+  p->num = i;
+  for (y = 0; y < p->img->height; y++) {
+    const uint32_t slot = y % p->slots;
+    while (atomic_load(&p->seq[slot]) != y) {
+      // 空きがなければ変換待ちの行を引き受ける、yより前の行は全て書き込み済み
+      n = atomic_load(&p->next);
+      if (n < y && atomic_compare_exchange_weak(&p->next, &n, n + 1)) {
+        convert_pipeline_row(p, n);
+      } else {
+        wait_pipeline(p, slot, y, y);
+      }
+    }
+    png_read_row(png, p->rows + p->row_size * slot, NULL);
+    atomic_store(&p->seq[slot], y + 1);
+    notify_pipeline(p);
+  }
+  convert_pipeline(p);
+  for (i = 0; i < p->num; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  p->num = 0;
+  png_read_end(png, NULL);
+  return atomic_load(&p->failed) ? FAILURE : SUCCESS;
+}
+
+/**
+ * @brief 画像全体の色表現を変換する。
+ *
+ * 変換に失敗した場合は画像を開放する。
+ *
+ * @param[in,out] img        変換する画像
+ * @param[in]     color_type 変換先の色表現の種別
+ * @return 変換した画像、失敗した場合NULL
+ */
+static image_t *convert_image(image_t *img, int color_type) {
+  image_t *converted = NULL;
+  switch (color_type) {
+    case COLOR_TYPE_INDEX:
+      converted = image_to_index(img);
+      break;
+    case COLOR_TYPE_GRAY:
+      converted = image_to_gray(img);
+      break;
+    case COLOR_TYPE_RGB:
+      converted = image_to_rgb(img);
+      break;
+    case COLOR_TYPE_RGBA:
+      converted = image_to_rgba(img);
+      break;
+  }
+  if (converted == NULL) {
+    free_image(img);
+  }
+  return converted;
+}
+
+/**
+ * @brief PNG形式のファイルを読み込む。
+ *
+ * @param[in] fp ファイルストリーム
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_png_stream(FILE *fp) {
+  return read_png_stream_with_option(fp, NULL);
+}
+
+/**
+ * @brief PNG読み込みオプションを標準の設定で初期化する。
+ *
+ * シングルスレッドで、ファイルの形式のまま読み込む設定とする。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_png_read_option(png_read_option_t *opt) {
+  opt->threads = 0;
+  opt->color_type = -1;
+}
+
+/**
+ * @brief オプションを指定してPNG形式のファイルを読み込む。
+ *
+ * @param[in] filename ファイル名
+ * @param[in] opt      読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_png_file_with_option(const char *filename, const png_read_option_t *opt) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  image_t *img = read_png_stream_with_option(fp, opt);
+  fclose(fp);
+  return img;
+}
+
+/**
+ * @brief メモリ上から読み込むためのソース
+ */
+typedef struct png_source_t {
+  const uint8_t *data; /**< PNG形式のデータ */
+  size_t size;         /**< データのサイズ */
+  size_t offset;       /**< 次に読み込む位置 */
+} png_source_t;
+
+/**
+ * @brief メモリ上のデータから読み込むlibpngの入力関数
+ *
+ * @param[in]  png  png_struct
+ * @param[out] data 読み込み先
+ * @param[in]  size 読み込むサイズ
+ */
+static void read_memory(png_structp png, png_bytep data, size_t size) {
+  png_source_t *src = png_get_io_ptr(png);
+  if (size > src->size - src->offset) {
+    png_error(png, "unexpected end of data");
+  }
+  memcpy(data, src->data + src->offset, size);
+  src->offset += size;
+}
+
+/**
+ * @brief PNG形式のファイルを読み込む。
+ *
+ * fpがNULLの場合はメモリ上のデータから読み込む。
+ *
+ * @param[in,out] ctx  コンテキスト、NULLの場合は使用しない
+ * @param[in]     fp   ファイルストリーム、NULLの場合はdataから読み込む
+ * @param[in]     data PNG形式のデータ
+ * @param[in]     size データのサイズ
+ * @param[in]     opt  読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+static image_t *read_png(png_context_t *ctx, FILE *fp, const uint8_t *data, size_t size,
+    const png_read_option_t *opt) {
+  result_t result = FAILURE;
+  image_t *volatile img = NULL;
+  png_pipeline_t *volatile pipeline = NULL;
+  uint32_t i, y;
+  uint32_t width, height;
+  int color_type;
+  int to = -1;
+  int pass, passes;
+  int expand;
+  int threads = 0;
+  png_structp png = NULL;
+  png_infop info = NULL;
+  png_byte sig_bytes[8];
+  png_source_t src;
+  if (opt != NULL) {
+    threads = opt->threads;
+    to = opt->color_type;
+  }
+  if (fp != NULL) {
+    if (fread(sig_bytes, sizeof(sig_bytes), 1, fp) != 1) {
+      return NULL;
+    }
+  } else {
+    if (size < sizeof(sig_bytes)) {
+      return NULL;
+    }
+    memcpy(sig_bytes, data, sizeof(sig_bytes));
+    src.data = data;
+    src.size = size;
+    src.offset = sizeof(sig_bytes);
+  }
+  if (png_sig_cmp(sig_bytes, 0, sizeof(sig_bytes))) {
+    return NULL;
+  }
+  png = create_read_struct(ctx);
+  if (png == NULL) {
+    goto error;
+  }
+  info = png_create_info_struct(png);
+  if (info == NULL) {
+    goto error;
+  }
+  if (setjmp(png_jmpbuf(png))) {
+    goto error;
+  }
+  if (fp != NULL) {
+    png_init_io(png, fp);
+  } else {
+    png_set_read_fn(png, &src, read_memory);
+  }
+  png_set_sig_bytes(png, sizeof(sig_bytes));
+  png_read_info(png, info);
+  if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+    // インターレースの場合は最終パスまで行が確定しないためパイプラインにできない
+    threads = 0;
+  }
+  if ((color_type = set_read_transform(png, info, threads <= 0)) < 0) {
+    goto error;
+  }
+  passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+  width = png_get_image_width(png, info);
+  height = png_get_image_height(png, info);
+  if ((img = allocate_image(width, height, color_type)) == NULL) {
+    goto error;
+  }
+  if (color_type == COLOR_TYPE_INDEX) {
+    read_palette(png, info, img);
+  }
+  if (threads > 0) {
+    png_pipeline_t *p;
+    if ((pipeline = p = calloc(1, sizeof(png_pipeline_t))) == NULL) {
+      goto error;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    p->img = img;
+    p->color_type = color_type;
+    // インデックスカラーへの変換は行単位ではできないので全行を読み込んでから行う
+    p->to = (to < 0 || to == COLOR_TYPE_INDEX) ? color_type : to;
+    p->channels = png_get_channels(png, info);
+    p->row_size = png_get_rowbytes(png, info);
+    p->slots = threads * PIPELINE_ROWS_PER_THREAD;
+    p->num = threads;
+    if ((p->rows = malloc(p->row_size * p->slots)) == NULL
+        || (p->seq = calloc(p->slots, sizeof(atomic_uint))) == NULL
+        || (p->threads = calloc(p->num, sizeof(pthread_t))) == NULL) {
+      goto error;
+    }
+    for (i = 0; i < p->slots; i++) {
+      atomic_init(&p->seq[i], i);
+    }
+    atomic_init(&p->next, 0);
+    atomic_init(&p->abort, FALSE);
+    atomic_init(&p->failed, FALSE);
+    atomic_init(&p->waiters, 0);
+    if (read_rows_pipeline(png, p) != SUCCESS) {
+      goto error;
+    }
+    if (p->to != color_type) {
+      img->color_type = p->to;
+      if (color_type == COLOR_TYPE_INDEX) {
+        free(img->palette);
+        img->palette = NULL;
+        img->palette_num = 0;
+      }
+    }
+  } else {
+    // インデックスカラーとグレースケールは1byte/画素で読み込まれるので展開が必要
+    expand = (color_type == COLOR_TYPE_INDEX || color_type == COLOR_TYPE_GRAY);
+    for (pass = 0; pass < passes; pass++) {
+      for (y = 0; y < height; y++) {
+        png_read_row(png, (png_bytep) img->map[y], NULL);
+        if (expand && passes == 1) {
+          unpack_row(img->map[y], (png_bytep) img->map[y], width, 1, color_type);
+        }
+      }
+    }
+    if (expand && passes > 1) {
+      // インターレースの場合は全パスの読み込みが終わってから展開する
+      for (y = 0; y < height; y++) {
+        unpack_row(img->map[y], (png_bytep) img->map[y], width, 1, color_type);
+      }
+    }
+    png_read_end(png, NULL);
+  }
+  result = SUCCESS;
+  error:
+  png_destroy_read_struct(&png, &info, NULL);
+  if (pipeline != NULL) {
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->changed);
+    free(pipeline->rows);
+    free(pipeline->seq);
+    free(pipeline->threads);
+    free(pipeline);
+  }
+  if (result != SUCCESS) {
+    free_image(img);
+    return NULL;
+  }
+  if (to >= 0 && img->color_type != to) {
+    return convert_image(img, to);
+  }
+  return img;
+}
+
+/**
+ * @brief オプションを指定してPNG形式のファイルを読み込む。
+ *
+ * 1行ずつ画像データの行へ直接デコードするため、
+ * 画像全体の中間バッファは確保しない。
+ * インターレース画像の場合は各パスを同じ行に重ねて読み込む。
+ *
+ * 変換スレッド数が指定された場合、インターレースでない画像は
+ * デコードと画素の展開、色表現の変換をパイプラインで並行して行う。
+ *
+ * @param[in] fp  ファイルストリーム
+ * @param[in] opt 読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_png_stream_with_option(FILE *fp, const png_read_option_t *opt) {
+  return read_png(NULL, fp, NULL, 0, opt);
+}
+
+/**
+ * @brief コンテキストを使ってPNG形式のファイルを読み込む。
+ *
+ * png_struct、zlibの状態などのメモリをコンテキストから確保し、次の画像で再利用する。
+ *
+ * @param[in,out] ctx コンテキスト
+ * @param[in]     fp  ファイルストリーム
+ * @param[in]     opt 読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_png_stream_with_context(png_context_t *ctx, FILE *fp, const png_read_option_t *opt) {
+  return read_png(ctx, fp, NULL, 0, opt);
+}
+
+/**
+ * @brief メモリ上のPNG形式のデータを読み込む。
+ *
+ * @param[in] data PNG形式のデータ
+ * @param[in] size データのサイズ
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_png_memory(const uint8_t *data, size_t size) {
+  return read_png_memory_with_option(data, size, NULL);
+}
+
+/**
+ * @brief オプションを指定してメモリ上のPNG形式のデータを読み込む。
+ *
+ * 読み込み処理はread_png_stream_with_option()と同じ。
+ *
+ * @param[in] data PNG形式のデータ
+ * @param[in] size データのサイズ
+ * @param[in] opt  読み込みオプション、NULLの場合標準の設定
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_png_memory_with_option(const uint8_t *data, size_t size,
+    const png_read_option_t *opt) {
+  if (data == NULL) {
+    return NULL;
+  }
+  return read_png(NULL, NULL, data, size, opt);
+}
+
+/**
+ * @brief PNG形式としてファイルに書き出す。
+ *
+ * @param[in] filename 書き出すファイル名
+ * @param[in] img      画像データ
+ * @return 成否
+ */
+result_t write_png_file(const char *filename, image_t *img) {
+  result_t result = FAILURE;
+  if (img == NULL) {
+    return result;
+  }
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    perror(filename);
+    return result;
+  }
+  result = write_png_stream(fp, img);
+  fclose(fp);
+  return result;
+}
+
+/**
+ * @brief オプションを指定してPNG形式としてファイルに書き出す。
+ *
+ * @param[in] filename 書き出すファイル名
+ * @param[in] img      画像データ
+ * @param[in] opt      書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_png_file_with_option(const char *filename, image_t *img,
+    const png_write_option_t *opt) {
+  result_t result = FAILURE;
+  if (img == NULL) {
+    return result;
+  }
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    perror(filename);
+    return result;
+  }
+  result = write_png_stream_with_option(fp, img, opt);
+  fclose(fp);
+  return result;
+}
+
+/**
+ * @brief PNG書き出しオプションを標準の設定で初期化する。
+ *
+ * 全ての項目をlibpngの標準の設定のままとする。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_png_write_option(png_write_option_t *opt) {
+  opt->level = -1;
+  opt->strategy = -1;
+  opt->filters = 0;
+  opt->buffer_size = 0;
+  opt->threads = 1;
+  opt->palette_order = PNG_WRITE_PALETTE_KEEP;
+  opt->encoder = PNG_WRITE_ENCODER_LIBPNG;
+  opt->interlace = FALSE;
+}
+
+/**
+ * @brief PNG書き出しオプションを速度優先の設定で初期化する。
+ *
+ * 圧縮率よりもエンコードの速さを優先する。
+ * フィルタはSubのみに固定して試行を省き、
+ * zlibは最低レベルでランレングスのみを探索させる。
+ *
+ * @param[out] opt 初期化するオプション
+ */
+void init_png_write_option_fastest(png_write_option_t *opt) {
+  opt->level = 1;
+  opt->strategy = PNG_WRITE_STRATEGY_RLE;
+  opt->filters = PNG_WRITE_FILTER_SUB;
+  opt->buffer_size = 64 * 1024;
+  opt->threads = 1;
+  opt->palette_order = PNG_WRITE_PALETTE_KEEP;
+  opt->encoder = PNG_WRITE_ENCODER_LIBPNG;
+  opt->interlace = FALSE;
+}
+
+/**
+ * @brief 書き出すカラーパレット
+ *
+ * 画像データのカラーパレットを並べ替えて書き出す場合、
+ * 画像データのインデックスはlutで書き出すインデックスに変換する。
+ */
+typedef struct png_palette_t {
+  color_t colors[256]; /**< 書き出すカラーパレット */
+  int num;             /**< 書き出すカラーパレットの数 */
+  png_byte lut[256];   /**< 画像データのインデックスから書き出すインデックスへの変換表 */
+} png_palette_t;
+
+/**
+ * @brief カラーパレットの各エントリの使用回数を数える。
+ *
+ * @param[in]  img   画像データ
+ * @param[out] count エントリごとの使用回数
+ */
+static void count_palette(image_t *img, uint32_t *count) {
+  uint32_t x, y;
+  memset(count, 0, sizeof(uint32_t) * 256);
+  for (y = 0; y < img->height; y++) {
+    for (x = 0; x < img->width; x++) {
+      count[img->map[y][x].i]++;
+    }
+  }
+}
+
+/**
+ * @brief インデックスの並びをキーの昇順に並べ替える。
+ *
+ * キーが同じ場合は元の順序を保つ。
+ *
+ * @param[in,out] index インデックスの並び
+ * @param[in]     num   インデックスの数
+ * @param[in]     key   インデックスごとのキー
+ */
+static void sort_palette(uint8_t *index, int num, const uint32_t *key) {
+  int i, j;
+  uint8_t v;
+  for (i = 1; i < num; i++) {
+    v = index[i];
+    for (j = i; j > 0 && key[index[j - 1]] > key[v]; j--) {
+      index[j] = index[j - 1];
+    }
+    index[j] = v;
+  }
+}
+
+/**
+ * @brief 隣接して現れることが多いエントリ同士が近くなるように並べる。
+ *
+ * 上下左右に隣接するエントリの組の出現回数を数え、
+ * 最も使用回数の多いエントリから始めて、
+ * 直前に並べたエントリと隣接する回数が最も多いものを順に並べていく。
+ * 隣接するインデックスの差が小さくなり、フィルタ後の値が0付近に集まりやすくなる。
+ *
+ * @param[in]  img   画像データ
+ * @param[in]  count エントリごとの使用回数
+ * @param[out] index 並べたインデックス
+ * @return 成否
+ */
+static result_t order_by_cooccurrence(image_t *img, const uint32_t *count, uint8_t *index) {
+  int i, j, n, best;
+  uint32_t x, y;
+  uint8_t a, b;
+  uint8_t used[256];
+  const uint32_t *row;
+  uint32_t *pair = calloc(256 * 256, sizeof(uint32_t));
+  if (pair == NULL) {
+    return FAILURE;
+  }
+  for (y = 0; y < img->height; y++) {
+    for (x = 0; x < img->width; x++) {
+      a = img->map[y][x].i;
+      if (x > 0 && (b = img->map[y][x - 1].i) != a) {
+        pair[a * 256 + b]++;
+        pair[b * 256 + a]++;
+      }
+      if (y > 0 && (b = img->map[y - 1][x].i) != a) {
+        pair[a * 256 + b]++;
+        pair[b * 256 + a]++;
+      }
+    }
+  }
+  memset(used, 0, sizeof(used));
+  for (n = 0; n < img->palette_num; n++) {
+    best = -1;
+    row = n > 0 ? pair + index[n - 1] * 256 : NULL;
+    for (i = 0; i < img->palette_num; i++) {
+      if (used[i]) {
+        continue;
+      }
+      // 隣接回数、使用回数の順に比較し、同じ場合は元の順序を優先する
+      j = best;
+      if (j < 0
+          || (row != NULL && row[i] > row[j])
+          || ((row == NULL || row[i] == row[j]) && count[i] > count[j])) {
+        best = i;
+      }
+    }
+    index[n] = best;
+    used[best] = TRUE;
+  }
+  free(pair);
+  return SUCCESS;
+}
+
+/**
+ * @brief 書き出すカラーパレットを作成する。
+ *
+ * PNG_WRITE_PALETTE_KEEP以外の場合は指定された順に並べ替え、
+ * 使用されていないエントリは取り除く。
+ * また、tRNSが短くなるように不透明でないエントリを先頭に集める。
+ *
+ * @param[in]  img   画像データ
+ * @param[in]  order カラーパレットの並べ方(PNG_WRITE_PALETTE_*)
+ * @param[out] pal   書き出すカラーパレット
+ */
+static void make_palette(image_t *img, int order, png_palette_t *pal) {
+  int i, n, opaque;
+  uint32_t count[256];
+  uint32_t key[256];
+  uint8_t index[256];
+  color_t c;
+  for (i = 0; i < 256; i++) {
+    pal->lut[i] = i;
+  }
+  memcpy(pal->colors, img->palette, sizeof(color_t) * img->palette_num);
+  pal->num = img->palette_num;
+  if (order == PNG_WRITE_PALETTE_KEEP || img->palette_num == 0) {
+    return;
+  }
+  count_palette(img, count);
+  for (i = 0; i < img->palette_num; i++) {
+    index[i] = i;
+  }
+  if (order != PNG_WRITE_PALETTE_COOCCURRENCE
+      || order_by_cooccurrence(img, count, index) != SUCCESS) {
+    for (i = 0; i < img->palette_num; i++) {
+      c = img->palette[i];
+      if (order == PNG_WRITE_PALETTE_LUMINANCE) {
+        // ITU-R BT.601規定の輝度の昇順
+        key[i] = 299 * c.r + 587 * c.g + 114 * c.b;
+      } else {
+        // 使用回数の降順
+        key[i] = UINT32_MAX - count[i];
+      }
+    }
+    sort_palette(index, img->palette_num, key);
+  }
+  memset(pal->lut, 0, sizeof(pal->lut));
+  n = 0;
+  for (opaque = FALSE; opaque <= TRUE; opaque++) {
+    for (i = 0; i < img->palette_num; i++) {
+      c = img->palette[index[i]];
+      if (count[index[i]] > 0 && (c.a == 0xff) == opaque) {
+        pal->colors[n] = c;
+        pal->lut[index[i]] = n;
+        n++;
+      }
+    }
+  }
+  pal->num = n > 0 ? n : 1;
+}
+
+/**
+ * @brief カラーパレットを書き出し用に設定する。
+ *
+ * 透過情報は不透明でない最後のエントリまでをtRNSとして設定する。
+ *
+ * @param[in] png  png_struct
+ * @param[in] info png_info
+ * @param[in] pal  書き出すカラーパレット
+ */
+static void write_palette(png_structp png, png_infop info, const png_palette_t *pal) {
+  int i;
+  int num_trans;
+  png_color palette[256];
+  png_byte trans[256];
+  for (i = 0; i < pal->num; i++) {
+    palette[i].red = pal->colors[i].r;
+    palette[i].green = pal->colors[i].g;
+    palette[i].blue = pal->colors[i].b;
+  }
+  png_set_PLTE(png, info, palette, pal->num);
+  for (i = pal->num - 1; i >= 0 && pal->colors[i].a == 0xff; i--);
+  if (i >= 0) {
+    num_trans = i + 1;
+    for (i = 0; i < num_trans; i++) {
+      trans[i] = pal->colors[i].a;
+    }
+    png_set_tRNS(png, info, trans, num_trans, NULL);
+  }
+}
+
+/**
+ * @brief 画像データの行をPNGの画素のレイアウトで作業用バッファに詰める。
+ *
+ * @param[out] dst        書き込み先
+ * @param[in]  src        画像データの行
+ * @param[in]  width      画像の幅
+ * @param[in]  color_type 色表現の種別
+ * @param[in]  lut        インデックスの変換表、変換しない場合NULL
+ */
+static void pack_row(png_bytep dst, const pixcel_t *src, uint32_t width, int color_type,
+    const png_byte *lut) {
+  uint32_t x;
+  switch (color_type) {
+    case COLOR_TYPE_INDEX:  // インデックスカラー
+      if (lut != NULL) {
+        for (x = 0; x < width; x++) {
+          dst[x] = lut[src[x].i];
+        }
+      } else {
+        for (x = 0; x < width; x++) {
+          dst[x] = src[x].i;
+        }
+      }
+      break;
+    case COLOR_TYPE_GRAY:  // グレースケール
+      for (x = 0; x < width; x++) {
+        dst[x] = src[x].g;
+      }
+      break;
+    case COLOR_TYPE_RGB:  // RGB
+      for (x = 0; x < width; x++) {
+        *dst++ = src[x].c.r;
+        *dst++ = src[x].c.g;
+        *dst++ = src[x].c.b;
+      }
+      break;
+    case COLOR_TYPE_RGBA:  // RGBA
+      memcpy(dst, src, sizeof(pixcel_t) * width);
+      break;
+  }
+}
+
+/**
+ * @brief 画像データの行からインターレースのパスの画素を集めてPNGの画素のレイアウトで詰める。
+ *
+ * @param[out] dst        書き込み先
+ * @param[in]  src        画像データの行
+ * @param[in]  width      画像の幅
+ * @param[in]  color_type 色表現の種別
+ * @param[in]  lut        インデックスの変換表、変換しない場合NULL
+ * @param[in]  pass       インターレースのパス(0-6)
+ */
+static void pack_pass_row(png_bytep dst, const pixcel_t *src, uint32_t width, int color_type,
+    const png_byte *lut, int pass) {
+  const uint32_t step = PNG_PASS_COL_OFFSET(pass);
+  uint32_t x = PNG_PASS_START_COL(pass);
+  switch (color_type) {
+    case COLOR_TYPE_INDEX:  // インデックスカラー
+      for (; x < width; x += step) {
+        *dst++ = lut != NULL ? lut[src[x].i] : src[x].i;
+      }
+      break;
+    case COLOR_TYPE_GRAY:  // グレースケール
+      for (; x < width; x += step) {
+        *dst++ = src[x].g;
+      }
+      break;
+    case COLOR_TYPE_RGB:  // RGB
+      for (; x < width; x += step) {
+        *dst++ = src[x].c.r;
+        *dst++ = src[x].c.g;
+        *dst++ = src[x].c.b;
+      }
+      break;
+    case COLOR_TYPE_RGBA:  // RGBA
+      for (; x < width; x += step) {
+        memcpy(dst, &src[x], sizeof(pixcel_t));
+        dst += sizeof(pixcel_t);
+      }
+      break;
+  }
+}
+
+/**
+ * @brief 色表現の種別に対応するPNGのカラータイプを返す。
+ *
+ * @param[in] color_type 色表現の種別
+ * @return PNGのカラータイプ、対応していない場合-1
+ */
+static int get_png_color_type(int color_type) {
+  switch (color_type) {
+    case COLOR_TYPE_INDEX:  // インデックスカラー
+      return PNG_COLOR_TYPE_PALETTE;
+    case COLOR_TYPE_GRAY:  // グレースケール
+      return PNG_COLOR_TYPE_GRAY;
+    case COLOR_TYPE_RGB:  // RGB
+      return PNG_COLOR_TYPE_RGB;
+    case COLOR_TYPE_RGBA:  // RGBA
+      return PNG_COLOR_TYPE_RGBA;
+  }
+  return -1;
+}
+
+/**
+ * @brief 色表現の種別に対応するPNGの1画素あたりのbyte数を返す。
+ *
+ * @param[in] color_type 色表現の種別
+ * @return 1画素あたりのbyte数
+ */
+static size_t get_pixel_bytes(int color_type) {
+  switch (color_type) {
+    case COLOR_TYPE_RGB:  // RGB
+      return 3;
+    case COLOR_TYPE_RGBA:  // RGBA
+      return 4;
+  }
+  return 1;
+}
+
+/**
+ * @brief 圧縮戦略に対応するzlibの値を返す。
+ *
+ * @param[in] strategy 圧縮戦略(PNG_WRITE_STRATEGY_*)
+ * @return zlibの圧縮戦略
+ */
+static int get_zlib_strategy(int strategy) {
+  switch (strategy) {
+    case PNG_WRITE_STRATEGY_FILTERED:
+      return Z_FILTERED;
+    case PNG_WRITE_STRATEGY_RLE:
+      return Z_RLE;
+    case PNG_WRITE_STRATEGY_HUFFMAN_ONLY:
+      return Z_HUFFMAN_ONLY;
+  }
+  return Z_DEFAULT_STRATEGY;
+}
+
+/**
+ * @brief 書き出しオプションをlibpngに設定する。
+ *
+ * @param[in] png png_struct
+ * @param[in] opt 書き出しオプション
+ */
+static void set_write_option(png_structp png, const png_write_option_t *opt) {
+  int filters = 0;
+  if (opt->level >= 0) {
+    png_set_compression_level(png, opt->level);
+  }
+  if (opt->strategy >= 0) {
+    png_set_compression_strategy(png, get_zlib_strategy(opt->strategy));
+  }
+  if (opt->filters & PNG_WRITE_FILTER_NONE) {
+    filters |= PNG_FILTER_NONE;
+  }
+  if (opt->filters & PNG_WRITE_FILTER_SUB) {
+    filters |= PNG_FILTER_SUB;
+  }
+  if (opt->filters & PNG_WRITE_FILTER_UP) {
+    filters |= PNG_FILTER_UP;
+  }
+  if (opt->filters & PNG_WRITE_FILTER_AVG) {
+    filters |= PNG_FILTER_AVG;
+  }
+  if (opt->filters & PNG_WRITE_FILTER_PAETH) {
+    filters |= PNG_FILTER_PAETH;
+  }
+  if (filters != 0) {
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, filters);
+  }
+  if (opt->buffer_size > 0) {
+    png_set_compression_buffer_size(png, opt->buffer_size);
+  }
+}
+
+/**
+ * @brief IHDRとカラーパレットを設定する。
+ *
+ * @param[in] png        png_struct
+ * @param[in] info       png_info
+ * @param[in] img        画像データ
+ * @param[in] color_type PNGのカラータイプ
+ * @param[in] interlace  インターレースの方式(PNG_INTERLACE_*)
+ * @param[in] pal        書き出すカラーパレット
+ */
+static void set_header(png_structp png, png_infop info, image_t *img, int color_type,
+    int interlace, const png_palette_t *pal) {
+  png_set_IHDR(png, info, img->width, img->height, 8,
+      color_type, interlace, PNG_COMPRESSION_TYPE_DEFAULT,
+      PNG_FILTER_TYPE_DEFAULT);
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    write_palette(png, info, pal);
+  }
+}
+
+/**
+ * @brief メモリ上に書き出すためのバッファ
+ */
+typedef struct png_memory_t {
+  png_bytep data;  /**< 書き出したデータ */
+  size_t size;     /**< 書き出したデータのサイズ */
+  size_t capacity; /**< バッファの容量 */
+} png_memory_t;
+
+/**
+ * @brief メモリ上のバッファに書き出すlibpngの出力関数
+ *
+ * @param[in] png  png_struct
+ * @param[in] data 書き出すデータ
+ * @param[in] size 書き出すデータのサイズ
+ */
+static void write_memory(png_structp png, png_bytep data, size_t size) {
+  png_memory_t *mem = png_get_io_ptr(png);
+  if (mem->size + size > mem->capacity) {
+    size_t capacity = mem->capacity * 2 + size;
+    png_bytep p = realloc(mem->data, capacity);
+    if (p == NULL) {
+      png_error(png, "out of memory");
+    }
+    mem->data = p;
+    mem->capacity = capacity;
+  }
+  memcpy(mem->data + mem->size, data, size);
+  mem->size += size;
+}
+
+/**
+ * @brief メモリ上に書き出す場合の何もしないlibpngのフラッシュ関数
+ *
+ * @param[in] png png_struct
+ */
+static void flush_memory(png_structp png) {
+}
+
+/**
+ * @brief 書き出し先を設定する。
+ *
+ * @param[in] png png_struct
+ * @param[in] fp  書き出すファイルストリームのポインタ、メモリに書き出す場合NULL
+ * @param[in] mem 書き出すメモリ上のバッファ、ファイルに書き出す場合NULL
+ */
+static void set_output(png_structp png, FILE *fp, png_memory_t *mem) {
+  if (fp != NULL) {
+    png_init_io(png, fp);
+  } else {
+    png_set_write_fn(png, mem, write_memory, flush_memory);
+  }
+}
+
+static result_t write_png(png_context_t *ctx, FILE *fp, png_memory_t *mem, image_t *img,
+    const png_write_option_t *opt);
+static result_t write_png_parallel(FILE *fp, png_memory_t *mem, image_t *img,
+    const png_write_option_t *opt, const png_palette_t *pal);
+static result_t write_png_fast(png_context_t *ctx, FILE *fp, png_memory_t *mem, image_t *img,
+    const png_write_option_t *opt, const png_palette_t *pal);
+
+/**
+ * @brief PNG形式としてファイルに書き出す。
+ *
+ * @param[in] fp  書き出すファイルストリームのポインタ
+ * @param[in] img 画像データ
+ * @return 成否
+ */
+result_t write_png_stream(FILE *fp, image_t *img) {
+  return write_png_stream_with_option(fp, img, NULL);
+}
+
+/**
+ * @brief オプションを指定してPNG形式としてファイルに書き出す。
+ *
+ * 1行ずつエンコードする。
+ * RGBとRGBAは画像データの行をそのまま渡し、
+ * インデックスカラーとグレースケールは1行分の作業用バッファに詰めてから渡す。
+ * インターレースの場合は、パスごとに画像データの行から該当する画素を
+ * 1行分の作業用バッファに集めて渡すため、画像全体をバッファすることはない。
+ * スレッド数に2以上が指定された場合はwrite_png_parallel()で、
+ * 内蔵のエンコーダが指定された場合はwrite_png_fast()で書き出す。
+ * ただしインターレースの場合はスレッド数の指定は無視する。
+ *
+ * @param[in] fp  書き出すファイルストリームのポインタ
+ * @param[in] img 画像データ
+ * @param[in] opt 書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_png_stream_with_option(FILE *fp, image_t *img,
+    const png_write_option_t *opt) {
+  return write_png(NULL, fp, NULL, img, opt);
+}
+
+/**
+ * @brief コンテキストを使ってPNG形式としてファイルに書き出す。
+ *
+ * png_struct、zlibの状態、行バッファなどのメモリをコンテキストから確保し、次の画像で再利用する。
+ * スレッド数に2以上が指定された場合の並列の書き出しではコンテキストを使用しない。
+ *
+ * @param[in,out] ctx コンテキスト
+ * @param[in]     fp  書き出すファイルストリームのポインタ
+ * @param[in]     img 画像データ
+ * @param[in]     opt 書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_png_stream_with_context(png_context_t *ctx, FILE *fp, image_t *img,
+    const png_write_option_t *opt) {
+  return write_png(ctx, fp, NULL, img, opt);
+}
+
+/**
+ * @brief PNG形式としてメモリ上に書き出す。
+ *
+ * @param[out] data 書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size 書き出したデータのサイズ
+ * @param[in]  img  画像データ
+ * @return 成否
+ */
+result_t write_png_memory(uint8_t **data, size_t *size, image_t *img) {
+  return write_png_memory_with_option(data, size, img, NULL);
+}
+
+/**
+ * @brief オプションを指定してPNG形式としてメモリ上に書き出す。
+ *
+ * 書き出し処理はwrite_png_stream_with_option()と同じ。
+ *
+ * @param[out] data 書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size 書き出したデータのサイズ
+ * @param[in]  img  画像データ
+ * @param[in]  opt  書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+result_t write_png_memory_with_option(uint8_t **data, size_t *size, image_t *img,
+    const png_write_option_t *opt) {
+  png_memory_t mem;
+  memset(&mem, 0, sizeof(mem));
+  if (write_png(NULL, NULL, &mem, img, opt) != SUCCESS) {
+    free(mem.data);
+    return FAILURE;
+  }
+  *data = mem.data;
+  *size = mem.size;
+  return SUCCESS;
+}
+
+/**
+ * @brief PNG形式として書き出す。
+ *
+ * ファイルとメモリ上のバッファのどちらに書き出すかを指定できる。
+ *
+ * @param[in,out] ctx コンテキスト、NULLの場合は使用しない
+ * @param[in]     fp  書き出すファイルストリームのポインタ、メモリに書き出す場合NULL
+ * @param[in]     mem 書き出すメモリ上のバッファ、ファイルに書き出す場合NULL
+ * @param[in]     img 画像データ
+ * @param[in]     opt 書き出しオプション、NULLの場合標準の設定
+ * @return 成否
+ */
+static result_t write_png(png_context_t *ctx, FILE *fp, png_memory_t *mem, image_t *img,
+    const png_write_option_t *opt) {
+  uint32_t y;
+  int pass;
+  result_t result = FAILURE;
+  int color_type;
+  const int interlace = opt != NULL && opt->interlace;
+  png_structp png = NULL;
+  png_infop info = NULL;
+  png_bytep row = NULL;
+  png_palette_t pal;
+  if (img == NULL) {
+    return result;
+  }
+  if ((color_type = get_png_color_type(img->color_type)) < 0) {
+    return FAILURE;
+  }
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    make_palette(img, opt != NULL ? opt->palette_order : PNG_WRITE_PALETTE_KEEP, &pal);
+  }
+  if (opt != NULL && opt->encoder == PNG_WRITE_ENCODER_FAST) {
+    return write_png_fast(ctx, fp, mem, img, opt, &pal);
+  }
+  if (opt != NULL && opt->threads > 1 && !interlace) {
+    return write_png_parallel(fp, mem, img, opt, &pal);
+  }
+  if (interlace || color_type == PNG_COLOR_TYPE_PALETTE || color_type == PNG_COLOR_TYPE_GRAY) {
+    if ((row = context_alloc(ctx, get_pixel_bytes(img->color_type) * img->width)) == NULL) {
+      return FAILURE;
+    }
+  }
+  png = create_write_struct(ctx);
+  if (png == NULL) {
+    goto error;
+  }
+  info = png_create_info_struct(png);
+  if (info == NULL) {
+    goto error;
+  }
+  if (setjmp(png_jmpbuf(png))) {
+    goto error;
+  }
+  set_output(png, fp, mem);
+  if (opt != NULL) {
+    set_write_option(png, opt);
+  }
+  set_header(png, info, img, color_type,
+      interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, &pal);
+  png_write_info(png, info);
+  if (interlace) {
+    // png_set_interlace_handling()を呼ばないため、libpngはパスごとの行が渡されるものとして扱う
+    for (pass = 0; pass < 7; pass++) {
+      if (PNG_PASS_COLS(img->width, pass) == 0) {
+        continue;  // 空のパスはlibpngも読み飛ばす
+      }
+      for (y = PNG_PASS_START_ROW(pass); y < img->height; y += PNG_PASS_ROW_OFFSET(pass)) {
+        pack_pass_row(row, img->map[y], img->width, img->color_type, pal.lut, pass);
+        png_write_row(png, row);
+      }
+    }
+  } else {
+    if (color_type == PNG_COLOR_TYPE_RGB) {
+      // 画素情報の4byte目を読み飛ばすことで行をそのまま渡せる
+      png_set_filler(png, 0, PNG_FILLER_AFTER);
+    }
+    for (y = 0; y < img->height; y++) {
+      if (row != NULL) {
+        pack_row(row, img->map[y], img->width, img->color_type, pal.lut);
+        png_write_row(png, row);
+      } else {
+        png_write_row(png, (png_bytep) img->map[y]);
+      }
+    }
+  }
+  png_write_end(png, info);
+  result = SUCCESS;
+  error:
+  png_destroy_write_struct(&png, &info);
+  context_free(ctx, row);
+  return result;
+}
+
+#define DICTIONARY_SIZE 32768 /**< deflateのスライド窓のサイズ */
+#define BAND_MIN_ROWS   64    /**< 並列書き出しで1スレッドに割り当てる最小の行数 */
+#define BAND_CHUNK_ROWS 16    /**< 並列書き出しでまとめてdeflateに渡す行数 */
+
+/**
+ * @brief 並列書き出しで1スレッドが担当する行の範囲と、その圧縮結果
+ */
+typedef struct png_band_t {
+  image_t *img;      /**< 画像データ */
+  uint32_t start;    /**< 担当する最初の行 */
+  uint32_t end;      /**< 担当する最後の行の次の行 */
+  int last;          /**< 画像の最後のバンドか否か */
+  int level;         /**< zlibの圧縮レベル */
+  int strategy;      /**< zlibの圧縮戦略 */
+  int filters;       /**< 使用を許可するフィルタ(PNG_WRITE_FILTER_*の論理和) */
+  const png_byte *lut; /**< インデックスの変換表 */
+  png_bytep out;     /**< 圧縮結果 */
+  size_t out_size;   /**< 圧縮結果のサイズ */
+  size_t capacity;   /**< 圧縮結果のバッファの容量 */
+  uLong adler;       /**< フィルタ後のデータのAdler-32 */
+  size_t in_size;    /**< フィルタ後のデータのサイズ */
+  result_t result;   /**< 処理結果 */
+  int running;       /**< スレッドが動作中か否か */
+  pthread_t thread;  /**< 処理を行うスレッド */
+} png_band_t;
+
+/**
+ * @brief IDATチャンクを一定のサイズにまとめて書き出すためのバッファ
+ */
+typedef struct idat_writer_t {
+  png_structp png;   /**< png_struct */
+  png_bytep buffer;  /**< チャンクにまとめるためのバッファ */
+  size_t size;       /**< バッファ内のデータサイズ */
+  size_t capacity;   /**< バッファの容量 */
+} idat_writer_t;
+
+/**
+ * @brief Paethフィルタの予測値を返す。
+ *
+ * @param[in] a 左の値
+ * @param[in] b 上の値
+ * @param[in] c 左上の値
+ * @return 予測値
+ */
+static int paeth_predictor(int a, int b, int c) {
+  const int p = a + b - c;
+  const int pa = abs(p - a);
+  const int pb = abs(p - b);
+  const int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  if (pb <= pc) {
+    return b;
+  }
+  return c;
+}
+
+/**
+ * @brief 指定したフィルタを1行に適用する。
+ *
+ * 先頭にフィルタタイプの1byteを付けて書き込む。
+ *
+ * @param[out] dst  書き込み先、size + 1byte必要
+ * @param[in]  type フィルタタイプ(0:None 1:Sub 2:Up 3:Average 4:Paeth)
+ * @param[in]  cur  フィルタを適用する行
+ * @param[in]  prev 一つ前の行、先頭行の場合は0で埋めたもの
+ * @param[in]  size 1行のbyte数
+ * @param[in]  bpp  1画素のbyte数
+ */
+static void filter_row(png_bytep dst, int type, const png_byte *cur,
+    const png_byte *prev, size_t size, size_t bpp) {
+  size_t i;
+  *dst++ = type;
+  switch (type) {
+    case 0:  // None
+      memcpy(dst, cur, size);
+      break;
+    case 1:  // Sub
+      for (i = 0; i < bpp && i < size; i++) {
+        dst[i] = cur[i];
+      }
+      for (; i < size; i++) {
+        dst[i] = cur[i] - cur[i - bpp];
+      }
+      break;
+    case 2:  // Up
+      for (i = 0; i < size; i++) {
+        dst[i] = cur[i] - prev[i];
+      }
+      break;
+    case 3:  // Average
+      for (i = 0; i < bpp && i < size; i++) {
+        dst[i] = cur[i] - (prev[i] >> 1);
+      }
+      for (; i < size; i++) {
+        dst[i] = cur[i] - ((cur[i - bpp] + prev[i]) >> 1);
+      }
+      break;
+    case 4:  // Paeth
+      for (i = 0; i < bpp && i < size; i++) {
+        dst[i] = cur[i] - prev[i];
+      }
+      for (; i < size; i++) {
+        dst[i] = cur[i] - paeth_predictor(cur[i - bpp], prev[i], prev[i - bpp]);
+      }
+      break;
+  }
+}
+
+/**
+ * @brief 許可されたフィルタのうち最も圧縮に向いたものを1行に適用する。
+ *
+ * libpngと同じく、フィルタ後の値を符号付きとみなした絶対値の和が
+ * 最小となるものを選択する。
+ *
+ * @param[out] dst     書き込み先、size + 1byte必要
+ * @param[out] scratch 作業用バッファ、size + 1byte必要
+ * @param[in]  cur     フィルタを適用する行
+ * @param[in]  prev    一つ前の行、先頭行の場合は0で埋めたもの
+ * @param[in]  size    1行のbyte数
+ * @param[in]  bpp     1画素のbyte数
+ * @param[in]  filters 使用を許可するフィルタ(PNG_WRITE_FILTER_*の論理和)
+ */
+static void filter_row_adaptive(png_bytep dst, png_bytep scratch, const png_byte *cur,
+    const png_byte *prev, size_t size, size_t bpp, int filters) {
+  int type;
+  size_t i;
+  uint64_t sum;
+  uint64_t best = UINT64_MAX;
+  for (type = 0; type <= 4; type++) {
+    if ((filters & (1 << type)) == 0) {
+      continue;
+    }
+    if ((filters & ~(1 << type)) == 0) {
+      // 1種類しか許可されていなければ比較の必要はない
+      filter_row(dst, type, cur, prev, size, bpp);
+      return;
+    }
+    filter_row(scratch, type, cur, prev, size, bpp);
+    sum = 0;
+    for (i = 1; i <= size; i++) {
+      sum += abs((int8_t) scratch[i]);
+    }
+    if (sum < best) {
+      best = sum;
+      memcpy(dst, scratch, size + 1);
+    }
+  }
+}
+
+/**
+ * @brief バンドの圧縮結果のバッファに追記する形でdeflateを行う。
+ *
+ * @param[in,out] band バンド
+ * @param[in,out] z    z_stream
+ * @param[in]     in   圧縮するデータ
+ * @param[in]     size 圧縮するデータのサイズ
+ * @param[in]     flush deflateに渡すflushの指定
+ * @return 成否
+ */
+static result_t deflate_band(png_band_t *band, z_stream *z, png_bytep in, size_t size, int flush) {
+  int ret;
+  z->next_in = in;
+  z->avail_in = size;
+  for (;;) {
+    if (band->out_size == band->capacity) {
+      size_t capacity = band->capacity * 2 + deflateBound(z, size) + 16;
+      png_bytep out = realloc(band->out, capacity);
+      if (out == NULL) {
+        return FAILURE;
+      }
+      band->out = out;
+      band->capacity = capacity;
+    }
+    z->next_out = band->out + band->out_size;
+    z->avail_out = band->capacity - band->out_size;
+    ret = deflate(z, flush);
+    band->out_size = band->capacity - z->avail_out;
+    if (ret == Z_STREAM_ERROR) {
+      return FAILURE;
+    }
+    if (flush == Z_FINISH ? ret == Z_STREAM_END : z->avail_out != 0) {
+      return SUCCESS;
+    }
+  }
+}
+
+/**
+ * @brief バンドのフィルタ処理と圧縮を行う。
+ *
+ * スレッドのエントリポイントとなる。
+ * 先行するバンドの末尾32KBを同じ手順でフィルタ処理して辞書として設定し、
+ * バンドの切れ目でも圧縮率が落ちないようにする。
+ * 最後のバンド以外はZ_SYNC_FLUSHでbyte境界に揃えて終わらせるため、
+ * 各バンドの圧縮結果を連結すると一つのdeflateストリームになる。
+ *
+ * @param[in,out] arg バンド(png_band_t)
+ * @return NULL
+ */
+static void *encode_band(void *arg) {
+  png_band_t *band = arg;
+  image_t *img = band->img;
+  const size_t bpp = get_pixel_bytes(img->color_type);
+  const size_t size = bpp * img->width;
+  const size_t line = size + 1;
+  const uint32_t dict_rows = (DICTIONARY_SIZE + line - 1) / line;
+  const uint32_t chunk_rows = dict_rows > BAND_CHUNK_ROWS ? dict_rows : BAND_CHUNK_ROWS;
+  uint32_t y, start, n;
+  int flush;
+  int initialized = FALSE;
+  png_bytep prev = NULL, cur = NULL, scratch = NULL, lines = NULL, tmp;
+  z_stream z;
+  band->result = FAILURE;
+  band->adler = adler32(0L, Z_NULL, 0);
+  band->in_size = 0;
+  if ((prev = calloc(size, 1)) == NULL
+      || (cur = malloc(size)) == NULL
+      || (scratch = malloc(line)) == NULL
+      || (lines = malloc(line * chunk_rows)) == NULL) {
+    goto error;
+  }
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, band->level, Z_DEFLATED, -MAX_WBITS, 8, band->strategy) != Z_OK) {
+    goto error;
+  }
+  initialized = TRUE;
+  // 先行するバンドの末尾を辞書とする
+  start = band->start > dict_rows ? band->start - dict_rows : 0;
+  if (start > 0) {
+    pack_row(prev, img->map[start - 1], img->width, img->color_type, band->lut);
+  }
+  for (n = 0, y = start; y < band->start; y++, n++) {
+    pack_row(cur, img->map[y], img->width, img->color_type, band->lut);
+    filter_row_adaptive(lines + line * n, scratch, cur, prev, size, bpp, band->filters);
+    tmp = prev, prev = cur, cur = tmp;
+  }
+  if (n > 0) {
+    const size_t dict_size = line * n < DICTIONARY_SIZE ? line * n : DICTIONARY_SIZE;
+    if (deflateSetDictionary(&z, lines + line * n - dict_size, dict_size) != Z_OK) {
+      goto error;
+    }
+  }
+  for (n = 0, y = band->start; y < band->end; y++) {
+    pack_row(cur, img->map[y], img->width, img->color_type, band->lut);
+    filter_row_adaptive(lines + line * n, scratch, cur, prev, size, bpp, band->filters);
+    tmp = prev, prev = cur, cur = tmp;
+    n++;
+    if (n < chunk_rows && y + 1 < band->end) {
+      continue;
+    }
+    if (y + 1 < band->end) {
+      flush = Z_NO_FLUSH;
+    } else {
+      flush = band->last ? Z_FINISH : Z_SYNC_FLUSH;
+    }
+    band->adler = adler32(band->adler, lines, line * n);
+    band->in_size += line * n;
+    if (deflate_band(band, &z, lines, line * n, flush) != SUCCESS) {
+      goto error;
+    }
+    n = 0;
+  }
+  band->result = SUCCESS;
+  error:
+  if (initialized) {
+    deflateEnd(&z);
+  }
+  free(prev);
+  free(cur);
+  free(scratch);
+  free(lines);
+  return NULL;
+}
+
+/**
+ * @brief IDATチャンクのデータを追加する。
+ *
+ * バッファが一杯になった時点でIDATチャンクとして書き出す。
+ *
+ * @param[in,out] w    IDATチャンクの書き出しバッファ
+ * @param[in]     data 追加するデータ
+ * @param[in]     size 追加するデータのサイズ
+ */
+static void write_idat(idat_writer_t *w, const png_byte *data, size_t size) {
+  while (size > 0) {
+    size_t n = w->capacity - w->size;
+    if (n > size) {
+      n = size;
+    }
+    memcpy(w->buffer + w->size, data, n);
+    w->size += n;
+    data += n;
+    size -= n;
+    if (w->size == w->capacity) {
+      png_write_chunk(w->png, (png_const_bytep) "IDAT", w->buffer, w->size);
+      w->size = 0;
+    }
+  }
+}
+
+/**
+ * @brief バッファに残ったデータをIDATチャンクとして書き出す。
+ *
+ * @param[in,out] w IDATチャンクの書き出しバッファ
+ */
+static void flush_idat(idat_writer_t *w) {
+  if (w->size > 0) {
+    png_write_chunk(w->png, (png_const_bytep) "IDAT", w->buffer, w->size);
+    w->size = 0;
+  }
+}
+
+/**
+ * @brief zlibストリームのヘッダを書き出す。
+ *
+ * @param[in,out] w     IDATチャンクの書き出しバッファ
+ * @param[in]     level zlibの圧縮レベル
+ */
+static void write_zlib_header(idat_writer_t *w, int level) {
+  png_byte header[2];
+  int flevel;
+  if (level == Z_DEFAULT_COMPRESSION || level == 6) {
+    flevel = 2;
+  } else if (level < 2) {
+    flevel = 0;
+  } else if (level < 6) {
+    flevel = 1;
+  } else {
+    flevel = 3;
+  }
+  header[0] = 0x78;  // deflate、32KBのスライド窓
+  header[1] = flevel << 6;
+  header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+  write_idat(w, header, sizeof(header));
+}
+
+/**
+ * @brief 複数のスレッドで圧縮してPNG形式として書き出す。
+ *
+ * 画像を行単位のバンドに分割し、バンドごとにフィルタ処理とdeflateを並列に行う。
+ * pigzと同様に、各バンドは先行するバンドの末尾を辞書とした独立したdeflateブロックとし、
+ * Z_SYNC_FLUSHの境界で連結する。Adler-32はバンドごとの値を結合して求める。
+ * ヘッダなどのチャンクはlibpngで書き出す。
+ *
+ * @param[in] fp  書き出すファイルストリームのポインタ、メモリに書き出す場合NULL
+ * @param[in] mem 書き出すメモリ上のバッファ、ファイルに書き出す場合NULL
+ * @param[in] img 画像データ
+ * @param[in] opt 書き出しオプション
+ * @param[in] pal 書き出すカラーパレット
+ * @return 成否
+ */
+static result_t write_png_parallel(FILE *fp, png_memory_t *mem, image_t *img,
+    const png_write_option_t *opt, const png_palette_t *pal) {
+  result_t result = FAILURE;
+  int i, num;
+  int color_type = get_png_color_type(img->color_type);
+  int filters;
+  int strategy;
+  uLong adler = 0;
+  png_byte trailer[4];
+  png_structp png = NULL;
+  png_infop info = NULL;
+  png_band_t *bands = NULL;
+  idat_writer_t w;
+  num = (img->height + BAND_MIN_ROWS - 1) / BAND_MIN_ROWS;
+  if (num > opt->threads) {
+    num = opt->threads;
+  }
+  if (num < 1) {
+    num = 1;
+  }
+  filters = opt->filters & PNG_WRITE_FILTER_ALL;
+  if (filters == 0) {
+    // libpngと同様、インデックスカラーではフィルタを使用しない
+    filters = color_type == PNG_COLOR_TYPE_PALETTE ? PNG_WRITE_FILTER_NONE : PNG_WRITE_FILTER_ALL;
+  }
+  if (opt->strategy >= 0) {
+    strategy = get_zlib_strategy(opt->strategy);
+  } else {
+    strategy = filters == PNG_WRITE_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+  }
+  memset(&w, 0, sizeof(w));
+  w.capacity = opt->buffer_size > 0 ? opt->buffer_size : PNG_ZBUF_SIZE;
+  if ((w.buffer = malloc(w.capacity)) == NULL) {
+    return FAILURE;
+  }
+  if ((bands = calloc(num, sizeof(png_band_t))) == NULL) {
+    goto error;
+  }
+  for (i = 0; i < num; i++) {
+    bands[i].img = img;
+    bands[i].start = (uint64_t) img->height * i / num;
+    bands[i].end = (uint64_t) img->height * (i + 1) / num;
+    bands[i].last = (i == num - 1);
+    bands[i].level = opt->level >= 0 ? opt->level : Z_DEFAULT_COMPRESSION;
+    bands[i].strategy = strategy;
+    bands[i].filters = filters;
+    bands[i].lut = pal->lut;
+  }
+  png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (png == NULL) {
+    goto error;
+  }
+  info = png_create_info_struct(png);
+  if (info == NULL) {
+    goto error;
+  }
+  if (setjmp(png_jmpbuf(png))) {
+    goto error;
+  }
+  set_output(png, fp, mem);
+  set_header(png, info, img, color_type, PNG_INTERLACE_NONE, pal);
+  png_write_info(png, info);
+  // 先頭以外のバンドを別スレッドで処理し、先頭のバンドはこのスレッドで処理する
+  for (i = 1; i < num; i++) {
+    bands[i].running = (pthread_create(&bands[i].thread, NULL, encode_band, &bands[i]) == 0);
+  }
+  encode_band(&bands[0]);
+  w.png = png;
+  write_zlib_header(&w, bands[0].level);
+  for (i = 0; i < num; i++) {
+    if (bands[i].running) {
+      pthread_join(bands[i].thread, NULL);
+      bands[i].running = FALSE;
+    } else if (i > 0) {
+      // スレッドを作成できなかった場合はこのスレッドで処理する
+      encode_band(&bands[i]);
+    }
+    if (bands[i].result != SUCCESS) {
+      goto error;
+    }
+    write_idat(&w, bands[i].out, bands[i].out_size);
+    if (i == 0) {
+      adler = bands[i].adler;
+    } else {
+      adler = adler32_combine(adler, bands[i].adler, bands[i].in_size);
+    }
+    free(bands[i].out);
+    bands[i].out = NULL;
+  }
+  png_save_uint_32(trailer, adler);
+  write_idat(&w, trailer, sizeof(trailer));
+  flush_idat(&w);
+  png_write_chunk(png, (png_const_bytep) "IEND", NULL, 0);
+  result = SUCCESS;
+  error:
+  if (bands != NULL) {
+    for (i = 0; i < num; i++) {
+      if (bands[i].running) {
+        pthread_join(bands[i].thread, NULL);
+      }
+      free(bands[i].out);
+    }
+    free(bands);
+  }
+  png_destroy_write_struct(&png, &info);
+  free(w.buffer);
+  return result;
+}
+
+#define FAST_BUFFER_SIZE 65536 /**< 内蔵のエンコーダで符号をまとめて書き出す単位 */
+
+/**
+ * @brief 内蔵のエンコーダのdeflateの状態
+ *
+ * 固定ハフマン符号の1ブロックのみで、一致は距離1の繰り返しだけを探す。
+ * 符号はビット反転済みのものを事前に表にしておき、64bitのバッファに詰めて書き出す。
+ */
+typedef struct fast_deflate_t {
+  idat_writer_t *w;            /**< IDATチャンクの書き出しバッファ */
+  uint64_t bits;               /**< 書き出し待ちのビット列 */
+  int count;                   /**< 書き出し待ちのビット数 */
+  int last;                    /**< 直前に書き出したリテラル、まだ無い場合-1 */
+  size_t run;                  /**< 直前のリテラルの繰り返しで未出力のbyte数 */
+  size_t size;                 /**< bufferに溜めたデータのサイズ */
+  uint16_t literal_code[256];  /**< リテラルの符号 */
+  uint8_t literal_bits[256];   /**< リテラルの符号長 */
+  uint32_t run_code[259];      /**< 長さごとの距離1の一致の符号(長さの拡張ビットと距離の符号を含む) */
+  uint8_t run_bits[259];       /**< 長さごとの距離1の一致の符号長 */
+  png_byte buffer[FAST_BUFFER_SIZE]; /**< 符号をまとめて書き出すためのバッファ */
+} fast_deflate_t;
+
+/**
+ * @brief ビット列の並びを反転する。
+ *
+ * deflateのハフマン符号は上位ビットから詰めるため、
+ * 下位ビットから詰めていくバッファ用に反転しておく。
+ *
+ * @param[in] code ビット列
+ * @param[in] bits ビット数
+ * @return 反転したビット列
+ */
+static uint32_t reverse_bits(uint32_t code, int bits) {
+  uint32_t r = 0;
+  while (bits-- > 0) {
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  return r;
+}
+
+/**
+ * @brief 固定ハフマン符号の表を作成してdeflateの状態を初期化する。
+ *
+ * @param[out] d deflateの状態
+ * @param[in]  w IDATチャンクの書き出しバッファ
+ */
+static void init_fast_deflate(fast_deflate_t *d, idat_writer_t *w) {
+  static const uint16_t base[] = {
+      3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+  };
+  static const uint8_t extra[] = {
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+      3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+  };
+  int i, s, sym, bits;
+  uint32_t code;
+  d->w = w;
+  d->bits = 0;
+  d->count = 0;
+  d->last = -1;
+  d->run = 0;
+  d->size = 0;
+  for (i = 0; i < 256; i++) {
+    if (i < 144) {
+      code = 0x30 + i;
+      bits = 8;
+    } else {
+      code = 0x190 + i - 144;
+      bits = 9;
+    }
+    d->literal_code[i] = reverse_bits(code, bits);
+    d->literal_bits[i] = bits;
+  }
+  for (i = 3, s = 0; i <= 258; i++) {
+    while (s < 28 && i >= base[s + 1]) {
+      s++;
+    }
+    sym = 257 + s;
+    if (sym < 280) {
+      code = sym - 256;
+      bits = 7;
+    } else {
+      code = 0xc0 + sym - 280;
+      bits = 8;
+    }
+    // 距離1は距離の符号0の5bitで、拡張ビットは無い
+    d->run_code[i] = reverse_bits(code, bits) | (i - base[s]) << bits;
+    d->run_bits[i] = bits + extra[s] + 5;
+  }
+}
+
+/**
+ * @brief 符号を書き出す。
+ *
+ * 32bit溜まるごとにバッファへ移し、バッファが一杯になればIDATチャンクに渡す。
+ *
+ * @param[in,out] d    deflateの状態
+ * @param[in]     code 符号
+ * @param[in]     bits 符号長(32以下)
+ */
+static void put_bits(fast_deflate_t *d, uint32_t code, int bits) {
+  png_bytep p;
+  d->bits |= (uint64_t) code << d->count;
+  d->count += bits;
+  if (d->count >= 32) {
+    p = d->buffer + d->size;
+    p[0] = d->bits;
+    p[1] = d->bits >> 8;
+    p[2] = d->bits >> 16;
+    p[3] = d->bits >> 24;
+    d->size += 4;
+    d->bits >>= 32;
+    d->count -= 32;
+    if (d->size == FAST_BUFFER_SIZE) {
+      write_idat(d->w, d->buffer, d->size);
+      d->size = 0;
+    }
+  }
+}
+
+/**
+ * @brief 未出力の繰り返しを距離1の一致として書き出す。
+ *
+ * @param[in,out] d deflateの状態
+ */
+static void flush_run(fast_deflate_t *d) {
+  size_t run = d->run;
+  while (run >= 258) {
+    put_bits(d, d->run_code[258], d->run_bits[258]);
+    run -= 258;
+  }
+  if (run >= 3) {
+    put_bits(d, d->run_code[run], d->run_bits[run]);
+  } else {
+    while (run-- > 0) {
+      put_bits(d, d->literal_code[d->last], d->literal_bits[d->last]);
+    }
+  }
+  d->run = 0;
+}
+
+/**
+ * @brief 先頭から同じ値が続く長さを返す。
+ *
+ * @param[in] data データ
+ * @param[in] size データのサイズ
+ * @param[in] b    比較する値
+ * @return 続く長さ
+ */
+static size_t count_run(const png_byte *data, size_t size, png_byte b) {
+  const uint64_t pattern = UINT64_C(0x0101010101010101) * b;
+  uint64_t v;
+  size_t i = 0;
+  while (i + 8 <= size) {
+    memcpy(&v, data + i, sizeof(v));
+    if (v != pattern) {
+      break;
+    }
+    i += 8;
+  }
+  while (i < size && data[i] == b) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * @brief 直前の値の繰り返しが始まるまでをリテラルとして書き出す。
+ *
+ * 写真などではほとんどのデータがリテラルとなるため、
+ * 書き出し待ちのビット列をローカル変数に置いて処理する。
+ *
+ * @param[in,out] d    deflateの状態
+ * @param[in]     data 圧縮するデータ
+ * @param[in]     size 圧縮するデータのサイズ、1以上
+ * @return 書き出したbyte数
+ */
+static size_t put_literals(fast_deflate_t *d, const png_byte *data, size_t size) {
+  uint64_t bits = d->bits;
+  int count = d->count;
+  size_t pos = d->size;
+  size_t i = 0;
+  png_byte b;
+  do {
+    b = data[i++];
+    bits |= (uint64_t) d->literal_code[b] << count;
+    count += d->literal_bits[b];
+    if (count >= 32) {
+      d->buffer[pos] = bits;
+      d->buffer[pos + 1] = bits >> 8;
+      d->buffer[pos + 2] = bits >> 16;
+      d->buffer[pos + 3] = bits >> 24;
+      pos += 4;
+      bits >>= 32;
+      count -= 32;
+      if (pos == FAST_BUFFER_SIZE) {
+        write_idat(d->w, d->buffer, pos);
+        pos = 0;
+      }
+    }
+  } while (i < size && data[i] != b);
+  d->bits = bits;
+  d->count = count;
+  d->size = pos;
+  d->last = b;
+  return i;
+}
+
 /**
- * @brief PNG形式のファイルを読み込む。
+ * @brief データを圧縮して書き出す。
  *
- * @param[in] filename ファイル名
- * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ * 直前の値の繰り返しは呼び出しをまたいで一致としてまとめる。
+ *
+ * @param[in,out] d    deflateの状態
+ * @param[in]     data 圧縮するデータ
+ * @param[in]     size 圧縮するデータのサイズ
  */
-image_t *read_png_file(const char *filename) {
-  FILE *fp = fopen(filename, "rb");
-  if (fp == NULL) {
-    perror(filename);
-    return NULL;
+static void fast_deflate(fast_deflate_t *d, const png_byte *data, size_t size) {
+  size_t i = 0;
+  size_t n;
+  while (i < size) {
+    if (data[i] == d->last) {
+      n = count_run(data + i, size - i, data[i]);
+      d->run += n;
+      i += n;
+      continue;
+    }
+    flush_run(d);
+    i += put_literals(d, data + i, size - i);
   }
-  image_t *img = read_png_stream(fp);
-  fclose(fp);
-  return img;
 }
 
 /**
- * @brief PNG形式のファイルを読み込む。
+ * @brief ブロックの終端を書き出し、残りのビット列をbyte境界まで詰めて書き出す。
  *
- * @param[in] fp ファイルストリーム
- * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ * @param[in,out] d deflateの状態
  */
-image_t *read_png_stream(FILE *fp) {
-  image_t *img = NULL;
-  int i, x, y;
-  int width, height;
-  int num;
-  png_colorp palette;
+static void finish_fast_deflate(fast_deflate_t *d) {
+  flush_run(d);
+  put_bits(d, 0, 7);  // ブロックの終端(256)
+  while (d->count > 0) {
+    d->buffer[d->size++] = d->bits;
+    d->bits >>= 8;
+    d->count -= 8;
+  }
+  d->count = 0;
+  write_idat(d->w, d->buffer, d->size);
+  d->size = 0;
+}
+
+/**
+ * @brief SubフィルタかUpフィルタを1行に適用する。
+ *
+ * どちらも参照する画素との差を取るだけのため、SSE2が使える場合は16byteずつ処理する。
+ * それ以外のフィルタはfilter_row()で処理する。
+ *
+ * @param[out] dst  書き込み先、size + 1byte必要
+ * @param[in]  type フィルタタイプ(0:None 1:Sub 2:Up 3:Average 4:Paeth)
+ * @param[in]  cur  フィルタを適用する行
+ * @param[in]  prev 一つ前の行、先頭行の場合は0で埋めたもの
+ * @param[in]  size 1行のbyte数
+ * @param[in]  bpp  1画素のbyte数
+ */
+static void filter_row_fast(png_bytep dst, int type, const png_byte *cur,
+    const png_byte *prev, size_t size, size_t bpp) {
+  const png_byte *ref;
+  size_t i = 0;
+  size_t offset;
+  if (type != 1 && type != 2) {
+    filter_row(dst, type, cur, prev, size, bpp);
+    return;
+  }
+  *dst++ = type;
+  if (type == 1) {
+    ref = cur;
+    offset = bpp;
+    for (; i < bpp && i < size; i++) {
+      dst[i] = cur[i];
+    }
+  } else {
+    ref = prev;
+    offset = 0;
+  }
+#ifdef __SSE2__
+  for (; i + 16 <= size; i += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i *) (cur + i));
+    const __m128i b = _mm_loadu_si128((const __m128i *) (ref + i - offset));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_sub_epi8(a, b));
+  }
+#endif
+  for (; i < size; i++) {
+    dst[i] = cur[i] - ref[i - offset];
+  }
+}
+
+/**
+ * @brief 内蔵のエンコーダでPNG形式として書き出す。
+ *
+ * fpngやfpngeと同様、圧縮率よりも速度を優先する。
+ * フィルタは1種類に固定し、deflateは固定ハフマン符号と距離1の一致のみで行う。
+ * RGBAは画像データの行を詰め直さずにそのままフィルタに渡す。
+ * インターレースの場合はパスごとに画素を集めた行を、パスの先頭行から改めてフィルタに渡す。
+ * CRC-32とAdler-32はzlibの実装を使用する。
+ * ヘッダなどのチャンクはlibpngで書き出す。
+ *
+ * 圧縮レベル、圧縮戦略、スレッド数の指定は無視する。
+ * フィルタは1種類だけ指定された場合はそれを使用し、
+ * それ以外の場合はインデックスカラーではNone、それ以外ではSubを使用する。
+ *
+ * @param[in,out] ctx コンテキスト、NULLの場合は使用しない
+ * @param[in]     fp  書き出すファイルストリームのポインタ、メモリに書き出す場合NULL
+ * @param[in]     mem 書き出すメモリ上のバッファ、ファイルに書き出す場合NULL
+ * @param[in]     img 画像データ
+ * @param[in]     opt 書き出しオプション
+ * @param[in]     pal 書き出すカラーパレット
+ * @return 成否
+ */
+static result_t write_png_fast(png_context_t *ctx, FILE *fp, png_memory_t *mem, image_t *img,
+    const png_write_option_t *opt, const png_palette_t *pal) {
+  result_t result = FAILURE;
+  uint32_t y, n, start, step;
+  int type, pass;
+  const int color_type = get_png_color_type(img->color_type);
+  const int filters = opt->filters & PNG_WRITE_FILTER_ALL;
+  const int passes = opt->interlace ? 7 : 1;
+  const size_t bpp = get_pixel_bytes(img->color_type);
+  const size_t stride = bpp * img->width;
+  size_t size;
+  const png_byte *cur;
+  const png_byte *prev;
+  png_bytep rows[2] = {NULL, NULL};
+  png_bytep zero = NULL;
+  png_bytep filtered = NULL;
+  uLong adler = adler32(0, NULL, 0);
+  png_byte trailer[4];
   png_structp png = NULL;
   png_infop info = NULL;
-  png_bytep row;
-  png_bytepp rows;
-  png_byte sig_bytes[8];
-  if (fread(sig_bytes, sizeof(sig_bytes), 1, fp) != 1) {
-    return NULL;
+  fast_deflate_t *d = NULL;
+  idat_writer_t w;
+  if (filters != 0 && (filters & (filters - 1)) == 0) {
+    for (type = 0; (filters & (1 << type)) == 0; type++) {
+    }
+  } else {
+    type = color_type == PNG_COLOR_TYPE_PALETTE ? 0 : 1;
   }
-  if (png_sig_cmp(sig_bytes, 0, sizeof(sig_bytes))) {
-    return NULL;
+  memset(&w, 0, sizeof(w));
+  w.capacity = opt->buffer_size > 0 ? opt->buffer_size : PNG_ZBUF_SIZE;
+  if ((w.buffer = context_alloc(ctx, w.capacity)) == NULL
+      || (d = context_alloc(ctx, sizeof(fast_deflate_t))) == NULL
+      || (zero = context_alloc(ctx, stride)) == NULL
+      || (filtered = context_alloc(ctx, stride + 1)) == NULL) {
+    goto error;
+  }
+  memset(zero, 0, stride);
+  if (color_type != PNG_COLOR_TYPE_RGBA || opt->interlace) {
+    if ((rows[0] = context_alloc(ctx, stride)) == NULL
+        || (rows[1] = context_alloc(ctx, stride)) == NULL) {
+      goto error;
+    }
   }
-  png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png = create_write_struct(ctx);
   if (png == NULL) {
     goto error;
   }
@@ -68,112 +2358,165 @@ image_t *read_png_stream(FILE *fp) {
   if (setjmp(png_jmpbuf(png))) {
     goto error;
   }
-  png_init_io(png, fp);
-  png_set_sig_bytes(png, sizeof(sig_bytes));
-  png_read_png(png, info, PNG_TRANSFORM_PACKING | PNG_TRANSFORM_STRIP_16, NULL);
-  width = png_get_image_width(png, info);
-  height = png_get_image_height(png, info);
-  rows = png_get_rows(png, info);
-  // 画像形式に応じて詰め込み
-  switch (png_get_color_type(png, info)) {
-    case PNG_COLOR_TYPE_PALETTE:  // インデックスカラー
-      if ((img = allocate_image(width, height, COLOR_TYPE_INDEX)) == NULL) {
-        goto error;
-      }
-      png_get_PLTE(png, info, &palette, &num);
-      img->palette_num = num;
-      for (i = 0; i < num; i++) {
-        png_color pc = palette[i];
-        img->palette[i] = color_from_rgb(pc.red, pc.green, pc.blue);
-      }
-      {
-        png_bytep trans = NULL;
-        int num_trans = 0;
-        if (png_get_tRNS(png, info, &trans, &num_trans, NULL) == PNG_INFO_tRNS
-            && trans != NULL && num_trans > 0) {
-          for (i = 0; i < num_trans; i++) {
-            img->palette[i].a = trans[i];
-          }
-          for (; i < num; i++) {
-            img->palette[i].a = 0xff;
-          }
-        }
-      }
-      for (y = 0; y < height; y++) {
-        row = rows[y];
-        for (x = 0; x < width; x++) {
-          img->map[y][x].i = *row++;
-        }
-      }
-      break;
-    case PNG_COLOR_TYPE_GRAY:  // グレースケール
-      if ((img = allocate_image(width, height, COLOR_TYPE_GRAY)) == NULL) {
-        goto error;
-      }
-      for (y = 0; y < height; y++) {
-        row = rows[y];
-        for (x = 0; x < width; x++) {
-          img->map[y][x].g = *row++;
-        }
-      }
-      break;
-    case PNG_COLOR_TYPE_GRAY_ALPHA:  // グレースケール+α
-      if ((img = allocate_image(width, height, COLOR_TYPE_RGBA)) == NULL) {
-        goto error;
-      }
-      for (y = 0; y < height; y++) {
-        row = rows[y];
-        for (x = 0; x < width; x++) {
-          uint8_t g = *row++;
-          img->map[y][x].c.r = g;
-          img->map[y][x].c.g = g;
-          img->map[y][x].c.b = g;
-          img->map[y][x].c.a = *row++;
-        }
-      }
-      break;
-    case PNG_COLOR_TYPE_RGB:  // RGB
-      if ((img = allocate_image(width, height, COLOR_TYPE_RGB)) == NULL) {
-        goto error;
+  set_output(png, fp, mem);
+  set_header(png, info, img, color_type,
+      opt->interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, pal);
+  png_write_info(png, info);
+  w.png = png;
+  init_fast_deflate(d, &w);
+  write_zlib_header(&w, 0);
+  put_bits(d, 3, 3);  // 最終ブロック、固定ハフマン符号
+  for (pass = 0; pass < passes; pass++) {
+    if (opt->interlace) {
+      if ((size = bpp * PNG_PASS_COLS(img->width, pass)) == 0) {
+        continue;
       }
-      for (y = 0; y < height; y++) {
-        row = rows[y];
-        for (x = 0; x < width; x++) {
-          img->map[y][x].c.r = *row++;
-          img->map[y][x].c.g = *row++;
-          img->map[y][x].c.b = *row++;
-          img->map[y][x].c.a = 0xff;
-        }
-      }
-      break;
-    case PNG_COLOR_TYPE_RGB_ALPHA:  // RGBA
-      if ((img = allocate_image(width, height, COLOR_TYPE_RGBA)) == NULL) {
-        goto error;
-      }
-      for (y = 0; y < height; y++) {
-        row = rows[y];
-        for (x = 0; x < width; x++) {
-          img->map[y][x].c.r = *row++;
-          img->map[y][x].c.g = *row++;
-          img->map[y][x].c.b = *row++;
-          img->map[y][x].c.a = *row++;
-        }
+      start = PNG_PASS_START_ROW(pass);
+      step = PNG_PASS_ROW_OFFSET(pass);
+    } else {
+      size = stride;
+      start = 0;
+      step = 1;
+    }
+    prev = zero;
+    for (y = start, n = 0; y < img->height; y += step, n++) {
+      if (opt->interlace) {
+        pack_pass_row(rows[n & 1], img->map[y], img->width, img->color_type, pal->lut, pass);
+        cur = rows[n & 1];
+      } else if (rows[0] != NULL) {
+        pack_row(rows[n & 1], img->map[y], img->width, img->color_type, pal->lut);
+        cur = rows[n & 1];
+      } else {
+        cur = (const png_byte *) img->map[y];
       }
-      break;
+      filter_row_fast(filtered, type, cur, prev, size, bpp);
+      adler = adler32(adler, filtered, size + 1);
+      fast_deflate(d, filtered, size + 1);
+      prev = cur;
+    }
   }
+  finish_fast_deflate(d);
+  png_save_uint_32(trailer, adler);
+  write_idat(&w, trailer, sizeof(trailer));
+  flush_idat(&w);
+  png_write_chunk(png, (png_const_bytep) "IEND", NULL, 0);
+  result = SUCCESS;
   error:
-  png_destroy_read_struct(&png, &info, NULL);
-  return img;
+  png_destroy_write_struct(&png, &info);
+  context_free(ctx, rows[0]);
+  context_free(ctx, rows[1]);
+  context_free(ctx, zero);
+  context_free(ctx, filtered);
+  context_free(ctx, d);
+  context_free(ctx, w.buffer);
+  return result;
 }
 
 /**
- * @brief PNG形式としてファイルに書き出す。
+ * @brief 最適化で試行する書き出しオプションの一覧を作成する。
  *
- * @param[in] filename 書き出すファイル名
- * @param[in] img      画像データ
+ * フィルタ、圧縮戦略、圧縮レベルの組み合わせに加え、
+ * インデックスカラーの場合はカラーパレットの並べ方の組み合わせを作成する。
+ *
+ * @param[in]  img    画像データ
+ * @param[out] trials 試行する書き出しオプション、呼び出し側でfreeすること
+ * @return 試行する書き出しオプションの数、失敗した場合-1
+ */
+static int make_trials(image_t *img, png_write_option_t **trials) {
+  static const int filters[] = {
+      PNG_WRITE_FILTER_NONE, PNG_WRITE_FILTER_SUB, PNG_WRITE_FILTER_UP,
+      PNG_WRITE_FILTER_AVG, PNG_WRITE_FILTER_PAETH, PNG_WRITE_FILTER_ALL,
+  };
+  static const int strategies[][2] = {
+      {PNG_WRITE_STRATEGY_DEFAULT, 6}, {PNG_WRITE_STRATEGY_DEFAULT, 9},
+      {PNG_WRITE_STRATEGY_FILTERED, 6}, {PNG_WRITE_STRATEGY_FILTERED, 9},
+      {PNG_WRITE_STRATEGY_RLE, 9}, {PNG_WRITE_STRATEGY_HUFFMAN_ONLY, 9},
+  };
+  const int orders = img->color_type == COLOR_TYPE_INDEX ? 4 : 1;
+  const int num_filters = sizeof(filters) / sizeof(filters[0]);
+  const int num_strategies = sizeof(strategies) / sizeof(strategies[0]);
+  int f, s, o, n = 0;
+  png_write_option_t *t;
+  if ((t = malloc(sizeof(png_write_option_t) * orders * num_filters * num_strategies)) == NULL) {
+    return -1;
+  }
+  for (o = 0; o < orders; o++) {
+    for (f = 0; f < num_filters; f++) {
+      for (s = 0; s < num_strategies; s++) {
+        init_png_write_option(&t[n]);
+        t[n].filters = filters[f];
+        t[n].strategy = strategies[s][0];
+        t[n].level = strategies[s][1];
+        t[n].palette_order = o;
+        n++;
+      }
+    }
+  }
+  *trials = t;
+  return n;
+}
+
+/**
+ * @brief 最適化の状態
+ */
+typedef struct png_optimizer_t {
+  image_t *img;               /**< 画像データ */
+  png_write_option_t *trials; /**< 試行する書き出しオプション */
+  int num;                    /**< 試行する書き出しオプションの数 */
+  atomic_int next;            /**< 次に試行する書き出しオプション */
+} png_optimizer_t;
+
+/**
+ * @brief 最適化を行うスレッドごとの結果
+ */
+typedef struct png_trial_worker_t {
+  png_optimizer_t *optimizer; /**< 最適化の状態 */
+  int best;                   /**< 最小となった試行、まだない場合-1 */
+  png_memory_t mem;           /**< 最小となった書き出し結果 */
+  int running;                /**< スレッドが動作中か否か */
+  pthread_t thread;           /**< 試行を行うスレッド */
+} png_trial_worker_t;
+
+/**
+ * @brief 未試行の書き出しオプションを順に取り出してメモリ上に書き出す。
+ *
+ * スレッドのエントリポイントとなる。
+ * 自スレッドで試行した中で最小のものだけを残す。
+ *
+ * @param[in,out] arg スレッドごとの結果(png_trial_worker_t)
+ * @return NULL
+ */
+static void *run_trials(void *arg) {
+  png_trial_worker_t *w = arg;
+  png_optimizer_t *o = w->optimizer;
+  png_memory_t mem, tmp;
+  int i;
+  memset(&mem, 0, sizeof(mem));
+  while ((i = atomic_fetch_add(&o->next, 1)) < o->num) {
+    mem.size = 0;
+    if (write_png(NULL, NULL, &mem, o->img, &o->trials[i]) != SUCCESS) {
+      continue;
+    }
+    if (w->best < 0 || mem.size < w->mem.size) {
+      tmp = w->mem, w->mem = mem, mem = tmp;
+      w->best = i;
+    }
+  }
+  free(mem.data);
+  return NULL;
+}
+
+/**
+ * @brief 最小となる設定を探してPNG形式としてファイルに書き出す。
+ *
+ * @param[in]  filename 書き出すファイル名
+ * @param[in]  img      画像データ
+ * @param[in]  threads  試行に使用するスレッド数
+ * @param[out] best     最小となった書き出しオプション、不要な場合NULL
  * @return 成否
  */
-result_t write_png_file(const char *filename, image_t *img) {
+result_t optimize_png_file(const char *filename, image_t *img, int threads,
+    png_write_option_t *best) {
   result_t result = FAILURE;
   if (img == NULL) {
     return result;
@@ -183,142 +2526,273 @@ result_t write_png_file(const char *filename, image_t *img) {
     perror(filename);
     return result;
   }
-  result = write_png_stream(fp, img);
+  result = optimize_png_stream(fp, img, threads, best);
   fclose(fp);
   return result;
 }
 
 /**
- * @brief PNG形式としてファイルに書き出す。
+ * @brief 最小となる設定を探してPNG形式としてファイルに書き出す。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
- * @param[in] img 画像データ
+ * フィルタ、圧縮戦略、圧縮レベル、インデックスカラーの場合はカラーパレットの並べ方の
+ * 組み合わせを、スレッドプールでメモリ上に書き出して比較し、最小のものを書き出す。
+ * サイズが同じ場合は一覧で先にあるものを採用するため、結果はスレッド数によらない。
+ *
+ * @param[in]  fp      書き出すファイルストリームのポインタ
+ * @param[in]  img     画像データ
+ * @param[in]  threads 試行に使用するスレッド数
+ * @param[out] best    最小となった書き出しオプション、不要な場合NULL
  * @return 成否
  */
-result_t write_png_stream(FILE *fp, image_t *img) {
-  int i, x, y;
+result_t optimize_png_stream(FILE *fp, image_t *img, int threads,
+    png_write_option_t *best) {
   result_t result = FAILURE;
-  int row_size;
-  int color_type;
-  png_structp png = NULL;
-  png_infop info = NULL;
-  png_bytep row;
-  png_bytepp rows = NULL;
-  png_colorp palette = NULL;
-  if (img == NULL) {
-    return result;
+  png_optimizer_t o;
+  png_trial_worker_t *workers = NULL;
+  png_trial_worker_t *winner = NULL;
+  int i;
+  if (img == NULL || get_png_color_type(img->color_type) < 0) {
+    return FAILURE;
   }
-  switch (img->color_type) {
-    case COLOR_TYPE_INDEX:  // インデックスカラー
-      color_type = PNG_COLOR_TYPE_PALETTE;
-      row_size = sizeof(png_byte) * img->width;
-      break;
-    case COLOR_TYPE_GRAY:  // グレースケール
-      color_type = PNG_COLOR_TYPE_GRAY;
-      row_size = sizeof(png_byte) * img->width;
-      break;
-    case COLOR_TYPE_RGB:  // RGB
-      color_type = PNG_COLOR_TYPE_RGB;
-      row_size = sizeof(png_byte) * img->width * 3;
-      break;
-    case COLOR_TYPE_RGBA:  // RGBA
-      color_type = PNG_COLOR_TYPE_RGBA;
-      row_size = sizeof(png_byte) * img->width * 4;
-      break;
-    default:
-      return FAILURE;
+  if (threads < 1) {
+    threads = 1;
   }
-  png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (png == NULL) {
-    goto error;
+  o.img = img;
+  if ((o.num = make_trials(img, &o.trials)) < 0) {
+    return FAILURE;
   }
-  info = png_create_info_struct(png);
-  if (info == NULL) {
-    goto error;
+  atomic_init(&o.next, 0);
+  if (threads > o.num) {
+    threads = o.num;
   }
-  if (setjmp(png_jmpbuf(png))) {
+  if ((workers = calloc(threads, sizeof(png_trial_worker_t))) == NULL) {
     goto error;
   }
-  png_init_io(png, fp);
-  png_set_IHDR(png, info, img->width, img->height, 8,
-      color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-      PNG_FILTER_TYPE_DEFAULT);
-  rows = png_malloc(png, sizeof(png_bytep) * img->height);
-  if (rows == NULL) {
-    goto error;
+  for (i = 0; i < threads; i++) {
+    workers[i].optimizer = &o;
+    workers[i].best = -1;
   }
-  png_set_rows(png, info, rows);
-  memset(rows, 0, sizeof(png_bytep) * img->height);
-  for (y = 0; y < img->height; y++) {
-    if ((rows[y] = png_malloc(png, row_size)) == NULL) {
-      goto error;
+  // 先頭以外はスレッドを作成し、このスレッドでも試行を行う
+  for (i = 1; i < threads; i++) {
+    workers[i].running = (pthread_create(&workers[i].thread, NULL, run_trials, &workers[i]) == 0);
+  }
+  run_trials(&workers[0]);
+  for (i = 0; i < threads; i++) {
+    if (workers[i].running) {
+      pthread_join(workers[i].thread, NULL);
+    }
+    if (workers[i].best < 0) {
+      continue;
+    }
+    if (winner == NULL || workers[i].mem.size < winner->mem.size
+        || (workers[i].mem.size == winner->mem.size && workers[i].best < winner->best)) {
+      winner = &workers[i];
     }
   }
-  switch (img->color_type) {
-    case COLOR_TYPE_INDEX:  // インデックスカラー
-      palette = png_malloc(png, sizeof(png_color) * img->palette_num);
-      for (i = 0; i < img->palette_num; i++) {
-        palette[i].red = img->palette[i].r;
-        palette[i].green = img->palette[i].g;
-        palette[i].blue = img->palette[i].b;
-      }
-      png_set_PLTE(png, info, palette, img->palette_num);
-      for (i = img->palette_num - 1; i >= 0 && img->palette[i].a != 0xff; i--);
-      if (i >= 0) {
-        int num_trans = i + 1;
-        png_byte trans[255];
-        for (i = 0; i < num_trans; i++) {
-          trans[i] = img->palette[i].a;
-        }
-        png_set_tRNS(png, info, trans, num_trans, NULL);
-      }
-      png_free(png, palette);
-      for (y = 0; y < img->height; y++) {
-        row = rows[y];
-        for (x = 0; x < img->width; x++) {
-          *row++ = img->map[y][x].i;
-        }
-      }
-      break;
-    case COLOR_TYPE_GRAY:  // グレースケール
-      for (y = 0; y < img->height; y++) {
-        row = rows[y];
-        for (x = 0; x < img->width; x++) {
-          *row++ = img->map[y][x].g;
-        }
-      }
-      break;
-    case COLOR_TYPE_RGB:  // RGB
-      for (y = 0; y < img->height; y++) {
-        row = rows[y];
-        for (x = 0; x < img->width; x++) {
-          *row++ = img->map[y][x].c.r;
-          *row++ = img->map[y][x].c.g;
-          *row++ = img->map[y][x].c.b;
-        }
-      }
-      break;
-    case COLOR_TYPE_RGBA:  // RGBA
-      for (y = 0; y < img->height; y++) {
-        row = rows[y];
-        for (x = 0; x < img->width; x++) {
-          *row++ = img->map[y][x].c.r;
-          *row++ = img->map[y][x].c.g;
-          *row++ = img->map[y][x].c.b;
-          *row++ = img->map[y][x].c.a;
-        }
-      }
-      break;
+  if (winner == NULL) {
+    goto error;
+  }
+  if (fwrite(winner->mem.data, winner->mem.size, 1, fp) != 1) {
+    goto error;
+  }
+  if (best != NULL) {
+    *best = o.trials[winner->best];
   }
-  png_write_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
   result = SUCCESS;
   error:
-  if (rows != NULL) {
-    for (y = 0; y < img->height; y++) {
-      png_free(png, rows[y]);
+  if (workers != NULL) {
+    for (i = 0; i < threads; i++) {
+      free(workers[i].mem.data);
     }
-    png_free(png, rows);
+    free(workers);
   }
-  png_destroy_write_struct(&png, &info);
+  free(o.trials);
   return result;
 }
+
+/**
+ * @brief 逐次デコードの状態
+ */
+struct png_decoder_t {
+  png_structp png;             /**< png_struct */
+  png_infop info;              /**< png_info */
+  image_t *img;                /**< デコード中の画像 */
+  png_bytep row;               /**< 1byte/画素の形式の行を合成するための作業用バッファ */
+  int done;                    /**< 画像の終端まで到達したか否か */
+  png_row_callback_t callback; /**< 行が更新された時のコールバック */
+  void *user;                  /**< コールバックに渡すポインタ */
+};
+
+/**
+ * @brief ヘッダを読み込んだ時のlibpngからのコールバック
+ *
+ * 変換を設定して画像を確保する。
+ *
+ * @param[in] png  png_struct
+ * @param[in] info png_info
+ */
+static void decoder_info_callback(png_structp png, png_infop info) {
+  png_decoder_t *dec = png_get_progressive_ptr(png);
+  int color_type;
+  if ((color_type = set_read_transform(png, info, TRUE)) < 0) {
+    png_error(png, "unsupported color type");
+  }
+  png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+  dec->img = allocate_image(png_get_image_width(png, info),
+      png_get_image_height(png, info), color_type);
+  if (dec->img == NULL) {
+    png_error(png, "out of memory");
+  }
+  if (color_type == COLOR_TYPE_INDEX) {
+    read_palette(png, info, dec->img);
+  }
+  if (color_type == COLOR_TYPE_INDEX || color_type == COLOR_TYPE_GRAY) {
+    if ((dec->row = png_malloc(png, dec->img->width)) == NULL) {
+      png_error(png, "out of memory");
+    }
+  }
+}
+
+/**
+ * @brief 1行デコードした時のlibpngからのコールバック
+ *
+ * インターレース画像の場合、libpngは各パスの画素をそのパスで埋まる矩形に引き伸ばして渡すため、
+ * これを合成することで途中のパスでもプレビューとして使える画像になる。
+ * 1byte/画素の形式は一旦PNGのレイアウトに詰め直して合成する。
+ *
+ * @param[in] png     png_struct
+ * @param[in] new_row デコードした行、このパスで更新されない行の場合NULL
+ * @param[in] y       行番号
+ * @param[in] pass    インターレースのパス
+ */
+static void decoder_row_callback(png_structp png, png_bytep new_row, png_uint_32 y, int pass) {
+  png_decoder_t *dec = png_get_progressive_ptr(png);
+  image_t *img = dec->img;
+  if (new_row == NULL || y >= img->height) {
+    return;
+  }
+  if (dec->row == NULL) {
+    png_progressive_combine_row(png, (png_bytep) img->map[y], new_row);
+  } else if (png_get_interlace_type(png, dec->info) == PNG_INTERLACE_NONE) {
+    unpack_row(img->map[y], new_row, img->width, 1, img->color_type);
+  } else {
+    pack_row(dec->row, img->map[y], img->width, img->color_type, NULL);
+    png_progressive_combine_row(png, dec->row, new_row);
+    unpack_row(img->map[y], dec->row, img->width, 1, img->color_type);
+  }
+  if (dec->callback != NULL) {
+    dec->callback(dec->user, img, y, pass);
+  }
+}
+
+/**
+ * @brief 画像の終端まで読み込んだ時のlibpngからのコールバック
+ *
+ * @param[in] png  png_struct
+ * @param[in] info png_info
+ */
+static void decoder_end_callback(png_structp png, png_infop info) {
+  png_decoder_t *dec = png_get_progressive_ptr(png);
+  dec->done = TRUE;
+}
+
+/**
+ * @brief PNG形式の逐次デコーダを作成する。
+ *
+ * ファイル全体が揃うのを待たず、受信したデータから順にデコードするためのもの。
+ * feed_png_decoder()でデータを渡すと、行が確定するごとにコールバックが呼ばれる。
+ * インターレース画像の場合は各パスごとに粗いプレビューとして全行が更新される。
+ *
+ * @param[in] callback 行が更新された時のコールバック、不要な場合NULL
+ * @param[in] user     コールバックに渡すポインタ
+ * @return 作成したデコーダ、失敗した場合NULL
+ */
+png_decoder_t *create_png_decoder(png_row_callback_t callback, void *user) {
+  png_decoder_t *dec;
+  if ((dec = calloc(1, sizeof(png_decoder_t))) == NULL) {
+    return NULL;
+  }
+  dec->callback = callback;
+  dec->user = user;
+  dec->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (dec->png == NULL) {
+    goto error;
+  }
+  dec->info = png_create_info_struct(dec->png);
+  if (dec->info == NULL) {
+    goto error;
+  }
+  png_set_progressive_read_fn(dec->png, dec,
+      decoder_info_callback, decoder_row_callback, decoder_end_callback);
+  return dec;
+  error:
+  free_png_decoder(dec);
+  return NULL;
+}
+
+/**
+ * @brief 逐次デコーダにデータを渡す。
+ *
+ * データは任意の位置で分割されていてよい。
+ * デコードできた行についてはこの中でコールバックが呼ばれる。
+ * 一度失敗したデコーダにはそれ以上データを渡すことはできない。
+ *
+ * @param[in,out] dec  デコーダ
+ * @param[in]     data PNGファイルのデータの続き
+ * @param[in]     size データのサイズ
+ * @return 成否
+ */
+result_t feed_png_decoder(png_decoder_t *dec, const uint8_t *data, size_t size) {
+  if (dec == NULL || dec->png == NULL) {
+    return FAILURE;
+  }
+  if (setjmp(png_jmpbuf(dec->png))) {
+    png_free(dec->png, dec->row);
+    dec->row = NULL;
+    png_destroy_read_struct(&dec->png, &dec->info, NULL);
+    return FAILURE;
+  }
+  png_process_data(dec->png, dec->info, (png_bytep) data, size);
+  return SUCCESS;
+}
+
+/**
+ * @brief 逐次デコードを終了し、デコードした画像を取り出す。
+ *
+ * デコーダはこの中で開放される。
+ *
+ * @param[in] dec デコーダ
+ * @return デコードした画像、画像の終端まで到達していない場合NULL
+ */
+image_t *finish_png_decoder(png_decoder_t *dec) {
+  image_t *img = NULL;
+  if (dec == NULL) {
+    return NULL;
+  }
+  if (dec->done && dec->png != NULL) {
+    img = dec->img;
+    dec->img = NULL;
+  }
+  free_png_decoder(dec);
+  return img;
+}
+
+/**
+ * @brief 逐次デコーダを開放する。
+ *
+ * デコード中の画像も開放される。
+ *
+ * @param[in] dec デコーダ
+ */
+void free_png_decoder(png_decoder_t *dec) {
+  if (dec == NULL) {
+    return;
+  }
+  if (dec->png != NULL) {
+    png_free(dec->png, dec->row);
+    png_destroy_read_struct(&dec->png, &dec->info, NULL);
+  }
+  free_image(dec->img);
+  free(dec);
+}
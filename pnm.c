@@ -15,33 +15,101 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <ctype.h>
 #include "image.h"
+#include "stream.h"
 
 /**
  * @brief 2値の最小値を返すマクロ
  */
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
+#define WRITE_BUFFER_SIZE (64 * 1024) /**< ASCII形式の書き出しバッファのサイズ */
+#define P1_LINE_LENGTH 69             /**< P1の1行の最大文字数、改行を含めて70文字以内とする */
+
+#define CHAR_SPACE 1 /**< 文字種別：空白文字 */
+#define CHAR_DIGIT 2 /**< 文字種別：数字 */
+
+/**
+ * @brief 文字種別の変換表
+ *
+ * isspace()/isdigit()はロケールを参照するため、1文字ごとに呼ぶと遅い。
+ * 空白文字はCロケールのisspace()と同じものとする。
+ */
+static const uint8_t CHAR_CLASS[256] = {
+  ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\v'] = CHAR_SPACE,
+  ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE, [' '] = CHAR_SPACE,
+  ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT, ['3'] = CHAR_DIGIT,
+  ['4'] = CHAR_DIGIT, ['5'] = CHAR_DIGIT, ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT,
+  ['8'] = CHAR_DIGIT, ['9'] = CHAR_DIGIT,
+};
+
+/**
+ * @brief 00～99の2桁の文字列の変換表
+ */
+static const char DIGIT_PAIRS[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/**
+ * @brief ASCII形式を読み込むための読み込み
+ *
+ * メモリ上のデータはストリームを介さずに直接走査する。
+ * ファイルストリームはロックした上でgetc_unlocked()を使い、stdioのバッファから直接読み込む。
+ * 自前のバッファに先読みしないため、連結された画像の次の画像やバイナリ形式の画像データを
+ * 読み込み済みにしてしまうことはない。
+ */
+typedef struct pnm_reader_t {
+  stream_t *s;        /**< ストリーム */
+  const uint8_t *cur; /**< メモリ上のデータの次に読み込む位置 */
+  const uint8_t *end; /**< メモリ上のデータの終端 */
+} pnm_reader_t;
+
+/**
+ * @brief ASCII形式を書き出すためのバッファ付きの書き出し
+ */
+typedef struct pnm_writer_t {
+  stream_t *s;  /**< ストリーム */
+  char *buffer; /**< 書き出しバッファ */
+  char *cur;    /**< 次に書き出す位置 */
+  char *end;    /**< バッファの終端 */
+} pnm_writer_t;
+
 static uint8_t normalize(int value, int max);
-static int get_next_non_space_char(FILE *fp);
-static int get_next_token(FILE *fp, char *buf, size_t size);
-static int parse_int(const char *str);
-static int get_next_int(FILE *fp);
-
-static result_t read_p1(FILE *fp, image_t *img);
-static result_t read_p2(FILE *fp, image_t *img, int max);
-static result_t read_p3(FILE *fp, image_t *img, int max);
-static result_t read_p4(FILE *fp, image_t *img);
-static result_t read_p5(FILE *fp, image_t *img, int max);
-static result_t read_p6(FILE *fp, image_t *img, int max);
-
-static result_t write_p1(FILE *fp, image_t *img);
-static result_t write_p2(FILE *fp, image_t *img);
-static result_t write_p3(FILE *fp, image_t *img);
-static result_t write_p4(FILE *fp, image_t *img);
-static result_t write_p5(FILE *fp, image_t *img);
-static result_t write_p6(FILE *fp, image_t *img);
+static void init_reader(pnm_reader_t *r, stream_t *s);
+static void finish_reader(pnm_reader_t *r);
+static int read_char(pnm_reader_t *r);
+static int get_next_non_space_char(pnm_reader_t *r);
+static int get_next_token(pnm_reader_t *r, char *buf, size_t size);
+static int get_next_int(pnm_reader_t *r);
+
+static result_t init_writer(pnm_writer_t *w, stream_t *s);
+static result_t flush_writer(pnm_writer_t *w);
+static result_t reserve_writer(pnm_writer_t *w, size_t size);
+static char *format_uint8(char *p, uint8_t value);
+
+static result_t read_p1(stream_t *s, image_t *img);
+static result_t read_p2(stream_t *s, image_t *img, int max);
+static result_t read_p3(stream_t *s, image_t *img, int max);
+static result_t read_p4(stream_t *s, image_t *img);
+static result_t read_p5(stream_t *s, image_t *img, int max);
+static result_t read_p6(stream_t *s, image_t *img, int max);
+static image_t *read_pnm(stream_t *s);
+
+static result_t write_p1(pnm_writer_t *w, image_t *img);
+static result_t write_p2(pnm_writer_t *w, image_t *img);
+static result_t write_p3(pnm_writer_t *w, image_t *img);
+static result_t write_p4(stream_t *s, image_t *img);
+static result_t write_p5(stream_t *s, image_t *img);
+static result_t write_p6(stream_t *s, image_t *img);
+static result_t write_pnm(stream_t *s, image_t *img, int type);
 
 /**
  * @brief [0,max]の値を[0,255]の範囲に正規化する
@@ -52,43 +120,101 @@ static uint8_t normalize(int value, int max) {
 }
 
 /**
- * @brief 次のトークンをintにパースしたものを返す。
+ * @brief 読み込みを開始する。
  *
- * 次のトークンがない、
- * トークンに数字以外が含まれる場合、
- * エラーとして-1を返す
+ * ファイルストリームの場合はfinish_reader()までロックする。
  *
- * @return 次の整数値、エラー時-1
+ * @param[out] r 読み込み
+ * @param[in]  s ストリーム
  */
-static int get_next_int(FILE *fp) {
-  char token[11];
-  get_next_token(fp, token, sizeof(token));
-  return parse_int(token);
+static void init_reader(pnm_reader_t *r, stream_t *s) {
+  r->s = s;
+  if (s->fp != NULL) {
+    r->cur = NULL;
+    r->end = NULL;
+    flockfile(s->fp);
+    return;
+  }
+  r->cur = s->data + MIN(s->offset, s->size);
+  r->end = s->data + s->size;
 }
 
 /**
- * @brief atoiのエラー判定を厳しくした処理。
+ * @brief 読み込みを終了し、読み込んだ位置をストリームに反映する。
  *
- * 空の場合、数字以外の文字が含まれる場合に
- * エラーとして-1を返す。
+ * @param[in,out] r 読み込み
+ */
+static void finish_reader(pnm_reader_t *r) {
+  if (r->s->fp != NULL) {
+    funlockfile(r->s->fp);
+    return;
+  }
+  r->s->offset = r->cur - r->s->data;
+}
+
+/**
+ * @brief 1byte読み込む。
  *
- * @param[in] str 読み込む文字列
- * return パース結果
+ * @param[in,out] r 読み込み
+ * @return 読み込んだ値、終端に到達した場合EOF
  */
-static int parse_int(const char *str) {
-  int i;
-  int r = 0;
-  if (str[0] == 0) {
-    return -1;
+static int read_char(pnm_reader_t *r) {
+  int c;
+  if (r->cur < r->end) {
+    return *r->cur++;
+  }
+  if (r->s->fp == NULL) {
+    return EOF;
   }
-  for (i = 0; str[i] != 0; i++) {
-    if (!isdigit((int)str[i])) {
+  if ((c = getc_unlocked(r->s->fp)) != EOF) {
+    r->s->offset++;
+  }
+  return c;
+}
+
+/**
+ * @brief 次のトークンをintにパースしたものを返す。
+ *
+ * 次のトークンがない、
+ * トークンに数字以外が含まれる、
+ * トークンが10桁を超えるかintの範囲を超える場合、
+ * エラーとして-1を返す。
+ * トークンの末尾の空白は読み込み済みとなる。
+ *
+ * @param[in,out] r 読み込み
+ * @return 次の整数値、エラー時-1
+ */
+static int get_next_int(pnm_reader_t *r) {
+  int64_t value = 0;
+  int digits = 0;
+  int c;
+  const uint8_t *p = r->cur;
+  // メモリ上で空白と数字と空白が続く場合は1文字ずつread_char()を介さずに読む
+  while (p < r->end && CHAR_CLASS[*p] == CHAR_SPACE) {
+    p++;
+  }
+  while (p < r->end && CHAR_CLASS[*p] == CHAR_DIGIT && digits < 10) {
+    value = value * 10 + (*p++ - '0');
+    digits++;
+  }
+  if (digits != 0 && p < r->end && CHAR_CLASS[*p] == CHAR_SPACE && value <= INT32_MAX) {
+    r->cur = p + 1;
+    return value;
+  }
+  // コメントや終端を含む場合は先頭から読み直す
+  value = 0;
+  digits = 0;
+  c = get_next_non_space_char(r);
+  for (; c != EOF && CHAR_CLASS[c] != CHAR_SPACE; c = read_char(r)) {
+    if (CHAR_CLASS[c] != CHAR_DIGIT || ++digits > 10) {
       return -1;
     }
-    r *= 10;
-    r += str[i] - '0';
+    value = value * 10 + (c - '0');
+  }
+  if (digits == 0 || value > INT32_MAX) {
+    return -1;
   }
-  return r;
+  return value;
 }
 
 /**
@@ -97,17 +223,17 @@ static int parse_int(const char *str) {
  * 空白とコメントを読み飛ばす。
  * トークンの末尾の空白は読み込み済みとなる。
  *
- * @param[in]     fp   ファイルストリーム
+ * @param[in,out] r    読み込み
  * @param[in,out] buf  トークン格納先
  * @param[in]     size トークン格納先のサイズ
  * @return トークンのサイズ、エラー時0
  */
-static int get_next_token(FILE *fp, char *buf, size_t size) {
+static int get_next_token(pnm_reader_t *r, char *buf, size_t size) {
   int i = 0;
-  int c = get_next_non_space_char(fp);
-  while (c != EOF && !isspace(c) && i < size - 1) {
+  int c = get_next_non_space_char(r);
+  while (c != EOF && CHAR_CLASS[c] != CHAR_SPACE && i < size - 1) {
     buf[i++] = c;
-    c = getc(fp);
+    c = read_char(r);
   }
   buf[i] = 0;
   return i;
@@ -116,13 +242,13 @@ static int get_next_token(FILE *fp, char *buf, size_t size) {
 /**
  * @brief 空白文字とコメントを読み飛ばした次の文字を返す。
  *
- * @param[in] fp ファイルストリーム
+ * @param[in,out] r 読み込み
  * @return 次の文字、EOFに到達した場合はEOF
  */
-static int get_next_non_space_char(FILE *fp) {
+static int get_next_non_space_char(pnm_reader_t *r) {
   int c;
   int comment = FALSE;
-  while ((c = getc(fp)) != EOF) {
+  while ((c = read_char(r)) != EOF) {
     if (comment) {
       if (c == '\n' || c == '\r') {
         comment = FALSE;
@@ -133,13 +259,80 @@ static int get_next_non_space_char(FILE *fp) {
       comment = TRUE;
       continue;
     }
-    if (!isspace(c)) {
+    if (CHAR_CLASS[c] != CHAR_SPACE) {
       break;
     }
   }
   return c;
 }
 
+/**
+ * @brief 書き出しを初期化する。
+ *
+ * @param[out] w 書き出し
+ * @param[in]  s ストリーム
+ * @return 成否
+ */
+static result_t init_writer(pnm_writer_t *w, stream_t *s) {
+  w->s = s;
+  if ((w->buffer = malloc(WRITE_BUFFER_SIZE)) == NULL) {
+    return FAILURE;
+  }
+  w->cur = w->buffer;
+  w->end = w->buffer + WRITE_BUFFER_SIZE;
+  return SUCCESS;
+}
+
+/**
+ * @brief バッファにたまったデータをストリームに書き出す。
+ *
+ * @param[in,out] w 書き出し
+ * @return 成否
+ */
+static result_t flush_writer(pnm_writer_t *w) {
+  result_t result = stream_write(w->s, w->buffer, w->cur - w->buffer);
+  w->cur = w->buffer;
+  return result;
+}
+
+/**
+ * @brief バッファに指定したサイズの空きを確保する。
+ *
+ * @param[in,out] w    書き出し
+ * @param[in]     size 必要な空き、WRITE_BUFFER_SIZE以下であること
+ * @return 成否
+ */
+static result_t reserve_writer(pnm_writer_t *w, size_t size) {
+  if (w->end - w->cur >= size) {
+    return SUCCESS;
+  }
+  return flush_writer(w);
+}
+
+/**
+ * @brief 8bitの値を10進数の文字列にする。
+ *
+ * 下2桁は2桁ずつの変換表から取り出す。
+ *
+ * @param[out] p     書き出し先、3byte以上の空きがあること
+ * @param[in]  value 値
+ * @return 書き出した文字列の次の位置
+ */
+static char *format_uint8(char *p, uint8_t value) {
+  if (value >= 100) {
+    *p++ = '0' + value / 100;
+    value %= 100;
+    memcpy(p, &DIGIT_PAIRS[value * 2], 2);
+    return p + 2;
+  }
+  if (value >= 10) {
+    memcpy(p, &DIGIT_PAIRS[value * 2], 2);
+    return p + 2;
+  }
+  *p++ = '0' + value;
+  return p;
+}
+
 /**
  * @brief PNM(PPM/PGM/PBM)形式のファイルを読み込む。
  *
@@ -160,89 +353,107 @@ image_t *read_pnm_file(const char *filename) {
 /**
  * @brief P1の画像データを読み込む。
  *
- * @param[in]     fp  ファイルストリーム
+ * @param[in]     s   ストリーム
  * @param[in,out] img 画像構造体
  * @return 成否
  */
-static result_t read_p1(FILE *fp, image_t *img) {
+static result_t read_p1(stream_t *s, image_t *img) {
+  result_t result = FAILURE;
   int x, y;
   int tmp;
+  pnm_reader_t r;
+  init_reader(&r, s);
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      tmp = get_next_non_space_char(fp);
+      tmp = get_next_non_space_char(&r);
       if (tmp == '0') {
         img->map[y][x].i = 0;
       } else if (tmp == '1') {
         img->map[y][x].i = 1;
       } else {
-        return FAILURE;
+        goto error;
       }
     }
   }
-  return SUCCESS;
+  result = SUCCESS;
+  error:
+  finish_reader(&r);
+  return result;
 }
 
 /**
  * @brief P2の画像データを読み込む。
  *
- * @param[in]     fp  ファイルストリーム
+ * @param[in]     s   ストリーム
  * @param[in,out] img 画像構造体
  * @param[in]     max 輝度最大値
  * @return 成否
  */
-static result_t read_p2(FILE *fp, image_t *img, int max) {
+static result_t read_p2(stream_t *s, image_t *img, int max) {
+  result_t result = FAILURE;
   int x, y;
   int tmp;
+  pnm_reader_t r;
+  init_reader(&r, s);
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      if ((tmp = get_next_int(fp)) < 0) {
-        return FAILURE;
+      if ((tmp = get_next_int(&r)) < 0) {
+        goto error;
       }
       img->map[y][x].g = normalize(tmp, max);
     }
   }
-  return SUCCESS;
+  result = SUCCESS;
+  error:
+  finish_reader(&r);
+  return result;
 }
 
 /**
  * @brief P3の画像データを読み込む。
  *
- * @param[in]     fp  ファイルストリーム
+ * @param[in]     s   ストリーム
  * @param[in,out] img 画像構造体
  * @param[in]     max 輝度最大値
  * @return 成否
  */
-static result_t read_p3(FILE *fp, image_t *img, int max) {
+static result_t read_p3(stream_t *s, image_t *img, int max) {
+  result_t result = FAILURE;
   int x, y;
   int tmp;
+  pnm_reader_t r;
+  init_reader(&r, s);
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      if ((tmp = get_next_int(fp)) < 0) {
-        return FAILURE;
+      if ((tmp = get_next_int(&r)) < 0) {
+        goto error;
       }
       img->map[y][x].c.r = normalize(tmp, max);
-      if ((tmp = get_next_int(fp)) < 0) {
-        return FAILURE;
+      if ((tmp = get_next_int(&r)) < 0) {
+        goto error;
       }
       img->map[y][x].c.g = normalize(tmp, max);
-      if ((tmp = get_next_int(fp)) < 0) {
-        return FAILURE;
+      if ((tmp = get_next_int(&r)) < 0) {
+        goto error;
       }
       img->map[y][x].c.b = normalize(tmp, max);
       img->map[y][x].c.a = 0xff;
     }
   }
-  return SUCCESS;
+  result = SUCCESS;
+  error:
+  finish_reader(&r);
+  return result;
 }
 
 /**
  * @brief P4の画像データを読み込む。
  *
- * @param[in]     fp  ファイルストリーム
+ * @param[in]     s   ストリーム
  * @param[in,out] img 画像構造体
  * @return 成否
  */
-static result_t read_p4(FILE *fp, image_t *img) {
+static result_t read_p4(stream_t *s, image_t *img) {
   int x, y;
   uint8_t *row;
   int stride;
@@ -253,7 +464,7 @@ static result_t read_p4(FILE *fp, image_t *img) {
   for (y = 0; y < img->height; y++) {
     int pos = 0;
     int shift = 8;
-    if (fread(row, stride, 1, fp) != 1) {
+    if (stream_read(s, row, stride) != SUCCESS) {
       free(row);
       return FAILURE;
     }
@@ -273,12 +484,12 @@ static result_t read_p4(FILE *fp, image_t *img) {
 /**
  * @brief P5の画像データを読み込む。
  *
- * @param[in]     fp  ファイルストリーム
+ * @param[in]     s   ストリーム
  * @param[in,out] img 画像構造体
  * @param[in]     max 輝度最大値
  * @return 成否
  */
-static result_t read_p5(FILE *fp, image_t *img, int max) {
+static result_t read_p5(stream_t *s, image_t *img, int max) {
   int x, y;
   int tmp;
   uint8_t *row;
@@ -290,7 +501,7 @@ static result_t read_p5(FILE *fp, image_t *img, int max) {
     return FAILURE;
   }
   for (y = 0; y < img->height; y++) {
-    if (fread(buffer, stride, 1, fp) != 1) {
+    if (stream_read(s, buffer, stride) != SUCCESS) {
       free(buffer);
       return FAILURE;
     }
@@ -314,12 +525,12 @@ static result_t read_p5(FILE *fp, image_t *img, int max) {
 /**
  * @brief P6の画像データを読み込む。
  *
- * @param[in]     fp  ファイルストリーム
+ * @param[in]     s   ストリーム
  * @param[in,out] img 画像構造体
  * @param[in]     max 輝度最大値
  * @return 成否
  */
-static result_t read_p6(FILE *fp, image_t *img, int max) {
+static result_t read_p6(stream_t *s, image_t *img, int max) {
   int x, y;
   int tmp;
   uint8_t *row;
@@ -331,7 +542,7 @@ static result_t read_p6(FILE *fp, image_t *img, int max) {
     return FAILURE;
   }
   for (y = 0; y < img->height; y++) {
-    if (fread(buffer, stride, 1, fp) != 1) {
+    if (stream_read(s, buffer, stride) != SUCCESS) {
       free(buffer);
       return FAILURE;
     }
@@ -369,6 +580,31 @@ static result_t read_p6(FILE *fp, image_t *img, int max) {
  * @return 読み込んだ画像、読み込みに失敗した場合NULL
  */
 image_t *read_pnm_stream(FILE *fp) {
+  stream_t s;
+  stream_init_file(&s, fp);
+  return read_pnm(&s);
+}
+
+/**
+ * @brief メモリ上のPNM(PPM/PGM/PBM)形式のデータを読み込む。
+ *
+ * @param[in] data PNM形式のデータ
+ * @param[in] size データのサイズ
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+image_t *read_pnm_memory(const uint8_t *data, size_t size) {
+  stream_t s;
+  stream_init_memory(&s, data, size);
+  return read_pnm(&s);
+}
+
+/**
+ * @brief PNM(PPM/PGM/PBM)形式の画像を読み込む。
+ *
+ * @param[in] s ストリーム
+ * @return 読み込んだ画像、読み込みに失敗した場合NULL
+ */
+static image_t *read_pnm(stream_t *s) {
   char token[4];
   int type;
   int width;
@@ -376,19 +612,24 @@ image_t *read_pnm_stream(FILE *fp) {
   int max = 0;
   result_t result = FAILURE;
   image_t *img = NULL;
+  pnm_reader_t r;
+  init_reader(&r, s);
   memset(token, 0, sizeof(token));
-  get_next_token(fp, token, sizeof(token));
+  get_next_token(&r, token, sizeof(token));
   type = token[1] - '0';
+  width = get_next_int(&r);
+  height = get_next_int(&r);
+  if (type != 1 && type != 4) {
+    max = get_next_int(&r);
+  }
+  finish_reader(&r);
   if (token[0] != 'P' || type < 1 || type > 6 || token[2] != 0) {
     return NULL;
   }
-  width = get_next_int(fp);
-  height = get_next_int(fp);
   if (width <= 0 || height <= 0) {
     return NULL;
   }
   if (type != 1 && type != 4) {
-    max = get_next_int(fp);
     if (max < 1 || max > 65535) {
       return NULL;
     }
@@ -419,22 +660,22 @@ image_t *read_pnm_stream(FILE *fp) {
   }
   switch (type) {
     case 1:  // ASCII 2値
-      result = read_p1(fp, img);
+      result = read_p1(s, img);
       break;
     case 2:  // ASCII グレースケール
-      result = read_p2(fp, img, max);
+      result = read_p2(s, img, max);
       break;
     case 3:  // ASCII RGB
-      result = read_p3(fp, img, max);
+      result = read_p3(s, img, max);
       break;
     case 4:  // バイナリ 2値
-      result = read_p4(fp, img);
+      result = read_p4(s, img);
       break;
     case 5:  // バイナリ グレースケール
-      result = read_p5(fp, img, max);
+      result = read_p5(s, img, max);
       break;
     case 6:  // バイナリ RGB
-      result = read_p6(fp, img, max);
+      result = read_p6(s, img, max);
       break;
   }
   if (result != SUCCESS) {
@@ -466,78 +707,94 @@ result_t write_pnm_file(const char *filename, image_t *img, int type) {
     return result;
   }
   result = write_pnm_stream(fp, img, type);
-  fclose(fp);
+  // バッファに残ったデータの書き出しに失敗した場合も失敗とする
+  if (fclose(fp) != 0) {
+    result = FAILURE;
+  }
   return result;
 }
 
 /**
- * @brief P1の画像データを読み込む。
+ * @brief P1の画像データを書き出す。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
- * @param[in] img 画像データ
+ * 1行は改行を含めて70文字以内とする。
+ *
+ * @param[in,out] w   書き出し
+ * @param[in]     img 画像データ
  * @return 成否
  */
-static result_t write_p1(FILE *fp, image_t *img) {
+static result_t write_p1(pnm_writer_t *w, image_t *img) {
   int x, y;
+  int i, n;
   for (y = 0; y < img->height; y++) {
-    int line = 0;
-    for (x = 0; x < img->width; x++) {
-      if(++line > 69) {
-        putc('\n', fp);
-        line = 1;
+    for (x = 0; x < img->width; x += n) {
+      n = MIN(img->width - x, P1_LINE_LENGTH);
+      if (reserve_writer(w, n + 1) != SUCCESS) {
+        return FAILURE;
+      }
+      for (i = 0; i < n; i++) {
+        *w->cur++ = '0' + img->map[y][x + i].i;
       }
-      putc('0' + img->map[y][x].i, fp);
+      *w->cur++ = '\n';
     }
-    putc('\n', fp);
   }
-  return SUCCESS;
+  return flush_writer(w);
 }
 
 /**
- * @brief P2の画像データを読み込む。
+ * @brief P2の画像データを書き出す。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
- * @param[in] img 画像データ
+ * @param[in,out] w   書き出し
+ * @param[in]     img 画像データ
  * @return 成否
  */
-static result_t write_p2(FILE *fp, image_t *img) {
+static result_t write_p2(pnm_writer_t *w, image_t *img) {
   int x, y;
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      fprintf(fp, "%u\n", img->map[y][x].g);
+      if (reserve_writer(w, 4) != SUCCESS) {
+        return FAILURE;
+      }
+      w->cur = format_uint8(w->cur, img->map[y][x].g);
+      *w->cur++ = '\n';
     }
   }
-  return SUCCESS;
+  return flush_writer(w);
 }
 
 /**
- * @brief P3の画像データを読み込む。
+ * @brief P3の画像データを書き出す。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
- * @param[in] img 画像データ
+ * @param[in,out] w   書き出し
+ * @param[in]     img 画像データ
  * @return 成否
  */
-static result_t write_p3(FILE *fp, image_t *img) {
+static result_t write_p3(pnm_writer_t *w, image_t *img) {
   int x, y;
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      fprintf(fp, "%u %u %u\n",
-          img->map[y][x].c.r,
-          img->map[y][x].c.g,
-          img->map[y][x].c.b);
+      if (reserve_writer(w, 12) != SUCCESS) {
+        return FAILURE;
+      }
+      w->cur = format_uint8(w->cur, img->map[y][x].c.r);
+      *w->cur++ = ' ';
+      w->cur = format_uint8(w->cur, img->map[y][x].c.g);
+      *w->cur++ = ' ';
+      w->cur = format_uint8(w->cur, img->map[y][x].c.b);
+      *w->cur++ = '\n';
     }
   }
-  return SUCCESS;
+  return flush_writer(w);
 }
 
 /**
  * @brief P4の画像データを読み込む。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
+ * @param[in] s   ストリーム
  * @param[in] img 画像データ
  * @return 成否
  */
-static result_t write_p4(FILE *fp, image_t *img) {
+static result_t write_p4(stream_t *s, image_t *img) {
   int x, y;
   uint8_t p;
   for (y = 0; y < img->height; y++) {
@@ -548,53 +805,53 @@ static result_t write_p4(FILE *fp, image_t *img) {
       shift--;
       p |= img->map[y][x].i << shift;
       if (shift == 0) {
-        putc(p, fp);
+        stream_putc(s, p);
         shift = 8;
         p = 0;
       }
     }
     // 端があればここで出力
     if (shift != 8) {
-      putc(p, fp);
+      stream_putc(s, p);
     }
   }
-  return SUCCESS;
+  return s->error ? FAILURE : SUCCESS;
 }
 
 /**
  * @brief P5の画像データを読み込む。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
+ * @param[in] s   ストリーム
  * @param[in] img 画像データ
  * @return 成否
  */
-static result_t write_p5(FILE *fp, image_t *img) {
+static result_t write_p5(stream_t *s, image_t *img) {
   int x, y;
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      putc(img->map[y][x].g, fp);
+      stream_putc(s, img->map[y][x].g);
     }
   }
-  return SUCCESS;
+  return s->error ? FAILURE : SUCCESS;
 }
 
 /**
  * @brief P6の画像データを読み込む。
  *
- * @param[in] fp  書き出すファイルストリームのポインタ
+ * @param[in] s   ストリーム
  * @param[in] img 画像データ
  * @param 成否
  */
-static result_t write_p6(FILE *fp, image_t *img) {
+static result_t write_p6(stream_t *s, image_t *img) {
   int x, y;
   for (y = 0; y < img->height; y++) {
     for (x = 0; x < img->width; x++) {
-      putc(img->map[y][x].c.r, fp);
-      putc(img->map[y][x].c.g, fp);
-      putc(img->map[y][x].c.b, fp);
+      stream_putc(s, img->map[y][x].c.r);
+      stream_putc(s, img->map[y][x].c.g);
+      stream_putc(s, img->map[y][x].c.b);
     }
   }
-  return SUCCESS;
+  return s->error ? FAILURE : SUCCESS;
 }
 
 /**
@@ -609,10 +866,45 @@ static result_t write_p6(FILE *fp, image_t *img) {
  * @return 成否
  */
 result_t write_pnm_stream(FILE *fp, image_t *img, int type) {
+  stream_t s;
+  stream_init_file(&s, fp);
+  return write_pnm(&s, img, type);
+}
+
+/**
+ * @brief PNM(PPM/PGM/PBM)形式としてメモリ上に書き出す。
+ *
+ * 入力された画像データが出力タイプと合致しない場合、
+ * 内部で変換して出力を行う。
+ *
+ * @param[out] data 書き出したデータ、呼び出し側でfree()すること
+ * @param[out] size 書き出したデータのサイズ
+ * @param[in]  img  画像データ
+ * @param[in]  type 出力タイプ、1～6を指定
+ * @return 成否
+ */
+result_t write_pnm_memory(uint8_t **data, size_t *size, image_t *img, int type) {
+  stream_t s;
+  stream_init_buffer(&s);
+  return stream_take_buffer(&s, write_pnm(&s, img, type), data, size);
+}
+
+/**
+ * @brief PNM(PPM/PGM/PBM)形式として書き出す。
+ *
+ * @param[in] s    ストリーム
+ * @param[in] img  画像データ
+ * @param[in] type 出力タイプ、1～6を指定
+ * @return 成否
+ */
+static result_t write_pnm(stream_t *s, image_t *img, int type) {
+  result_t result = FAILURE;
   image_t *work = NULL;
+  pnm_writer_t w;
   if (img == NULL) {
     return FAILURE;
   }
+  memset(&w, 0, sizeof(w));
   if (type < 1 || type > 6) {
     return FAILURE;
   }
@@ -642,31 +934,41 @@ result_t write_pnm_stream(FILE *fp, image_t *img, int type) {
       break;
   }
   // ヘッダ出力、コメントなし
-  fprintf(fp, "P%d\n", type);
-  fprintf(fp, "%u %u\n", img->width, img->height);
+  if (stream_printf(s, "P%d\n", type) != SUCCESS
+      || stream_printf(s, "%u %u\n", img->width, img->height) != SUCCESS) {
+    goto error;
+  }
   if (type != 1 && type != 4) {
-    fprintf(fp, "255\n");
+    if (stream_printf(s, "255\n") != SUCCESS) {
+      goto error;
+    }
+  }
+  // ASCII形式は1画素ごとに書き出さず、バッファにためて書き出す
+  if (type <= 3 && init_writer(&w, s) != SUCCESS) {
+    goto error;
   }
   switch (type) {
     case 1:  // ASCII 2値
-      write_p1(fp, img);
+      result = write_p1(&w, img);
       break;
     case 2:  // ASCII グレースケール
-      write_p2(fp, img);
+      result = write_p2(&w, img);
       break;
     case 3:  // ASCII RGB
-      write_p3(fp, img);
+      result = write_p3(&w, img);
       break;
     case 4:  // バイナリ 2値
-      write_p4(fp, img);
+      result = write_p4(s, img);
       break;
     case 5:  // バイナリ グレースケール
-      write_p5(fp, img);
+      result = write_p5(s, img);
       break;
     case 6:  // バイナリ RGB
-      write_p6(fp, img);
+      result = write_p6(s, img);
       break;
   }
+  error:
+  free(w.buffer);
   free_image(work);
-  return SUCCESS;
+  return result;
 }
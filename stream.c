@@ -0,0 +1,279 @@
+/**
+ * @file stream.c
+ *
+ * Copyright (c) 2026 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief ファイルとメモリ上のバッファを同じように読み書きするための入出力
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2026/10/17
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include "stream.h"
+
+#define BUFFER_SIZE_MIN 4096 /**< 書き出し用のバッファの最小の容量 */
+
+/**
+ * @brief ファイルストリームを読み書きするストリームとして初期化する。
+ *
+ * @param[out] s  ストリーム
+ * @param[in]  fp ファイルストリーム
+ */
+void stream_init_file(stream_t *s, FILE *fp) {
+  memset(s, 0, sizeof(stream_t));
+  s->fp = fp;
+}
+
+/**
+ * @brief メモリ上のデータを読み込むストリームとして初期化する。
+ *
+ * データはコピーせずに参照するため、読み込みが終わるまで保持すること。
+ *
+ * @param[out] s    ストリーム
+ * @param[in]  data 読み込むデータ
+ * @param[in]  size データのサイズ
+ */
+void stream_init_memory(stream_t *s, const uint8_t *data, size_t size) {
+  memset(s, 0, sizeof(stream_t));
+  s->data = (uint8_t *) data;
+  s->size = size;
+}
+
+/**
+ * @brief メモリ上のバッファに書き出すストリームとして初期化する。
+ *
+ * バッファは書き出しに応じて確保し、stream_take_buffer()で受け取る。
+ *
+ * @param[out] s ストリーム
+ */
+void stream_init_buffer(stream_t *s) {
+  memset(s, 0, sizeof(stream_t));
+}
+
+/**
+ * @brief 書き出したバッファを受け取る。
+ *
+ * 書き出しに失敗していた場合はバッファを解放する。
+ *
+ * @param[in,out] s      stream_init_buffer()で初期化したストリーム
+ * @param[in]     result 書き出し処理の成否
+ * @param[out]    data   書き出したデータ、呼び出し側でfree()すること
+ * @param[out]    size   書き出したデータのサイズ
+ * @return 成否
+ */
+result_t stream_take_buffer(stream_t *s, result_t result, uint8_t **data, size_t *size) {
+  if (result != SUCCESS || s->error) {
+    free(s->data);
+    s->data = NULL;
+    return FAILURE;
+  }
+  *data = s->data;
+  *size = s->size;
+  s->data = NULL;
+  return SUCCESS;
+}
+
+/**
+ * @brief 指定したサイズのデータを読み込む。
+ *
+ * @param[in,out] s    ストリーム
+ * @param[out]    buf  読み込み先
+ * @param[in]     size 読み込むサイズ
+ * @return 全て読み込めた場合SUCCESS
+ */
+result_t stream_read(stream_t *s, void *buf, size_t size) {
+  if (s->fp != NULL) {
+    if (size != 0 && fread(buf, size, 1, s->fp) != 1) {
+      return FAILURE;
+    }
+    s->offset += size;
+    return SUCCESS;
+  }
+  if (s->offset > s->size || size > s->size - s->offset) {
+    return FAILURE;
+  }
+  memcpy(buf, s->data + s->offset, size);
+  s->offset += size;
+  return SUCCESS;
+}
+
+/**
+ * @brief 1バイト読み込む。
+ *
+ * @param[in,out] s ストリーム
+ * @return 読み込んだ値、終端に到達した場合EOF
+ */
+int stream_getc(stream_t *s) {
+  int c;
+  if (s->fp != NULL) {
+    if ((c = getc(s->fp)) != EOF) {
+      s->offset++;
+    }
+    return c;
+  }
+  if (s->offset >= s->size) {
+    return EOF;
+  }
+  return s->data[s->offset++];
+}
+
+/**
+ * @brief 指定した位置まで読み飛ばす。
+ *
+ * パイプなどシーク出来ないファイルストリームでも使えるよう、
+ * ファイルストリームの場合は読み込んで捨てる。後方へは移動できない。
+ *
+ * @param[in,out] s      ストリーム
+ * @param[in]     offset ストリームの先頭からの位置
+ * @return 成否
+ */
+result_t stream_skip_to(stream_t *s, size_t offset) {
+  uint8_t buf[256];
+  size_t size;
+  if (offset < s->offset) {
+    return FAILURE;
+  }
+  if (s->fp == NULL) {
+    if (offset > s->size) {
+      return FAILURE;
+    }
+    s->offset = offset;
+    return SUCCESS;
+  }
+  while (s->offset < offset) {
+    size = offset - s->offset;
+    if (size > sizeof(buf)) {
+      size = sizeof(buf);
+    }
+    if (stream_read(s, buf, size) != SUCCESS) {
+      return FAILURE;
+    }
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 書き出し用のバッファを必要な容量まで拡張する。
+ *
+ * @param[in,out] s    ストリーム
+ * @param[in]     size 必要な容量
+ * @return 成否
+ */
+static result_t reserve_buffer(stream_t *s, size_t size) {
+  size_t capacity;
+  uint8_t *p;
+  if (size <= s->capacity) {
+    return SUCCESS;
+  }
+  capacity = s->capacity * 2;
+  if (capacity < size) {
+    capacity = size;
+  }
+  if (capacity < BUFFER_SIZE_MIN) {
+    capacity = BUFFER_SIZE_MIN;
+  }
+  if ((p = realloc(s->data, capacity)) == NULL) {
+    s->error = TRUE;
+    return FAILURE;
+  }
+  s->data = p;
+  s->capacity = capacity;
+  return SUCCESS;
+}
+
+/**
+ * @brief データを書き出す。
+ *
+ * @param[in,out] s    ストリーム
+ * @param[in]     buf  書き出すデータ
+ * @param[in]     size 書き出すサイズ
+ * @return 成否
+ */
+result_t stream_write(stream_t *s, const void *buf, size_t size) {
+  if (s->fp != NULL) {
+    if (size != 0 && fwrite(buf, size, 1, s->fp) != 1) {
+      s->error = TRUE;
+      return FAILURE;
+    }
+    s->offset += size;
+    return SUCCESS;
+  }
+  if (reserve_buffer(s, s->offset + size) != SUCCESS) {
+    return FAILURE;
+  }
+  memcpy(s->data + s->offset, buf, size);
+  s->offset += size;
+  if (s->size < s->offset) {
+    s->size = s->offset;
+  }
+  return SUCCESS;
+}
+
+/**
+ * @brief 1バイト書き出す。
+ *
+ * @param[in,out] s ストリーム
+ * @param[in]     c 書き出す値
+ * @return 成否
+ */
+result_t stream_putc(stream_t *s, int c) {
+  uint8_t b = c;
+  if (s->fp != NULL) {
+    if (putc(c, s->fp) == EOF) {
+      s->error = TRUE;
+      return FAILURE;
+    }
+    s->offset++;
+    return SUCCESS;
+  }
+  return stream_write(s, &b, 1);
+}
+
+/**
+ * @brief 書式を指定して文字列を書き出す。
+ *
+ * @param[in,out] s      ストリーム
+ * @param[in]     format 書式
+ * @return 成否
+ */
+result_t stream_printf(stream_t *s, const char *format, ...) {
+  va_list args;
+  int length;
+  va_start(args, format);
+  if (s->fp != NULL) {
+    length = vfprintf(s->fp, format, args);
+    va_end(args);
+    if (length < 0) {
+      s->error = TRUE;
+      return FAILURE;
+    }
+    s->offset += length;
+    return SUCCESS;
+  }
+  // 長さを求めてからバッファを拡張し、バッファに直接書き出す
+  length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (length < 0) {
+    s->error = TRUE;
+    return FAILURE;
+  }
+  // vsnprintf()は終端文字も書き込むため、その分も確保する
+  if (reserve_buffer(s, s->offset + length + 1) != SUCCESS) {
+    return FAILURE;
+  }
+  va_start(args, format);
+  vsnprintf((char *) s->data + s->offset, length + 1, format, args);
+  va_end(args);
+  s->offset += length;
+  if (s->size < s->offset) {
+    s->size = s->offset;
+  }
+  return SUCCESS;
+}
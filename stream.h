@@ -0,0 +1,47 @@
+/**
+ * @file stream.h
+ *
+ * Copyright (c) 2026 大前良介 (OHMAE Ryosuke)
+ *
+ * This software is released under the MIT License.
+ * http://opensource.org/licenses/MIT
+ *
+ * @brief ファイルとメモリ上のバッファを同じように読み書きするための入出力
+ * @author <a href="mailto:ryo@mm2d.net">大前良介 (OHMAE Ryosuke)</a>
+ * @date 2026/10/17
+ */
+
+#ifndef STREAM_H_
+#define STREAM_H_
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "def.h"
+
+/**
+ * @brief 入出力ストリーム
+ *
+ * ファイルストリームか、メモリ上のバッファのいずれかを読み書きする。
+ * 書き出し用のバッファは必要に応じて拡張する。
+ */
+typedef struct stream_t {
+  FILE *fp;          /**< ファイルストリーム、メモリ上のバッファの場合NULL */
+  uint8_t *data;     /**< メモリ上のバッファ */
+  size_t size;       /**< バッファ上のデータのサイズ */
+  size_t capacity;   /**< 書き出し用に確保したバッファの容量 */
+  size_t offset;     /**< 次に読み書きする位置、ファイルストリームの場合は読み書きしたサイズ */
+  int error;         /**< 読み書きに失敗した場合TRUE */
+} stream_t;
+
+void stream_init_file(stream_t *s, FILE *fp);
+void stream_init_memory(stream_t *s, const uint8_t *data, size_t size);
+void stream_init_buffer(stream_t *s);
+result_t stream_take_buffer(stream_t *s, result_t result, uint8_t **data, size_t *size);
+result_t stream_read(stream_t *s, void *buf, size_t size);
+int stream_getc(stream_t *s);
+result_t stream_skip_to(stream_t *s, size_t offset);
+result_t stream_write(stream_t *s, const void *buf, size_t size);
+result_t stream_putc(stream_t *s, int c);
+result_t stream_printf(stream_t *s, const char *format, ...);
+
+#endif /* STREAM_H_ */